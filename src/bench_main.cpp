@@ -0,0 +1,638 @@
+//
+// bench_main.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <dirent.h>
+#include <unistd.h>
+#include "im_mailbox.h"
+#include "im_message.hpp"
+#include "im_message_publisher.h"
+#include "im_nickname_registry.h"
+#include "im_session.h"
+#include "logger.h"
+
+using boost::asio::ip::tcp;
+
+//----------------------------------------------------------------------
+// Allocation counting.
+//----------------------------------------------------------------------
+
+// Every allocation of the process goes through here, so each benchmark can
+// tell how many allocations an operation costs. Counted on every thread.
+// All the forms are replaced (array, nothrow and sized ones included), so 
+// nothing allocated here is ever released by the library's own delete.
+//
+static std::atomic<std::uint64_t> allocations_count( 0 );
+
+static void* counted_allocate( std::size_t size ) noexcept
+{
+  allocations_count.fetch_add( 1, std::memory_order_relaxed );
+  return std::malloc( size > 0 ? size : 1 );
+}
+
+// Kept out of line: once inlined into a delete expression, the compiler 
+// would see new'd memory going to free() and warn about the mismatch.
+//
+static void counted_release( void* pointer ) noexcept 
+  __attribute__(( noinline ));
+
+static void counted_release( void* pointer ) noexcept
+{
+  std::free( pointer );
+}
+
+void* operator new( std::size_t size )
+{
+  void* pointer = counted_allocate( size );
+  if ( pointer == nullptr )
+  {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void* operator new[]( std::size_t size )
+{
+  return operator new( size );
+}
+
+void* operator new( std::size_t size, const std::nothrow_t& ) noexcept
+{
+  return counted_allocate( size );
+}
+
+void* operator new[]( std::size_t size, const std::nothrow_t& ) noexcept
+{
+  return counted_allocate( size );
+}
+
+void operator delete( void* pointer ) noexcept
+{
+  counted_release( pointer );
+}
+
+void operator delete[]( void* pointer ) noexcept
+{
+  counted_release( pointer );
+}
+
+void operator delete( void* pointer, std::size_t ) noexcept
+{
+  counted_release( pointer );
+}
+
+void operator delete[]( void* pointer, std::size_t ) noexcept
+{
+  counted_release( pointer );
+}
+
+void operator delete( void* pointer, const std::nothrow_t& ) noexcept
+{
+  counted_release( pointer );
+}
+
+void operator delete[]( void* pointer, const std::nothrow_t& ) noexcept
+{
+  counted_release( pointer );
+}
+
+//----------------------------------------------------------------------
+// Harness.
+//----------------------------------------------------------------------
+
+// Results of benchmarked operations are added here, so the optimizer can't
+// drop the operations themselves.
+static volatile std::size_t bench_sink = 0;
+
+struct bench_result
+{
+  double ns_per_op;
+  double allocations_per_op;
+};
+
+// Runs "operation" (called with the iteration index) "iterations" times,
+// after a tenth of that as warm up unless "is_warmed_up" is false.
+//
+template <class Operation>
+static bench_result run_bench( std::size_t iterations, Operation operation,
+  bool is_warmed_up = true )
+{
+  for ( std::size_t i = 0; is_warmed_up && ( i < iterations / 10 ); ++i )
+  {
+    operation( i );
+  }
+
+  std::uint64_t first_allocations = allocations_count.load();
+  auto start = std::chrono::steady_clock::now();
+  for ( std::size_t i = 0; i < iterations; ++i )
+  {
+    operation( i );
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  std::uint64_t allocations = allocations_count.load() - first_allocations;
+
+  bench_result result;
+  result.ns_per_op = static_cast<double>(
+    std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count() )
+    / iterations;
+  result.allocations_per_op = static_cast<double>( allocations ) / iterations;
+  return result;
+}
+
+static void print_header( const char* group )
+{
+  std::printf( "\n%s\n", group );
+  std::printf( "  %-50s %12s %12s\n", "", "ns/op", "allocs/op" );
+}
+
+static void print_result( const std::string& name,
+  const bench_result& result )
+{
+  std::printf( "  %-50s %12.1f %12.2f\n", name.c_str(), result.ns_per_op,
+    result.allocations_per_op );
+}
+
+static std::vector<std::string> make_nicknames( std::size_t count )
+{
+  std::vector<std::string> nicknames;
+  nicknames.reserve( count );
+  for ( std::size_t i = 0; i < count; ++i )
+  {
+    nicknames.push_back( "user" + std::to_string( i ) );
+  }
+  return nicknames;
+}
+
+//----------------------------------------------------------------------
+// im_message
+//----------------------------------------------------------------------
+
+static void bench_message()
+{
+  print_header( "im_message: factories, headers and relaying" );
+  const std::size_t iterations = 1000000;
+  const std::string body( 100, 'b' );
+
+  print_result( "build_message_msg_from_originator (100 B)",
+    run_bench( iterations, [&]( std::size_t )
+    {
+      bench_sink += im_message::build_message_msg_from_originator(
+        "destinatary", body )->length();
+    } ) );
+
+  print_result( "build_message_msg_to_destinatary (100 B)",
+    run_bench( iterations, [&]( std::size_t )
+    {
+      bench_sink += im_message::build_message_msg_to_destinatary(
+        "originator", body )->length();
+    } ) );
+
+  print_result( "build_message_ack_msg",
+    run_bench( iterations, [&]( std::size_t )
+    {
+      bench_sink += im_message::build_message_ack_msg(
+        "Message successfully delivered." )->length();
+    } ) );
+
+  std::vector<std::string> nicknames = make_nicknames( 50 );
+  print_result( "build_list_response_msg (50 nicknames)",
+    run_bench( iterations / 10, [&]( std::size_t )
+    {
+      bench_sink += im_message::build_list_response_msg(
+        nicknames )->length();
+    } ) );
+
+  im_message_ptr msg_ptr =
+    im_message::build_message_msg_from_originator( "destinatary", body );
+  im_message received_msg;
+  received_msg.clear();
+
+  print_result( "encode legacy header",
+    run_bench( iterations, [&]( std::size_t )
+    {
+      msg_ptr->encode_type();
+      msg_ptr->encode_length();
+      bench_sink += msg_ptr->header()[0];
+    } ) );
+
+  print_result( "decode legacy header",
+    run_bench( iterations, [&]( std::size_t )
+    {
+      std::memcpy( received_msg.data(), msg_ptr->data(),
+        im_message::header_length );
+      bench_sink += received_msg.decode_type()
+        && received_msg.decode_length();
+    } ) );
+
+  char binary_header[im_message::binary_header_length];
+  print_result( "encode binary header",
+    run_bench( iterations, [&]( std::size_t i )
+    {
+      msg_ptr->encode_binary_header( binary_header,
+        static_cast<std::uint32_t>( i ) );
+      bench_sink += binary_header[4];
+    } ) );
+
+  print_result( "decode binary header",
+    run_bench( iterations, [&]( std::size_t )
+    {
+      bench_sink += received_msg.decode_binary_header( binary_header );
+    } ) );
+
+  // Same nickname length both ways, so the body stays where it is.
+  print_result( "readdress_message_msg (100 B)",
+    run_bench( iterations, [&]( std::size_t i )
+    {
+      msg_ptr->readdress_message_msg( ( i % 2 == 0 )
+        ? "originator_a" : "originator_b" );
+      bench_sink += msg_ptr->value_length();
+    } ) );
+}
+
+//----------------------------------------------------------------------
+// Payload parsing
+//----------------------------------------------------------------------
+
+// Stands in for "extract_message_elements", which the parser replaced.
+//
+static void bench_parser()
+{
+  print_header( "Payload parsing" );
+  const std::size_t iterations = 1000000;
+
+  im_message_ptr msg_ptr = im_message::build_message_msg_from_originator(
+    "destinatary", std::string( 100, 'b' ) );
+  print_result( "get_message_fields (MESSAGE_MSG, 100 B)",
+    run_bench( iterations, [&]( std::size_t )
+    {
+      boost::string_view nickname, body;
+      msg_ptr->get_message_fields( nickname, body );
+      bench_sink += nickname.length() + body.length();
+    } ) );
+
+  im_message_ptr list_msg_ptr =
+    im_message::build_list_response_msg( make_nicknames( 50 ) );
+  print_result( "im_field_parser (LIST_RESPONSE_MSG, 50 nicknames)",
+    run_bench( iterations / 10, [&]( std::size_t )
+    {
+      im_field_parser parser( list_msg_ptr->get_nicknames_list() );
+      boost::string_view field;
+      while ( parser.next( field ) )
+      {
+        bench_sink += field.length();
+      }
+    } ) );
+}
+
+//----------------------------------------------------------------------
+// im_message_publisher
+//----------------------------------------------------------------------
+
+class bench_subscriber : public im_message_subscriber
+{
+public:
+  void process_message( im_message_ptr im_message_ptr )
+  {
+    bench_sink += im_message_ptr->length();
+  }
+};
+
+static void bench_publisher()
+{
+  print_header( "im_message_publisher::publish_message" );
+  const std::size_t subscribers_counts[] = { 1, 100, 10000 };
+  im_message_ptr msg_ptr = im_message::build_broadcast_msg(
+    "User with nickname \"someone\" has logged in." );
+
+  for ( std::size_t subscribers_count : subscribers_counts )
+  {
+    im_message_publisher publisher;
+    for ( std::size_t i = 0; i < subscribers_count; ++i )
+    {
+      publisher.subscribe( "topic", std::make_shared<bench_subscriber>() );
+    }
+
+    const std::string topic( "topic" );
+    bench_result result = run_bench( 10000000 / ( subscribers_count + 9 ),
+      [&]( std::size_t )
+      {
+        publisher.publish_message( topic, nullptr, msg_ptr );
+      } );
+    print_result( std::to_string( subscribers_count ) + " subscriber(s)",
+      result );
+    std::printf( "  %-50s %12.1f\n", "  per delivery",
+      result.ns_per_op / subscribers_count );
+
+    // What a user joining and leaving a room of that size costs.
+    im_message_subscriber_ptr joining_ptr =
+      std::make_shared<bench_subscriber>();
+    print_result( "  subscribe + unsubscribe",
+      run_bench( 100000, [&]( std::size_t )
+      {
+        publisher.subscribe( topic, joining_ptr );
+        publisher.unsubscribe( topic, joining_ptr );
+      } ) );
+  }
+}
+
+//----------------------------------------------------------------------
+// Nickname registry (the session manager's register/lookup/unregister)
+//----------------------------------------------------------------------
+
+static void bench_registry()
+{
+  print_header( "im_nickname_registry (session manager nicknames)" );
+  const std::size_t registered_counts[] = { 1000, 10000, 100000 };
+
+  // Sessions are never started; one of them stands for all the users.
+  boost::asio::io_service io_service;
+  im_session_ptr session_ptr = std::make_shared<im_session>(
+    std::make_shared<tcp::socket>( io_service ) );
+
+  for ( std::size_t registered_count : registered_counts )
+  {
+    std::vector<std::string> nicknames = make_nicknames( registered_count );
+    std::vector<std::string> missing_nicknames;
+    for ( auto& nickname : nicknames )
+    {
+      missing_nicknames.push_back( nickname + "_" );
+    }
+    std::vector<std::size_t> lookup_order( registered_count );
+    for ( std::size_t i = 0; i < registered_count; ++i )
+    {
+      lookup_order[i] = i;
+    }
+    std::shuffle( lookup_order.begin(), lookup_order.end(),
+      std::mt19937( 1 ) );
+
+    im_nickname_registry registry;
+    std::string scale = " @" + std::to_string( registered_count );
+
+    // Registering and unregistering go over the whole set exactly once
+    // (no warm up), so every call does change the registry.
+    //
+    print_result( "try_register" + scale,
+      run_bench( registered_count, [&]( std::size_t i )
+      {
+        bench_sink += registry.try_register( nicknames[i], session_ptr );
+      }, false ) );
+
+    print_result( "find (hit)" + scale,
+      run_bench( 1000000, [&]( std::size_t i )
+      {
+        bench_sink += static_cast<bool>( registry.find(
+          nicknames[lookup_order[i % registered_count]] ) );
+      } ) );
+
+    print_result( "find (miss)" + scale,
+      run_bench( 1000000, [&]( std::size_t i )
+      {
+        bench_sink += static_cast<bool>( registry.find(
+          missing_nicknames[lookup_order[i % registered_count]] ) );
+      } ) );
+
+    print_result( "get_nicknames_snapshot" + scale,
+      run_bench( 10, [&]( std::size_t )
+      {
+        bench_sink += registry.get_nicknames_snapshot()->size();
+      } ) );
+
+    print_result( "unregister" + scale,
+      run_bench( registered_count, [&]( std::size_t i )
+      {
+        bench_sink += registry.unregister( nicknames[lookup_order[i]],
+          session_ptr );
+      }, false ) );
+  }
+}
+
+//----------------------------------------------------------------------
+// Mailbox
+//----------------------------------------------------------------------
+
+// Leaves "directory" empty, so every run starts with no segments.
+static void remove_segments( const std::string& directory )
+{
+  DIR* directory_ptr = ::opendir( directory.c_str() );
+  if ( directory_ptr == nullptr )
+  {
+    return;
+  }
+  while ( struct dirent* entry = ::readdir( directory_ptr ) )
+  {
+    if ( std::strncmp( entry->d_name, "mailbox.", 8 ) == 0 )
+    {
+      ::unlink( ( directory + "/" + entry->d_name ).c_str() );
+    }
+  }
+  ::closedir( directory_ptr );
+}
+
+static void bench_mailbox()
+{
+  print_header( "im_mailbox (to ./mailbox.bench) against the relay path" );
+  const std::size_t iterations = 1000000;
+  const std::string body( 100, 'b' );
+  std::vector<std::string> nicknames = make_nicknames( 50 );
+
+  print_result( "relay: build_message_msg_to_destinatary (100 B)",
+    run_bench( iterations, [&]( std::size_t )
+    {
+      bench_sink += im_message::build_message_msg_to_destinatary(
+        "originator", body )->length();
+    } ) );
+
+  const std::string directory( "mailbox.bench" );
+  remove_segments( directory );
+  {
+    im_mailbox::options mailbox_options;
+    mailbox_options.directory = directory;
+    im_mailbox mailbox( mailbox_options );
+    mailbox.start();
+    for ( const std::string& nickname : nicknames )
+    {
+      mailbox.add_known_user( nickname );
+    }
+
+    // Every recipient logs in once a hundred messages are waiting, so the
+    // segments get compacted along the way.
+    //
+    std::atomic<std::uint64_t> stored_count( 0 );
+    std::size_t stores_count = iterations + iterations / 10;
+    auto start = std::chrono::steady_clock::now();
+    print_result( "store_message (100 B, 1% take_messages)",
+      run_bench( iterations, [&]( std::size_t i )
+      {
+        const std::string& recipient = nicknames[i % nicknames.size()];
+        mailbox.store_message( recipient, "originator", body,
+          [&stored_count]() { ++stored_count; } );
+        if ( ( i / nicknames.size() ) % 100 == 99 )
+        {
+          bench_sink += mailbox.take_messages( recipient ).size();
+        }
+      } ) );
+
+    while ( stored_count < stores_count )
+    {
+      std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+    }
+    double stored_seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start ).count();
+    im_mailbox::statistics statistics = mailbox.get_statistics();
+    std::printf( "  %-50s %12.0f\n", "acknowledged messages/s",
+      stores_count / stored_seconds );
+    std::printf( "  %-50s %12.1f\n", "messages per commit",
+      static_cast<double>( stores_count ) / statistics.commits );
+    std::printf( "  %-50s %12llu\n", "compactions",
+      static_cast<unsigned long long>( statistics.compactions ) );
+  }
+  remove_segments( directory );
+  ::rmdir( directory.c_str() );
+}
+
+//----------------------------------------------------------------------
+// Logger
+//----------------------------------------------------------------------
+
+static void bench_logger( std::size_t max_threads_count )
+{
+  std::printf( "\nLogger::log (LOG_INFO with 4 arguments, to ./server.log)\n" );
+  std::printf( "  %-50s %12s %12s %12s\n", "", "ns/op", "allocs/op",
+    "records/s" );
+  const std::size_t records_count = 1000000;
+
+  // Producers wait for room, so this is the rate the worker sustains
+  // rather than how fast records can be dropped.
+  Logger& logger = Logger::instance();
+  logger.setOverflowPolicy( Logger::OVERFLOW_BLOCK );
+  for ( std::size_t threads_count = 1; threads_count <= max_threads_count;
+    threads_count *= 2 )
+  {
+    // Every thread logs its share; ns/op is wall time per record, so
+    // perfect scaling halves it whenever the threads double.
+    //
+    std::size_t records_per_thread = records_count / threads_count;
+    boost::barrier start_barrier( threads_count + 1 );
+    std::vector<std::unique_ptr<boost::thread>> threads;
+    for ( std::size_t t = 0; t < threads_count; ++t )
+    {
+      threads.emplace_back( new boost::thread( [&, t]()
+      {
+        start_barrier.wait();
+        for ( std::size_t i = 0; i < records_per_thread; ++i )
+        {
+          LOG_INFO( "Benchmark record ", i, " from thread ", t );
+        }
+      } ) );
+    }
+
+    std::uint64_t first_allocations = allocations_count.load();
+    auto start = std::chrono::steady_clock::now();
+    start_barrier.wait();
+    for ( auto& thread : threads )
+    {
+      thread->join();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    std::uint64_t allocations = allocations_count.load() - first_allocations;
+    logger.flush();
+    auto drained = std::chrono::steady_clock::now() - start;
+
+    double total_records = static_cast<double>(
+      records_per_thread * threads_count );
+    double ns_per_op = static_cast<double>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count() )
+      / total_records;
+    double drained_seconds = std::chrono::duration<double>( drained ).count();
+    std::printf( "  %-50s %12.1f %12.2f %12.0f\n",
+      ( std::to_string( threads_count ) + " thread(s)" ).c_str(), ns_per_op,
+      allocations / total_records, total_records / drained_seconds );
+  }
+  std::printf( "  (records/s counts until everything was written)\n" );
+  std::printf( "  %-50s %12llu\n", "dropped records",
+    static_cast<unsigned long long>( logger.getDroppedCount() ) );
+}
+
+//----------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+  try
+  {
+    // "im_bench [<group> ...]" runs the given groups only.
+    //
+    const char* groups[] = { "message", "parser", "publisher", "registry",
+      "mailbox", "logger" };
+    std::vector<std::string> selected( argv + 1, argv + argc );
+    for ( auto& group : selected )
+    {
+      if ( std::find( std::begin( groups ), std::end( groups ), group )
+        == std::end( groups ) )
+      {
+        std::cerr << "Usage: im_bench [message] [parser] [publisher] "
+          << "[registry] [mailbox] [logger]\n";
+        return 1;
+      }
+    }
+
+    auto is_selected = [&]( const char* group )
+    {
+      return selected.empty() || ( std::find( selected.begin(),
+        selected.end(), group ) != selected.end() );
+    };
+
+    if ( is_selected( "message" ) )
+    {
+      bench_message();
+    }
+    if ( is_selected( "parser" ) )
+    {
+      bench_parser();
+    }
+    if ( is_selected( "publisher" ) )
+    {
+      bench_publisher();
+    }
+    if ( is_selected( "registry" ) )
+    {
+      bench_registry();
+    }
+    if ( is_selected( "mailbox" ) )
+    {
+      bench_mailbox();
+    }
+    if ( is_selected( "logger" ) )
+    {
+      LogSinkOptions sink_options;
+      sink_options.keptSegments = 1;
+      Logger::setSinkOptions( sink_options );
+      bench_logger( std::max( 2u, boost::thread::hardware_concurrency() ) );
+    }
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
@@ -28,7 +28,8 @@ im_client::im_client(boost::asio::io_service& io_service,
   : io_service_(io_service),
     endpoint_iterator_(endpoint_iterator),
     client_user_io_handler_(client_user_io_handler),
-    is_connected_with_server_(false)
+    is_connected_with_server_(false),
+    is_list_paged_(false)
 {
 }
 
@@ -59,6 +60,16 @@ void im_client::disconnect()
 void im_client::on_message_received(im_session_ptr im_session_ptr, 
   const im_message& msg)
 {
+  // The connection acknowledge says which protocol the server accepted; 
+  // everything after it uses that one.
+  //
+  if ( msg.is_connect_ack_msg() 
+    && ( msg.get_protocol_version() != im_message::LEGACY_PROTOCOL ) )
+  {
+    im_session_ptr_->switch_protocol_version( msg.get_protocol_version() );
+    is_list_paged_ = true;
+  }
+
   im_message_handler_.process_message( im_session_ptr_, msg );
   //client_user_io_handler_.print_message( msg );
 }
@@ -115,73 +126,187 @@ void im_client::send_message(im_message_ptr im_message_ptr)
       });
 }
 
+void im_client::request_nicknames_list()
+{
+  io_service_.post(
+      [this]()
+      {
+        if ( is_list_paged_ )
+        {
+          listed_nicknames_.clear();
+          im_session_ptr_->send_message( 
+            im_message::build_list_request_msg( "", list_page_size ) );
+        }
+        else
+        {
+          im_session_ptr_->send_message( 
+            im_message::build_list_request_msg() );
+        }
+      });
+}
+
 //----------------------------------------------------------------------
 
-void im_client::on_connect_msg( im_session_ptr im_session_ptr, 
-  std::string nickname )
+void im_client::on_connect_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view nickname )
 {
   // Handled by server.
 }
 
-void im_client::on_connect_ack_msg( im_session_ptr im_session_ptr, 
-  std::string ack_message )
+void im_client::on_connect_ack_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view ack_message )
 {
   is_connected_with_server_ = true;
-  client_user_io_handler_.print_server_message( ack_message );
+  client_user_io_handler_.print_server_message( ack_message.to_string() );
 }
 
-void im_client::on_connect_rfsd_msg( im_session_ptr im_session_ptr, 
-  std::string error_message )
+void im_client::on_connect_rfsd_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view error_message )
 {
-  client_user_io_handler_.print_server_message( error_message );
+  client_user_io_handler_.print_server_message( error_message.to_string() );
   disconnect();
 }
 
-void im_client::on_message_msg( im_session_ptr im_session_ptr, 
-  std::string destinatary_nickname, std::string message )
+void im_client::on_message_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view destinatary_nickname, boost::string_view message )
 {
-  client_user_io_handler_.print_user_message( destinatary_nickname, message );
+  client_user_io_handler_.print_user_message( 
+    destinatary_nickname.to_string(), message.to_string() );
 }
 
-void im_client::on_message_ack_msg( im_session_ptr im_session_ptr, 
-  std::string ack_message )
+void im_client::on_message_ack_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view ack_message )
 {
-  client_user_io_handler_.print_server_message( ack_message );
+  client_user_io_handler_.print_server_message( ack_message.to_string() );
 }
 
-void im_client::on_message_rfsd_msg( im_session_ptr im_session_ptr, 
-  std::string error_message )
+void im_client::on_message_rfsd_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view error_message )
 {
-  client_user_io_handler_.print_server_message( error_message );
+  client_user_io_handler_.print_server_message( error_message.to_string() );
 }
 
-void im_client::on_list_request_msg( im_session_ptr im_session_ptr )
+void im_client::on_list_request_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view cursor, std::size_t page_size )
 {
   // Handled by server.
 }
 
-void im_client::on_list_response_msg( im_session_ptr im_session_ptr, 
-  std::vector<std::string> nicknames_list )
+void im_client::on_list_response_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view nicknames_list )
 {
-  client_user_io_handler_.print_nicknames_list( nicknames_list );
+  im_field_parser parser( nicknames_list );
+  boost::string_view field;
+  if ( !is_list_paged_ )
+  {
+    std::vector<std::string> nicknames;
+    while ( parser.next( field ) )
+    {
+      nicknames.push_back( field.to_string() );
+    }
+    client_user_io_handler_.print_nicknames_list( nicknames );
+    return;
+  }
+
+  // "<total>|<next cursor>|<nickname>|..."
+  //
+  boost::string_view next_cursor;
+  if ( !parser.next( field ) || !parser.next( next_cursor ) )
+  {
+    return;
+  }
+  while ( parser.next( field ) )
+  {
+    if ( !field.empty() )
+    {
+      listed_nicknames_.push_back( field.to_string() );
+    }
+  }
+
+  if ( next_cursor.empty() )
+  {
+    client_user_io_handler_.print_nicknames_list( listed_nicknames_ );
+    listed_nicknames_.clear();
+  }
+  else
+  {
+    im_session_ptr_->send_message( im_message::build_list_request_msg( 
+      next_cursor.to_string(), list_page_size ) );
+  }
 }
 
-void im_client::on_disconnect_msg( im_session_ptr im_session_ptr )
+void im_client::on_disconnect_msg( const im_session_ptr& im_session_ptr )
 {
   // Handled by server.
 }
 
-void im_client::on_disconnect_ack_msg( im_session_ptr im_session_ptr, 
-  std::string ack_message )
+void im_client::on_disconnect_ack_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view ack_message )
 {
-  client_user_io_handler_.print_server_message( ack_message );
+  client_user_io_handler_.print_server_message( ack_message.to_string() );
   disconnect();
 }
 
-void im_client::on_broadcast_msg( im_session_ptr im_session_ptr, 
-  std::string broadcast_message )
+void im_client::on_broadcast_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view broadcast_message )
+{
+  client_user_io_handler_.print_server_message( 
+    broadcast_message.to_string() );
+}
+
+void im_client::on_stats_request_msg( const im_session_ptr& im_session_ptr )
+{
+  // Handled by server.
+}
+
+void im_client::on_stats_response_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view stats )
+{
+  client_user_io_handler_.print_stats( stats.to_string() );
+}
+
+void im_client::on_join_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view room )
+{
+  // Handled by server.
+}
+
+void im_client::on_join_ack_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view room )
+{
+  client_user_io_handler_.print_server_message( 
+    "You are in room \"" + room.to_string() + "\"." );
+}
+
+void im_client::on_join_rfsd_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view error_message )
+{
+  client_user_io_handler_.print_server_message( error_message.to_string() );
+}
+
+void im_client::on_leave_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view room )
+{
+  // Handled by server.
+}
+
+void im_client::on_leave_ack_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view room )
+{
+  client_user_io_handler_.print_server_message( 
+    "You left room \"" + room.to_string() + "\"." );
+}
+
+void im_client::on_room_message_msg( const im_session_ptr& im_session_ptr, 
+  boost::string_view room, boost::string_view message )
 {
-  client_user_io_handler_.print_server_message( broadcast_message );
+  // "<originator nickname>|<message>"
+  //
+  im_field_parser parser( message );
+  boost::string_view originator;
+  parser.next( originator );
+  client_user_io_handler_.print_room_message( room.to_string(), 
+    originator.to_string(), parser.rest().to_string() );
 }
 
 //----------------------------------------------------------------------
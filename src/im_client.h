@@ -26,6 +26,8 @@ class im_client
     public im_message_handler_callback
 {
 public:
+  enum { list_page_size = 500 };
+
   im_client(boost::asio::io_service& io_service,
       tcp::resolver::iterator endpoint_iterator, 
       im_client_user_io_handler& client_user_io_handler);
@@ -46,29 +48,46 @@ public:
   bool connect();
   bool is_connected();
   void send_message(im_message_ptr im_message_ptr);
+  void request_nicknames_list();
 
   // Inherited from im_message_handler_callback.
   //
-  void on_connect_msg( im_session_ptr im_session_ptr, 
-    std::string nickname );
-  void on_connect_ack_msg( im_session_ptr im_session_ptr, 
-    std::string ack_message );
-  void on_connect_rfsd_msg( im_session_ptr im_session_ptr, 
-    std::string error_message );
-  void on_message_msg( im_session_ptr im_session_ptr, 
-    std::string destinatary_nickname, std::string message );
-  void on_message_ack_msg( im_session_ptr im_session_ptr, 
-    std::string ack_message );
-  void on_message_rfsd_msg( im_session_ptr im_session_ptr, 
-    std::string error_message );
-  void on_list_request_msg( im_session_ptr im_session_ptr );
-  void on_list_response_msg( im_session_ptr im_session_ptr, 
-    std::vector<std::string> nicknames_list );
-  void on_disconnect_msg( im_session_ptr im_session_ptr );
-  void on_disconnect_ack_msg( im_session_ptr im_session_ptr, 
-    std::string ack_message );
-  void on_broadcast_msg( im_session_ptr im_session_ptr, 
-    std::string broadcast_message );
+  void on_connect_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view nickname );
+  void on_connect_ack_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view ack_message );
+  void on_connect_rfsd_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view error_message );
+  void on_message_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view destinatary_nickname, boost::string_view message );
+  void on_message_ack_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view ack_message );
+  void on_message_rfsd_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view error_message );
+  void on_list_request_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view cursor, std::size_t page_size );
+  void on_list_response_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view nicknames_list );
+  void on_disconnect_msg( const im_session_ptr& im_session_ptr );
+  void on_disconnect_ack_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view ack_message );
+  void on_broadcast_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view broadcast_message );
+  void on_stats_request_msg( const im_session_ptr& im_session_ptr );
+  void on_stats_response_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view stats );
+  void on_join_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view room );
+  void on_join_ack_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view room );
+  void on_join_rfsd_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view error_message );
+  void on_leave_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view room );
+  void on_leave_ack_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view room );
+  void on_room_message_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view room, boost::string_view message );
 
 private:
   bool do_connect(tcp::resolver::iterator endpoint_iterator);
@@ -82,6 +101,11 @@ private:
   std::thread io_service_thread_;
   im_message_handler im_message_handler_;
   bool is_connected_with_server_;
+  // Servers acknowledging a protocol version answer LIST in pages, which 
+  // are gathered here until the last one arrives. Only touched from the 
+  // io_service thread.
+  bool is_list_paged_;
+  std::vector<std::string> listed_nicknames_;
 };
 
 //----------------------------------------------------------------------
@@ -51,9 +51,17 @@ bool im_client_user_io_handler::process_command(
     if ( is_building_msg )
     {
       //std::cout << "Processing message body, or command not found.\n";
-      callback_ptr_->send_message( 
-        im_message::build_message_msg_from_originator( 
-          destinatary_nickname, command ) );
+      if ( destinatary_room.empty() )
+      {
+        callback_ptr_->send_message( 
+          im_message::build_message_msg_from_originator( 
+            destinatary_nickname, command ) );
+      }
+      else
+      {
+        callback_ptr_->send_message( 
+          im_message::build_room_message_msg( destinatary_room, command ) );
+      }
 
       is_building_msg = false;
 
@@ -97,6 +105,11 @@ bool im_client_user_io_handler::process_command(
             std::cout << "# [client] said: The user nickname must not be bigger \""
               << " than" << im_message::max_destinatary_length << "\".\n";
           }
+          else if ( destinatary.find( '|' ) != std::string::npos )
+          {
+            std::cout << "# [client] said: The user nickname must not " 
+              << "contain \"|\".\n";
+          }
           // TODO: Find a better way to handle constants without cross 
           //       referencing like this.
           else if ( destinatary.compare( 
@@ -115,7 +128,8 @@ bool im_client_user_io_handler::process_command(
               //std::cout << "im_client_user_io_handler::process_command -> "
                 //"Sending message...\n";
               callback_ptr_->send_message( 
-                im_message::build_connect_msg( destinatary ) );
+                im_message::build_connect_msg( destinatary, 
+                  im_message::BINARY_PROTOCOL ) );
             }
           }
         }
@@ -166,12 +180,66 @@ bool im_client_user_io_handler::process_command(
           else
           {
             destinatary_nickname = destinatary;
+            destinatary_room.clear();
             is_building_msg = true;
             std::cout << "# Type message: ";
           }
         }
       }
     }
+    else if ( boost::starts_with( command, JOIN_CMD ) 
+      || boost::starts_with( command, LEAVE_CMD ) 
+      || boost::starts_with( command, ROOM_CMD ) )
+    {
+      //std::cout << "Processing room command.\n";
+      std::vector<std::string> command_tokens = 
+          extract_command_tokens( command );
+      const std::string& room_command = command_tokens.at( 0 );
+      std::string room = ( command_tokens.size() == 2 ) 
+        ? trim( command_tokens.at( 1 ) ) : std::string();
+
+      if ( !callback_ptr_->is_connected() )
+      {
+        std::cout << "# [client] said: You need to be connected before " 
+          << "calling \"" << room_command << "\" command.\n";
+
+        print_next_command_dash();
+      }
+      else if ( command_tokens.size() != 2 )
+      {
+        std::cout << "# [client] said: The \"" << room_command << "\" command " 
+          << "accepts only one parameter that is the room name.\n";
+
+        print_next_command_dash();
+      }
+      else if ( room.empty() || ( room.find( '|' ) != std::string::npos ) 
+        || ( room.length() > im_message::max_room_name_length ) )
+      {
+        std::cout << "# [client] said: The room name must not be empty, " 
+          << "contain \"|\" nor be bigger than " 
+          << im_message::max_room_name_length << ".\n";
+
+        print_next_command_dash();
+      }
+      else if ( room_command.compare( JOIN_CMD ) == 0 )
+      {
+        callback_ptr_->send_message( im_message::build_join_msg( room ) );
+
+        print_next_command_dash();
+      }
+      else if ( room_command.compare( LEAVE_CMD ) == 0 )
+      {
+        callback_ptr_->send_message( im_message::build_leave_msg( room ) );
+
+        print_next_command_dash();
+      }
+      else
+      {
+        destinatary_room = room;
+        is_building_msg = true;
+        std::cout << "# Type message: ";
+      }
+    }
     else if ( command.compare( LIST_CMD ) == 0)
     {
       //std::cout << "Processing 'list' command.\n";
@@ -182,7 +250,22 @@ bool im_client_user_io_handler::process_command(
       }
       else
       {
-        callback_ptr_->send_message( im_message::build_list_request_msg() );
+        callback_ptr_->request_nicknames_list();
+      }
+
+      print_next_command_dash();
+    }
+    else if ( command.compare( STATS_CMD ) == 0)
+    {
+      //std::cout << "Processing 'stats' command.\n";
+      if ( !callback_ptr_->is_connected() )
+      {
+        std::cout << "# [client] said: You need to be connected before " 
+          << "calling \"" << STATS_CMD << "\" command.\n";
+      }
+      else
+      {
+        callback_ptr_->send_message( im_message::build_stats_request_msg() );
       }
 
       print_next_command_dash();
@@ -237,6 +320,15 @@ void im_client_user_io_handler::print_user_message(
   print_next_command_dash();
 }
 
+void im_client_user_io_handler::print_room_message( 
+  const std::string room, const std::string originator, 
+  const std::string message )
+{
+  std::cout << "[" << originator << " in " << room << "] said: " 
+    << message << "\n";
+  print_next_command_dash();
+}
+
 void im_client_user_io_handler::print_server_message( 
   const std::string message )
 {
@@ -262,6 +354,12 @@ void im_client_user_io_handler::print_nicknames_list(
   print_next_command_dash();
 }
 
+void im_client_user_io_handler::print_stats( const std::string stats )
+{
+  std::cout << "[server] said: Server statistics \n" << stats;
+  print_next_command_dash();
+}
+
 void im_client_user_io_handler::print_error(const std::string prefix, 
   boost::system::error_code ec)
 {
@@ -315,10 +413,31 @@ void im_client_user_io_handler::print_help(bool with_intro)
     << "command is issued will   #\n";
   std::cout << "#          be the message to be sent to the previously provided destinatary.   #\n";
   std::cout << "#                                                                              #\n";
+  std::cout << "# " << JOIN_CMD << ": this command puts you in a room, so you "
+    << "get what is said there.        #\n";
+  std::cout << "#   Usage: \"" << JOIN_CMD << " <ROOM_NAME>\", where "
+    << "\"<ROOM_NAME>\" must be replaced by the     #\n";
+  std::cout << "#          name of the room, which is created when its first user joins.       #\n";
+  std::cout << "#                                                                              #\n";
+  std::cout << "# " << LEAVE_CMD << ": this command takes you out of a room."
+    << "                                 #\n";
+  std::cout << "#   Usage: \"" << LEAVE_CMD << " <ROOM_NAME>\"."
+    << "                                                #\n";
+  std::cout << "#                                                                              #\n";
+  std::cout << "# " << ROOM_CMD << ": this command allows you to send a message to "
+    << "everybody in a room you   #\n";
+  std::cout << "#       are in.                                                                #\n";
+  std::cout << "#   Usage: \"" << ROOM_CMD << " <ROOM_NAME>\", and then the message, "
+    << "like with \"" << MESSAGE_CMD << "\".      #\n";
+  std::cout << "#                                                                              #\n";
   std::cout << "# " << LIST_CMD << ": this command returns the list of nicknames " 
     << "already registered with the #\n";
   std::cout << "#       sending message server.                                                #\n";
   std::cout << "#                                                                              #\n";
+  std::cout << "# " << STATS_CMD << ": this command returns the numbers the sending "
+    << "message server keeps     #\n";
+  std::cout << "#        about itself (connections, messages, queues and so on).               #\n";
+  std::cout << "#                                                                              #\n";
   std::cout << "# " << DISCONNECT_CMD << ": this command terminates the current" 
     << " connection with the sending  #\n";
   std::cout << "#             message server.                                                  #\n";
@@ -327,9 +446,11 @@ void im_client_user_io_handler::print_help(bool with_intro)
     << "                              #\n";
   std::cout << "#                                                                              #\n";
   std::cout << "# Important:                                                                   #\n";
-  std::cout << "# 1- \"" << MESSAGE_CMD << "\", \"" << LIST_CMD << "\" and \"" 
-    << DISCONNECT_CMD << "\" commands can only be executed after a  #\n";
-  std::cout << "#    successfull connection with the server.                                   #\n";
+  std::cout << "# 1- \"" << MESSAGE_CMD << "\", \"" << JOIN_CMD << "\", \"" 
+    << LEAVE_CMD << "\", \"" << ROOM_CMD << "\", \"" << LIST_CMD << "\", \"" 
+    << STATS_CMD << "\" and \"" << DISCONNECT_CMD << "\"      #\n";
+  std::cout << "#    commands can only be executed after a successfull connection with the     #\n";
+  std::cout << "#    server.                                                                   #\n";
   std::cout << "# 2- On the other hand, \"" << CONNECT_CMD << "\" and \"" 
     << QUIT_CMD << "\" commands can only be executed     #\n";
   std::cout << "#    while the application has no connection established with the server.      #\n";
@@ -370,6 +491,10 @@ const std::string im_client_user_io_handler::HELP_CMD = "help";
 const std::string im_client_user_io_handler::CONNECT_CMD = "connect";
 const std::string im_client_user_io_handler::MESSAGE_CMD = "message";
 const std::string im_client_user_io_handler::LIST_CMD = "list";
+const std::string im_client_user_io_handler::STATS_CMD = "stats";
+const std::string im_client_user_io_handler::JOIN_CMD = "join";
+const std::string im_client_user_io_handler::LEAVE_CMD = "leave";
+const std::string im_client_user_io_handler::ROOM_CMD = "room";
 const std::string im_client_user_io_handler::DISCONNECT_CMD = "disconnect";
 const std::string im_client_user_io_handler::QUIT_CMD = "quit";
 
@@ -24,6 +24,7 @@ public:
   virtual bool connect() = 0;
   virtual bool is_connected() = 0;
   virtual void send_message(im_message_ptr im_message_ptr) = 0;
+  virtual void request_nicknames_list() = 0;
 };
 
 typedef std::shared_ptr<im_client_user_io_handler_callback> im_client_user_io_handler_callback_ptr;
@@ -42,6 +43,9 @@ public:
   void print_server_message( const std::string message );
   void print_client_message( const std::string message );
   void print_nicknames_list( const std::vector<std::string> nicknames_list );
+  void print_stats( const std::string stats );
+  void print_room_message( const std::string room, 
+    const std::string originator, const std::string message );
   void print_error(const std::string prefix, boost::system::error_code ec);
 
 private:
@@ -55,6 +59,10 @@ private:
   static const std::string CONNECT_CMD;
   static const std::string MESSAGE_CMD;
   static const std::string LIST_CMD;
+  static const std::string STATS_CMD;
+  static const std::string JOIN_CMD;
+  static const std::string LEAVE_CMD;
+  static const std::string ROOM_CMD;
   static const std::string DISCONNECT_CMD;
   static const std::string QUIT_CMD;
 
@@ -62,6 +70,8 @@ private:
   im_client_user_io_handler_callback_ptr callback_ptr_;
   bool is_building_msg = false;
   std::string destinatary_nickname;
+  // Set when the message being built goes to this room instead.
+  std::string destinatary_room;
   bool is_connected_with_server_;
 };
 
@@ -0,0 +1,123 @@
+//
+// im_latency_histogram.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#include <cmath>
+#include "im_latency_histogram.h"
+
+//----------------------------------------------------------------------
+// Constructor
+//----------------------------------------------------------------------
+
+im_latency_histogram::im_latency_histogram()
+  : count_( 0 ),
+    total_( 0 ),
+    max_( 0 )
+{
+  for ( auto& counter : counters_ )
+  {
+    counter.store( 0, std::memory_order_relaxed );
+  }
+}
+
+//----------------------------------------------------------------------
+// Public methods.
+//----------------------------------------------------------------------
+
+void im_latency_histogram::record( std::uint64_t value )
+{
+  counters_[get_counter_index( value )].fetch_add( 1,
+    std::memory_order_relaxed );
+  count_.fetch_add( 1, std::memory_order_relaxed );
+  total_.fetch_add( value, std::memory_order_relaxed );
+
+  std::uint64_t max = max_.load( std::memory_order_relaxed );
+  while ( ( value > max )
+    && !max_.compare_exchange_weak( max, value, std::memory_order_relaxed ) )
+  {
+  }
+}
+
+std::uint64_t im_latency_histogram::get_count() const
+{
+  return count_.load( std::memory_order_relaxed );
+}
+
+std::uint64_t im_latency_histogram::get_max() const
+{
+  return max_.load( std::memory_order_relaxed );
+}
+
+double im_latency_histogram::get_mean() const
+{
+  std::uint64_t count = get_count();
+  return ( count == 0 )
+    ? 0 : static_cast<double>( total_.load( std::memory_order_relaxed ) )
+      / count;
+}
+
+std::uint64_t im_latency_histogram::get_percentile( double percentile ) const
+{
+  std::uint64_t count = get_count();
+  if ( count == 0 )
+  {
+    return 0;
+  }
+
+  std::uint64_t wanted_count = static_cast<std::uint64_t>(
+    std::ceil( percentile / 100 * count ) );
+  if ( wanted_count == 0 )
+  {
+    wanted_count = 1;
+  }
+
+  std::uint64_t seen_count = 0;
+  for ( std::size_t i = 0; i < counters_count; ++i )
+  {
+    seen_count += counters_[i].load( std::memory_order_relaxed );
+    if ( seen_count >= wanted_count )
+    {
+      // Never more than was actually recorded.
+      std::uint64_t value = get_highest_value( i );
+      return ( value < get_max() ) ? value : get_max();
+    }
+  }
+  return get_max();
+}
+
+//----------------------------------------------------------------------
+// Private methods.
+//----------------------------------------------------------------------
+
+std::size_t im_latency_histogram::get_counter_index( std::uint64_t value )
+{
+  if ( value < sub_buckets_count )
+  {
+    return static_cast<std::size_t>( value );
+  }
+
+  // Keeps the "sub_bucket_bits - 1" bits below the highest one.
+  int highest_bit = 63 - __builtin_clzll( value );
+  int shift = highest_bit - ( sub_bucket_bits - 1 );
+  std::size_t sub_bucket = static_cast<std::size_t>( value >> shift )
+    - half_sub_buckets_count;
+  return sub_buckets_count + ( shift - 1 ) * half_sub_buckets_count
+    + sub_bucket;
+}
+
+std::uint64_t im_latency_histogram::get_highest_value( std::size_t index )
+{
+  if ( index < sub_buckets_count )
+  {
+    return index;
+  }
+
+  std::size_t shift = ( index - sub_buckets_count ) / half_sub_buckets_count
+    + 1;
+  std::uint64_t sub_bucket = ( index - sub_buckets_count )
+    % half_sub_buckets_count + half_sub_buckets_count;
+  return ( ( sub_bucket + 1 ) << shift ) - 1;
+}
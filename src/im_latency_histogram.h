@@ -0,0 +1,60 @@
+//
+// im_latency_histogram.h
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#ifndef IM_LATENCY_HISTOGRAM_H
+#define IM_LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+
+//----------------------------------------------------------------------
+
+// HDR style histogram of latencies (in nanoseconds). Values below
+// "sub_buckets_count" are counted exactly; above that, every power of two
+// is split into "sub_buckets_count / 2" linear buckets, so whatever is
+// reported is within 1/64 of what was recorded, across the whole 64 bit
+// range, with a fixed number of counters.
+//
+// Recording takes no lock (a relaxed increment), so any number of threads
+// may record into the same histogram.
+//
+class im_latency_histogram
+{
+public:
+  enum { sub_bucket_bits = 7 };
+  enum { sub_buckets_count = 1 << sub_bucket_bits };
+  enum { half_sub_buckets_count = sub_buckets_count / 2 };
+  enum { counters_count = sub_buckets_count
+    + ( 64 - sub_bucket_bits ) * half_sub_buckets_count };
+
+  im_latency_histogram();
+
+  void record( std::uint64_t value );
+
+  std::uint64_t get_count() const;
+  std::uint64_t get_max() const;
+  double get_mean() const;
+  // Smallest value at least "percentile" percent of the recorded ones are
+  // not above (0 if nothing was recorded).
+  std::uint64_t get_percentile( double percentile ) const;
+
+private:
+  static std::size_t get_counter_index( std::uint64_t value );
+  // Highest value counted by the counter at "index".
+  static std::uint64_t get_highest_value( std::size_t index );
+
+private:
+  std::atomic<std::uint64_t> counters_[counters_count];
+  std::atomic<std::uint64_t> count_;
+  std::atomic<std::uint64_t> total_;
+  std::atomic<std::uint64_t> max_;
+};
+
+//----------------------------------------------------------------------
+
+#endif // IM_LATENCY_HISTOGRAM_H
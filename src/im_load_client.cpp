@@ -0,0 +1,427 @@
+//
+// im_load_client.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#include <cstdlib>
+#include <string>
+#include "im_load_client.h"
+#include "im_load_generator.h"
+#include "im_message.hpp"
+
+//----------------------------------------------------------------------
+// Constructor
+//----------------------------------------------------------------------
+
+im_load_client::im_load_client( boost::asio::io_service& io_service,
+  tcp::resolver::iterator endpoint_iterator, std::string nickname,
+  int protocol_version, im_load_generator& generator )
+  : io_service_( io_service ),
+    endpoint_iterator_( endpoint_iterator ),
+    nickname_( nickname ),
+    protocol_version_( protocol_version ),
+    generator_( generator ),
+    state_( offline )
+{
+}
+
+//----------------------------------------------------------------------
+// Public methods.
+//----------------------------------------------------------------------
+
+void im_load_client::start()
+{
+  im_message_handler_.start( shared_from_this() );
+}
+
+const std::string& im_load_client::get_nickname() const
+{
+  return nickname_;
+}
+
+int im_load_client::get_state() const
+{
+  return state_.load( std::memory_order_relaxed );
+}
+
+bool im_load_client::connect()
+{
+  boost::unique_lock<boost::mutex> scoped_lock( client_mutex_ );
+  if ( state_ != offline )
+  {
+    return false;
+  }
+
+  do_connect();
+  return true;
+}
+
+bool im_load_client::send_direct_message(
+  const std::string& destinatary_nickname, std::size_t body_length )
+{
+  std::string body = std::to_string( get_now_nanoseconds() );
+  if ( body.length() < body_length )
+  {
+    body.append( "|" ).append( body_length - body.length() - 1, 'x' );
+  }
+
+  boost::unique_lock<boost::mutex> scoped_lock( client_mutex_ );
+  if ( state_ != logged_in )
+  {
+    return false;
+  }
+
+  message_send_times_.push_back( std::chrono::steady_clock::now() );
+  im_session_ptr_->send_message(
+    im_message::build_message_msg_from_originator( destinatary_nickname,
+      body ) );
+  ++generator_.get_statistics().messages_sent;
+  return true;
+}
+
+bool im_load_client::request_nicknames_list()
+{
+  boost::unique_lock<boost::mutex> scoped_lock( client_mutex_ );
+  if ( state_ != logged_in )
+  {
+    return false;
+  }
+
+  list_send_times_.push_back( std::chrono::steady_clock::now() );
+  im_session_ptr_->send_message( im_message::build_list_request_msg() );
+  ++generator_.get_statistics().lists_sent;
+  return true;
+}
+
+bool im_load_client::log_out_and_in()
+{
+  boost::unique_lock<boost::mutex> scoped_lock( client_mutex_ );
+  if ( state_ != logged_in )
+  {
+    return false;
+  }
+
+  state_ = logging_out;
+  im_session_ptr_->send_message( im_message::build_disconnect_msg() );
+  return true;
+}
+
+bool im_load_client::reconnect_abruptly()
+{
+  boost::unique_lock<boost::mutex> scoped_lock( client_mutex_ );
+  if ( state_ != logged_in )
+  {
+    return false;
+  }
+
+  close_session();
+  ++generator_.get_statistics().abrupt_reconnects;
+  do_connect();
+  return true;
+}
+
+void im_load_client::stop()
+{
+  boost::unique_lock<boost::mutex> scoped_lock( client_mutex_ );
+  close_session();
+  state_ = offline;
+}
+
+//----------------------------------------------------------------------
+
+void im_load_client::on_message_received( im_session_ptr im_session_ptr,
+  const im_message& msg )
+{
+  {
+    // Whatever a replaced session still had in its buffer is of no
+    // interest anymore.
+    boost::unique_lock<boost::mutex> scoped_lock( client_mutex_ );
+    if ( im_session_ptr != im_session_ptr_ )
+    {
+      return;
+    }
+
+    if ( msg.is_connect_ack_msg()
+      && ( msg.get_protocol_version() != im_message::LEGACY_PROTOCOL ) )
+    {
+      im_session_ptr->switch_protocol_version( msg.get_protocol_version() );
+    }
+  }
+
+  im_message_handler_.process_message( im_session_ptr, msg );
+}
+
+void im_load_client::on_error( im_session_ptr im_session_ptr,
+  boost::system::error_code ec )
+{
+  boost::unique_lock<boost::mutex> scoped_lock( client_mutex_ );
+  if ( im_session_ptr != im_session_ptr_ )
+  {
+    return;
+  }
+
+  ++generator_.get_statistics().connection_errors;
+  close_session();
+  state_ = offline;
+}
+
+//----------------------------------------------------------------------
+
+void im_load_client::on_connect_msg( const im_session_ptr& im_session_ptr,
+  boost::string_view nickname )
+{
+  // Handled by server.
+}
+
+void im_load_client::on_connect_ack_msg(
+  const im_session_ptr& im_session_ptr, boost::string_view ack_message )
+{
+  boost::unique_lock<boost::mutex> scoped_lock( client_mutex_ );
+  generator_.get_statistics().login_latency.record(
+    get_elapsed_nanoseconds( connect_time_ ) );
+  ++generator_.get_statistics().logins;
+  state_ = logged_in;
+}
+
+void im_load_client::on_connect_rfsd_msg(
+  const im_session_ptr& im_session_ptr, boost::string_view error_message )
+{
+  // Most likely the server didn't notice yet that the previous connection
+  // with this nickname was dropped; the generator tries again later.
+  //
+  boost::unique_lock<boost::mutex> scoped_lock( client_mutex_ );
+  ++generator_.get_statistics().logins_refused;
+  close_session();
+  state_ = offline;
+}
+
+void im_load_client::on_message_msg( const im_session_ptr& im_session_ptr,
+  boost::string_view originator_nickname, boost::string_view message )
+{
+  // "<send time>|<padding>", the send time taken from the same (steady)
+  // clock, since all clients live in this process.
+  //
+  std::uint64_t send_nanoseconds = 0;
+  for ( char digit : message )
+  {
+    if ( ( digit < '0' ) || ( digit > '9' ) )
+    {
+      break;
+    }
+    send_nanoseconds = send_nanoseconds * 10 + ( digit - '0' );
+  }
+
+  std::uint64_t now_nanoseconds = get_now_nanoseconds();
+  if ( ( send_nanoseconds > 0 ) && ( send_nanoseconds <= now_nanoseconds ) )
+  {
+    generator_.get_statistics().delivery_latency.record(
+      now_nanoseconds - send_nanoseconds );
+  }
+  ++generator_.get_statistics().messages_delivered;
+}
+
+void im_load_client::on_message_ack_msg(
+  const im_session_ptr& im_session_ptr, boost::string_view ack_message )
+{
+  time_point send_time;
+  boost::unique_lock<boost::mutex> scoped_lock( client_mutex_ );
+  if ( pop_send_time( message_send_times_, send_time ) )
+  {
+    generator_.get_statistics().message_ack_latency.record(
+      get_elapsed_nanoseconds( send_time ) );
+    ++generator_.get_statistics().messages_acknowledged;
+  }
+}
+
+void im_load_client::on_message_rfsd_msg(
+  const im_session_ptr& im_session_ptr, boost::string_view error_message )
+{
+  // The destinatary logged out meanwhile.
+  time_point send_time;
+  boost::unique_lock<boost::mutex> scoped_lock( client_mutex_ );
+  if ( pop_send_time( message_send_times_, send_time ) )
+  {
+    ++generator_.get_statistics().messages_refused;
+  }
+}
+
+void im_load_client::on_list_request_msg(
+  const im_session_ptr& im_session_ptr, boost::string_view cursor,
+  std::size_t page_size )
+{
+  // Handled by server.
+}
+
+void im_load_client::on_list_response_msg(
+  const im_session_ptr& im_session_ptr, boost::string_view nicknames_list )
+{
+  time_point send_time;
+  boost::unique_lock<boost::mutex> scoped_lock( client_mutex_ );
+  if ( pop_send_time( list_send_times_, send_time ) )
+  {
+    generator_.get_statistics().list_latency.record(
+      get_elapsed_nanoseconds( send_time ) );
+    ++generator_.get_statistics().lists_received;
+  }
+}
+
+void im_load_client::on_disconnect_msg( const im_session_ptr& im_session_ptr )
+{
+  // Handled by server.
+}
+
+void im_load_client::on_disconnect_ack_msg(
+  const im_session_ptr& im_session_ptr, boost::string_view ack_message )
+{
+  boost::unique_lock<boost::mutex> scoped_lock( client_mutex_ );
+  if ( state_ != logging_out )
+  {
+    return;
+  }
+
+  ++generator_.get_statistics().logouts;
+  close_session();
+  do_connect();
+}
+
+void im_load_client::on_broadcast_msg( const im_session_ptr& im_session_ptr,
+  boost::string_view broadcast_message )
+{
+  ++generator_.get_statistics().broadcasts_received;
+}
+
+void im_load_client::on_stats_request_msg(
+  const im_session_ptr& im_session_ptr )
+{
+  // Handled by server.
+}
+
+void im_load_client::on_stats_response_msg(
+  const im_session_ptr& im_session_ptr, boost::string_view stats )
+{
+  // Never asked for.
+}
+
+void im_load_client::on_join_msg( const im_session_ptr& im_session_ptr,
+  boost::string_view room )
+{
+  // Handled by server.
+}
+
+void im_load_client::on_join_ack_msg( const im_session_ptr& im_session_ptr,
+  boost::string_view room )
+{
+  // Rooms are never joined.
+}
+
+void im_load_client::on_join_rfsd_msg( const im_session_ptr& im_session_ptr,
+  boost::string_view error_message )
+{
+  // Rooms are never joined.
+}
+
+void im_load_client::on_leave_msg( const im_session_ptr& im_session_ptr,
+  boost::string_view room )
+{
+  // Handled by server.
+}
+
+void im_load_client::on_leave_ack_msg( const im_session_ptr& im_session_ptr,
+  boost::string_view room )
+{
+  // Rooms are never joined.
+}
+
+void im_load_client::on_room_message_msg(
+  const im_session_ptr& im_session_ptr, boost::string_view room,
+  boost::string_view message )
+{
+  // Rooms are never joined.
+}
+
+//----------------------------------------------------------------------
+
+std::uint64_t im_load_client::get_now_nanoseconds()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+//----------------------------------------------------------------------
+// Private methods.
+//----------------------------------------------------------------------
+
+void im_load_client::do_connect()
+{
+  state_ = connecting;
+  connect_time_ = std::chrono::steady_clock::now();
+  socket_ptr_ = std::make_shared<tcp::socket>( io_service_ );
+  im_session_ptr_ = std::make_shared<im_session>( socket_ptr_ );
+
+  auto self( shared_from_this() );
+  im_session_ptr session_ptr = im_session_ptr_;
+  boost::asio::async_connect( *socket_ptr_, endpoint_iterator_,
+    [this, self, session_ptr]( boost::system::error_code ec,
+      tcp::resolver::iterator )
+    {
+      boost::unique_lock<boost::mutex> scoped_lock( client_mutex_ );
+      if ( session_ptr != im_session_ptr_ )
+      {
+        return;
+      }
+
+      if ( ec )
+      {
+        ++generator_.get_statistics().connection_errors;
+        im_session_ptr_.reset();
+        socket_ptr_.reset();
+        state_ = offline;
+        return;
+      }
+
+      session_ptr->start( shared_from_this() );
+      session_ptr->send_message( im_message::build_connect_msg( nickname_,
+        protocol_version_ ) );
+    } );
+}
+
+void im_load_client::close_session()
+{
+  generator_.get_statistics().messages_lost += message_send_times_.size();
+  generator_.get_statistics().lists_lost += list_send_times_.size();
+  message_send_times_.clear();
+  list_send_times_.clear();
+
+  if ( im_session_ptr_ )
+  {
+    im_session_ptr_->disconnect( true );
+    im_session_ptr_.reset();
+  }
+  else if ( socket_ptr_ )
+  {
+    boost::system::error_code ignored_ec;
+    socket_ptr_->close( ignored_ec );
+  }
+  socket_ptr_.reset();
+}
+
+bool im_load_client::pop_send_time( std::deque<time_point>& send_times,
+  time_point& send_time )
+{
+  if ( send_times.empty() )
+  {
+    return false;
+  }
+
+  send_time = send_times.front();
+  send_times.pop_front();
+  return true;
+}
+
+std::uint64_t im_load_client::get_elapsed_nanoseconds( time_point since )
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - since ).count();
+}
@@ -0,0 +1,159 @@
+//
+// im_load_client.h
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#ifndef IM_LOAD_CLIENT_H
+#define IM_LOAD_CLIENT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/thread/mutex.hpp>
+#include "im_message_handler.h"
+#include "im_session.h"
+
+using boost::asio::ip::tcp;
+
+class im_load_generator;
+
+//----------------------------------------------------------------------
+
+// One simulated user of im_loadgen, talking to the server through the
+// same im_session and im_message_handler the real client uses.
+//
+// Requests are sent from the generator's thread, while answers come on
+// the session's handlers, so what both sides touch is guarded by
+// "client_mutex_" (or atomic).
+//
+class im_load_client
+  : public im_session_handler_callback,
+    public im_message_handler_callback,
+    public std::enable_shared_from_this<im_load_client>
+{
+public:
+  enum client_state
+  {
+    offline,
+    connecting,     // connecting or waiting for the login answer
+    logged_in,
+    logging_out     // waiting for the logout answer
+  };
+
+  im_load_client( boost::asio::io_service& io_service,
+    tcp::resolver::iterator endpoint_iterator, std::string nickname,
+    int protocol_version, im_load_generator& generator );
+
+  void start();
+
+  const std::string& get_nickname() const;
+  int get_state() const;
+
+  // Each of these is only acted upon in the right state, and returns
+  // whether it was.
+  //
+  // Connects and logs in.
+  bool connect();
+  // The body starts with the send time, so the destinatary can tell how
+  // long the delivery took.
+  bool send_direct_message( const std::string& destinatary_nickname,
+    std::size_t body_length );
+  bool request_nicknames_list();
+  // Logs out gracefully, and back in once the server acknowledged it.
+  bool log_out_and_in();
+  // Drops the connection without logging out, then connects again.
+  bool reconnect_abruptly();
+
+  // Closes the connection for good.
+  void stop();
+
+  // Inherited from im_session_handler_callback.
+  //
+  void on_message_received( im_session_ptr im_session_ptr,
+    const im_message& msg );
+  void on_error( im_session_ptr im_session_ptr,
+    boost::system::error_code ec );
+
+  // Inherited from im_message_handler_callback.
+  //
+  void on_connect_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view nickname );
+  void on_connect_ack_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view ack_message );
+  void on_connect_rfsd_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view error_message );
+  void on_message_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view originator_nickname, boost::string_view message );
+  void on_message_ack_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view ack_message );
+  void on_message_rfsd_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view error_message );
+  void on_list_request_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view cursor, std::size_t page_size );
+  void on_list_response_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view nicknames_list );
+  void on_disconnect_msg( const im_session_ptr& im_session_ptr );
+  void on_disconnect_ack_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view ack_message );
+  void on_broadcast_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view broadcast_message );
+  void on_stats_request_msg( const im_session_ptr& im_session_ptr );
+  void on_stats_response_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view stats );
+  void on_join_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view room );
+  void on_join_ack_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view room );
+  void on_join_rfsd_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view error_message );
+  void on_leave_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view room );
+  void on_leave_ack_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view room );
+  void on_room_message_msg( const im_session_ptr& im_session_ptr,
+    boost::string_view room, boost::string_view message );
+
+  static std::uint64_t get_now_nanoseconds();
+
+private:
+  typedef std::chrono::steady_clock::time_point time_point;
+
+  void do_connect();
+  // Closes the current session (if any); what was waiting for an answer
+  // on it is counted as lost. Must hold "client_mutex_".
+  void close_session();
+  // Pops the oldest of "send_times", false if it's empty.
+  static bool pop_send_time( std::deque<time_point>& send_times,
+    time_point& send_time );
+  static std::uint64_t get_elapsed_nanoseconds( time_point since );
+
+private:
+  boost::asio::io_service& io_service_;
+  tcp::resolver::iterator endpoint_iterator_;
+  const std::string nickname_;
+  const int protocol_version_;
+  im_load_generator& generator_;
+  im_message_handler im_message_handler_;
+
+  boost::mutex client_mutex_;
+  std::atomic<int> state_;
+  socket_ptr socket_ptr_;
+  im_session_ptr im_session_ptr_;
+  time_point connect_time_;
+  // Answers to a session come in the order of its requests.
+  std::deque<time_point> message_send_times_;
+  std::deque<time_point> list_send_times_;
+};
+
+typedef std::shared_ptr<im_load_client> im_load_client_ptr;
+
+//----------------------------------------------------------------------
+
+#endif // IM_LOAD_CLIENT_H
@@ -0,0 +1,335 @@
+//
+// im_load_generator.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <boost/thread.hpp>
+#include "im_load_generator.h"
+
+//----------------------------------------------------------------------
+// Constructors
+//----------------------------------------------------------------------
+
+im_load_statistics::im_load_statistics()
+  : logins( 0 ),
+    logins_refused( 0 ),
+    logouts( 0 ),
+    abrupt_reconnects( 0 ),
+    connection_errors( 0 ),
+    messages_sent( 0 ),
+    messages_acknowledged( 0 ),
+    messages_refused( 0 ),
+    messages_delivered( 0 ),
+    messages_lost( 0 ),
+    lists_sent( 0 ),
+    lists_received( 0 ),
+    lists_lost( 0 ),
+    broadcasts_received( 0 )
+{
+}
+
+im_load_generator::options::options()
+  : clients_count( 1000 ),
+    threads_count( boost::thread::hardware_concurrency() ),
+    duration_seconds( 10 ),
+    connect_rate( 1000 ),
+    message_rate( 1000 ),
+    list_rate( 10 ),
+    churn_rate( 10 ),
+    storm_interval_seconds( 0 ),
+    storm_fraction( 0.1 ),
+    message_bytes( 64 ),
+    protocol_version( im_message::BINARY_PROTOCOL ),
+    nickname_prefix( "load" ),
+    report_interval_seconds( 1 )
+{
+}
+
+im_load_generator::im_load_generator( boost::asio::io_service& io_service,
+  tcp::resolver::iterator endpoint_iterator, const options& options )
+  : io_service_( io_service ),
+    options_( options ),
+    random_generator_( std::random_device()() )
+{
+  clients_.reserve( options_.clients_count );
+  for ( std::size_t i = 0; i < options_.clients_count; ++i )
+  {
+    clients_.push_back( std::make_shared<im_load_client>( io_service_,
+      endpoint_iterator, options_.nickname_prefix + std::to_string( i ),
+      options_.protocol_version, *this ) );
+    clients_.back()->start();
+  }
+}
+
+//----------------------------------------------------------------------
+// Public methods.
+//----------------------------------------------------------------------
+
+void im_load_generator::run()
+{
+  std::unique_ptr<boost::asio::io_service::work> work_ptr(
+    new boost::asio::io_service::work( io_service_ ) );
+  boost::thread_group io_threads;
+  for ( std::size_t i = 0; i < options_.threads_count; ++i )
+  {
+    io_threads.create_thread( [this](){ io_service_.run(); } );
+  }
+
+  // Logs everyone in before measuring anything else; clients refused or
+  // dropped along the way are retried at the same rate.
+  //
+  time_point start_time = std::chrono::steady_clock::now();
+  double ramp_up_limit_seconds = options_.clients_count
+    / options_.connect_rate + 10;
+  std::uint64_t connects_issued = 0;
+  std::size_t next_client = 0;
+  auto connect_next_offline_client = [this, &next_client]()
+  {
+    for ( std::size_t i = 0; i < clients_.size(); ++i )
+    {
+      im_load_client_ptr& client_ptr = clients_[next_client];
+      next_client = ( next_client + 1 ) % clients_.size();
+      if ( client_ptr->connect() )
+      {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  double elapsed_seconds = 0;
+  while ( ( count_logged_in_clients() < clients_.size() )
+    && ( elapsed_seconds < ramp_up_limit_seconds ) )
+  {
+    std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+    elapsed_seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start_time ).count();
+    issue_due( options_.connect_rate, elapsed_seconds, connects_issued,
+      connect_next_offline_client );
+  }
+  std::printf( "%zu of %zu clients logged in after %.1f s\n",
+    count_logged_in_clients(), clients_.size(), elapsed_seconds );
+
+  // The measured run.
+  //
+  start_time = std::chrono::steady_clock::now();
+  connects_issued = 0;
+  std::uint64_t messages_issued = 0;
+  std::uint64_t lists_issued = 0;
+  std::uint64_t churns_issued = 0;
+  double next_storm_seconds = options_.storm_interval_seconds;
+  double next_report_seconds = options_.report_interval_seconds;
+  std::uniform_int_distribution<std::size_t> destinatary_distribution( 0,
+    clients_.size() - 1 );
+
+  elapsed_seconds = 0;
+  while ( elapsed_seconds < options_.duration_seconds )
+  {
+    std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+    elapsed_seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start_time ).count();
+
+    issue_due( options_.message_rate, elapsed_seconds, messages_issued,
+      [this, &destinatary_distribution]()
+      {
+        im_load_client* client_ptr = pick_logged_in_client();
+        return client_ptr && client_ptr->send_direct_message(
+          clients_[destinatary_distribution( random_generator_ )]
+            ->get_nickname(), options_.message_bytes );
+      } );
+    issue_due( options_.list_rate, elapsed_seconds, lists_issued,
+      [this]()
+      {
+        im_load_client* client_ptr = pick_logged_in_client();
+        return client_ptr && client_ptr->request_nicknames_list();
+      } );
+    issue_due( options_.churn_rate, elapsed_seconds, churns_issued,
+      [this]()
+      {
+        im_load_client* client_ptr = pick_logged_in_client();
+        return client_ptr && client_ptr->log_out_and_in();
+      } );
+    issue_due( options_.connect_rate, elapsed_seconds, connects_issued,
+      connect_next_offline_client );
+
+    if ( ( options_.storm_interval_seconds > 0 )
+      && ( elapsed_seconds >= next_storm_seconds ) )
+    {
+      run_storm();
+      next_storm_seconds += options_.storm_interval_seconds;
+    }
+
+    if ( ( options_.report_interval_seconds > 0 )
+      && ( elapsed_seconds >= next_report_seconds ) )
+    {
+      print_progress( elapsed_seconds );
+      next_report_seconds += options_.report_interval_seconds;
+    }
+  }
+
+  // Gives the answers still on their way a chance to arrive; whatever
+  // doesn't is counted as lost.
+  //
+  time_point grace_end_time = std::chrono::steady_clock::now()
+    + std::chrono::seconds( 2 );
+  while ( ( statistics_.messages_sent > statistics_.messages_acknowledged
+      + statistics_.messages_refused + statistics_.messages_lost )
+    && ( std::chrono::steady_clock::now() < grace_end_time ) )
+  {
+    std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+  }
+
+  for ( auto& client_ptr : clients_ )
+  {
+    client_ptr->stop();
+  }
+
+  work_ptr.reset();
+  io_service_.stop();
+  io_threads.join_all();
+
+  print_report( elapsed_seconds );
+}
+
+im_load_statistics& im_load_generator::get_statistics()
+{
+  return statistics_;
+}
+
+//----------------------------------------------------------------------
+// Private methods.
+//----------------------------------------------------------------------
+
+template<typename Function>
+void im_load_generator::issue_due( double rate, double elapsed_seconds,
+  std::uint64_t& issued, Function issue )
+{
+  std::uint64_t due = static_cast<std::uint64_t>( rate * elapsed_seconds );
+  while ( issued < due )
+  {
+    if ( !issue() )
+    {
+      // Nobody to act on right now; what is due is not made up for later,
+      // so a burst doesn't follow.
+      issued = due;
+      break;
+    }
+    ++issued;
+  }
+}
+
+void im_load_generator::run_storm()
+{
+  std::size_t storm_count = static_cast<std::size_t>(
+    std::ceil( options_.storm_fraction * clients_.size() ) );
+  for ( std::size_t i = 0; i < storm_count; ++i )
+  {
+    im_load_client* client_ptr = pick_logged_in_client();
+    if ( client_ptr )
+    {
+      client_ptr->reconnect_abruptly();
+    }
+  }
+}
+
+im_load_client* im_load_generator::pick_logged_in_client()
+{
+  std::uniform_int_distribution<std::size_t> distribution( 0,
+    clients_.size() - 1 );
+  for ( int i = 0; i < 8; ++i )
+  {
+    im_load_client* client_ptr =
+      clients_[distribution( random_generator_ )].get();
+    if ( client_ptr->get_state() == im_load_client::logged_in )
+    {
+      return client_ptr;
+    }
+  }
+  return nullptr;
+}
+
+std::size_t im_load_generator::count_logged_in_clients() const
+{
+  std::size_t logged_in_count = 0;
+  for ( const auto& client_ptr : clients_ )
+  {
+    if ( client_ptr->get_state() == im_load_client::logged_in )
+    {
+      ++logged_in_count;
+    }
+  }
+  return logged_in_count;
+}
+
+//----------------------------------------------------------------------
+
+void im_load_generator::print_progress( double elapsed_seconds )
+{
+  std::printf( "%6.1f s: %zu logged in, %llu sent, %llu acknowledged, "
+    "%llu delivered, message ack p99 %.1f us\n", elapsed_seconds,
+    count_logged_in_clients(),
+    static_cast<unsigned long long>( statistics_.messages_sent ),
+    static_cast<unsigned long long>( statistics_.messages_acknowledged ),
+    static_cast<unsigned long long>( statistics_.messages_delivered ),
+    statistics_.message_ack_latency.get_percentile( 99 ) / 1000.0 );
+  std::fflush( stdout );
+}
+
+void im_load_generator::print_report( double elapsed_seconds )
+{
+  auto per_second = [elapsed_seconds]( std::uint64_t count )
+  {
+    return ( elapsed_seconds > 0 ) ? count / elapsed_seconds : 0;
+  };
+  auto count = []( const std::atomic<std::uint64_t>& counter )
+  {
+    return static_cast<unsigned long long>( counter.load() );
+  };
+
+  std::printf( "\n%zu clients, %.1f s measured\n", clients_.size(),
+    elapsed_seconds );
+  std::printf( "  logins      %llu (%llu refused), %llu logouts, "
+    "%llu abrupt reconnects, %llu connection errors\n",
+    count( statistics_.logins ), count( statistics_.logins_refused ),
+    count( statistics_.logouts ), count( statistics_.abrupt_reconnects ),
+    count( statistics_.connection_errors ) );
+  std::printf( "  messages    %llu sent (%.1f/s), %llu acknowledged, "
+    "%llu refused, %llu lost\n", count( statistics_.messages_sent ),
+    per_second( statistics_.messages_sent ),
+    count( statistics_.messages_acknowledged ),
+    count( statistics_.messages_refused ),
+    count( statistics_.messages_lost ) );
+  std::printf( "              %llu delivered (%.1f/s)\n",
+    count( statistics_.messages_delivered ),
+    per_second( statistics_.messages_delivered ) );
+  std::printf( "  lists       %llu sent, %llu received, %llu lost\n",
+    count( statistics_.lists_sent ), count( statistics_.lists_received ),
+    count( statistics_.lists_lost ) );
+  std::printf( "  broadcasts  %llu received (%.1f/s)\n",
+    count( statistics_.broadcasts_received ),
+    per_second( statistics_.broadcasts_received ) );
+
+  std::printf( "\n  %-14s %10s %10s %10s %10s %10s %10s\n", "latency (us)",
+    "count", "p50", "p99", "p99.9", "max", "mean" );
+  print_latency( "message ack", statistics_.message_ack_latency );
+  print_latency( "delivery", statistics_.delivery_latency );
+  print_latency( "list", statistics_.list_latency );
+  print_latency( "login", statistics_.login_latency );
+}
+
+void im_load_generator::print_latency( const char* name,
+  const im_latency_histogram& histogram )
+{
+  std::printf( "  %-14s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+    static_cast<unsigned long long>( histogram.get_count() ),
+    histogram.get_percentile( 50 ) / 1000.0,
+    histogram.get_percentile( 99 ) / 1000.0,
+    histogram.get_percentile( 99.9 ) / 1000.0,
+    histogram.get_max() / 1000.0, histogram.get_mean() / 1000.0 );
+}
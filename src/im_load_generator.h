@@ -0,0 +1,132 @@
+//
+// im_load_generator.h
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#ifndef IM_LOAD_GENERATOR_H
+#define IM_LOAD_GENERATOR_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include "im_latency_histogram.h"
+#include "im_load_client.h"
+#include "im_message.hpp"
+
+using boost::asio::ip::tcp;
+
+//----------------------------------------------------------------------
+
+// What im_loadgen counted; updated by every client, from any thread.
+//
+struct im_load_statistics
+{
+  im_load_statistics();
+
+  std::atomic<std::uint64_t> logins;
+  std::atomic<std::uint64_t> logins_refused;
+  std::atomic<std::uint64_t> logouts;
+  std::atomic<std::uint64_t> abrupt_reconnects;
+  std::atomic<std::uint64_t> connection_errors;
+  std::atomic<std::uint64_t> messages_sent;
+  std::atomic<std::uint64_t> messages_acknowledged;
+  std::atomic<std::uint64_t> messages_refused;
+  std::atomic<std::uint64_t> messages_delivered;
+  std::atomic<std::uint64_t> messages_lost;
+  std::atomic<std::uint64_t> lists_sent;
+  std::atomic<std::uint64_t> lists_received;
+  std::atomic<std::uint64_t> lists_lost;
+  std::atomic<std::uint64_t> broadcasts_received;
+
+  // From MESSAGE_MSG sent to MESSAGE_ACK received.
+  im_latency_histogram message_ack_latency;
+  // From MESSAGE_MSG sent to it being received by the destinatary.
+  im_latency_histogram delivery_latency;
+  // From LIST_REQUEST_MSG sent to LIST_RESPONSE_MSG received.
+  im_latency_histogram list_latency;
+  // From connecting to CONNECT_ACK_MSG received.
+  im_latency_histogram login_latency;
+};
+
+//----------------------------------------------------------------------
+
+// Drives "clients_count" im_load_clients against one server: connects them
+// at "connect_rate", then, for "duration_seconds", issues each kind of
+// request at its own target rate (per second, across all clients) from
+// randomly picked logged in clients. Every "storm_interval_seconds", a
+// "storm_fraction" of the clients drop their connections at once and
+// connect again.
+//
+// Logging out and in ("churn_rate") is what makes the server broadcast,
+// as it does for every login and logout.
+//
+class im_load_generator
+{
+public:
+  struct options
+  {
+    options();
+
+    std::size_t clients_count;
+    std::size_t threads_count;
+    double duration_seconds;
+    double connect_rate;
+    double message_rate;
+    double list_rate;
+    double churn_rate;
+    double storm_interval_seconds;
+    double storm_fraction;
+    std::size_t message_bytes;
+    int protocol_version;
+    std::string nickname_prefix;
+    // Seconds between progress lines (0: none).
+    double report_interval_seconds;
+  };
+
+  im_load_generator( boost::asio::io_service& io_service,
+    tcp::resolver::iterator endpoint_iterator, const options& options );
+
+  // Runs the whole test from the calling thread, and prints the report.
+  void run();
+
+  im_load_statistics& get_statistics();
+
+private:
+  typedef std::chrono::steady_clock::time_point time_point;
+
+  void connect_clients( std::size_t clients_count );
+  // Issues whatever is due at "rate" by "elapsed_seconds", given "issued"
+  // were already; "issue" is called with the picked client and returns
+  // whether it could act on it.
+  template<typename Function>
+  void issue_due( double rate, double elapsed_seconds, std::uint64_t& issued,
+    Function issue );
+  void run_storm();
+  // Random client, or nullptr if none was found logged in after a few
+  // tries.
+  im_load_client* pick_logged_in_client();
+  std::size_t count_logged_in_clients() const;
+
+  void print_progress( double elapsed_seconds );
+  void print_report( double elapsed_seconds );
+  static void print_latency( const char* name,
+    const im_latency_histogram& histogram );
+
+private:
+  boost::asio::io_service& io_service_;
+  const options options_;
+  std::vector<im_load_client_ptr> clients_;
+  im_load_statistics statistics_;
+  std::mt19937 random_generator_;
+};
+
+//----------------------------------------------------------------------
+
+#endif // IM_LOAD_GENERATOR_H
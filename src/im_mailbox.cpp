@@ -0,0 +1,846 @@
+//
+// im_mailbox.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "im_mailbox.h"
+
+//----------------------------------------------------------------------
+
+static void encode_little_endian( char* buffer, std::uint64_t number,
+  std::size_t bytes_count )
+{
+  for ( std::size_t i = 0; i < bytes_count; ++i )
+  {
+    buffer[i] = static_cast<char>( ( number >> ( 8 * i ) ) & 0xff );
+  }
+}
+
+static std::uint64_t decode_little_endian( const char* buffer,
+  std::size_t bytes_count )
+{
+  std::uint64_t number = 0;
+  for ( std::size_t i = 0; i < bytes_count; ++i )
+  {
+    number |= static_cast<std::uint64_t>(
+      static_cast<unsigned char>( buffer[i] ) ) << ( 8 * i );
+  }
+  return number;
+}
+
+static void report_error( const char* operation, const std::string& name )
+{
+  std::cerr << "Mailbox -> " << operation << " of \"" << name
+    << "\" failed: " << std::strerror( errno ) << "\n";
+}
+
+//----------------------------------------------------------------------
+// Constructor
+//----------------------------------------------------------------------
+
+im_mailbox::options::options()
+  : directory( "mailbox" ),
+  segment_bytes( 64 * 1024 * 1024 ),
+  commit_bytes( 256 * 1024 ),
+  commit_interval_milliseconds( 5 ),
+  compaction_live_percent( 25 )
+{
+}
+
+im_mailbox::recipient_mailbox::recipient_mailbox()
+  : pending_bytes( 0 ),
+  known_segment_id( 0 ),
+  is_online( false )
+{
+}
+
+im_mailbox::im_mailbox( const options& mailbox_options )
+  : options_( mailbox_options ),
+  next_sequence_( 1 ),
+  pending_messages_count_( 0 ),
+  uncommitted_bytes_( 0 ),
+  is_worker_done_( false ),
+  is_sync_error_reported_( false ),
+  stored_messages_count_( 0 ),
+  delivered_messages_count_( 0 ),
+  commits_count_( 0 ),
+  compactions_count_( 0 )
+{
+  // A segment must hold at least the largest record.
+  if ( options_.segment_bytes < 1024 * 1024 )
+  {
+    throw std::runtime_error( "Mailbox segments can't be under 1 MiB!" );
+  }
+
+  if ( ( ::mkdir( options_.directory.c_str(), 0755 ) != 0 )
+    && ( errno != EEXIST ) )
+  {
+    report_error( "mkdir", options_.directory );
+    throw std::runtime_error( "Unable to create the mailbox directory!" );
+  }
+
+  recover();
+
+  boost::unique_lock<boost::mutex> scoped_lock( mutex_ );
+  if ( !start_new_segment() )
+  {
+    throw std::runtime_error( "Unable to open the mailbox!" );
+  }
+}
+
+im_mailbox::~im_mailbox()
+{
+  stop();
+
+  for ( auto& entry : segments_ )
+  {
+    close_segment( *entry.second, false );
+  }
+}
+
+//----------------------------------------------------------------------
+// Public methods.
+//----------------------------------------------------------------------
+
+void im_mailbox::start()
+{
+  worker_thread_ = boost::thread( [this]() { run_worker(); } );
+}
+
+void im_mailbox::stop()
+{
+  if ( !worker_thread_.joinable() )
+  {
+    return;
+  }
+
+  {
+    boost::unique_lock<boost::mutex> scoped_lock( mutex_ );
+    is_worker_done_ = true;
+    worker_condition_.notify_one();
+  }
+  worker_thread_.join();
+}
+
+void im_mailbox::add_known_user( const std::string& nickname )
+{
+  boost::unique_lock<boost::mutex> scoped_lock( mutex_ );
+  add_recipient( nickname );
+}
+
+bool im_mailbox::is_known_user( boost::string_view nickname )
+{
+  boost::unique_lock<boost::mutex> scoped_lock( mutex_ );
+  return recipients_.find( nickname.to_string() ) != recipients_.end();
+}
+
+im_mailbox::store_result im_mailbox::store_message(
+  boost::string_view recipient, boost::string_view originator,
+  boost::string_view message, stored_callback on_stored )
+{
+  std::string recipient_nickname = recipient.to_string();
+
+  boost::unique_lock<boost::mutex> scoped_lock( mutex_ );
+  auto recipient_iterator = recipients_.find( recipient_nickname );
+  if ( recipient_iterator == recipients_.end() )
+  {
+    return unknown_recipient;
+  }
+
+  recipient_mailbox& mailbox = recipient_iterator->second;
+  if ( mailbox.is_online )
+  {
+    return recipient_online;
+  }
+  if ( ( mailbox.pending.size() >= max_pending_messages )
+    || ( mailbox.pending_bytes + message.length() > max_pending_bytes ) )
+  {
+    return mailbox_full;
+  }
+
+  message_location location = append_record( message_record,
+    next_sequence_, recipient, originator, message );
+  if ( location.length == 0 )
+  {
+    return store_failed;
+  }
+
+  ++next_sequence_;
+  mailbox.pending.push_back( location );
+  mailbox.pending_bytes += message.length();
+  active_segment_ptr_->live_bytes += location.length;
+  ++pending_messages_count_;
+  uncommitted_callbacks_.push_back( std::move( on_stored ) );
+  ++stored_messages_count_;
+  return stored;
+}
+
+std::vector<im_message_ptr> im_mailbox::take_messages(
+  const std::string& recipient )
+{
+  boost::unique_lock<boost::mutex> scoped_lock( mutex_ );
+  auto recipient_iterator = recipients_.find( recipient );
+  if ( recipient_iterator == recipients_.end() )
+  {
+    return std::vector<im_message_ptr>();
+  }
+  return take_pending_messages( recipient, recipient_iterator->second );
+}
+
+std::vector<im_message_ptr> im_mailbox::log_in( const std::string& nickname )
+{
+  boost::unique_lock<boost::mutex> scoped_lock( mutex_ );
+  if ( !add_recipient( nickname ) )
+  {
+    return std::vector<im_message_ptr>();
+  }
+
+  recipient_mailbox& mailbox = recipients_[nickname];
+  mailbox.is_online = true;
+  return take_pending_messages( nickname, mailbox );
+}
+
+void im_mailbox::log_out( const std::string& nickname )
+{
+  boost::unique_lock<boost::mutex> scoped_lock( mutex_ );
+  auto recipient_iterator = recipients_.find( nickname );
+  if ( recipient_iterator != recipients_.end() )
+  {
+    recipient_iterator->second.is_online = false;
+  }
+}
+
+im_mailbox::statistics im_mailbox::get_statistics()
+{
+  statistics mailbox_statistics;
+  mailbox_statistics.stored_messages = stored_messages_count_;
+  mailbox_statistics.delivered_messages = delivered_messages_count_;
+  mailbox_statistics.commits = commits_count_;
+  mailbox_statistics.compactions = compactions_count_;
+
+  boost::unique_lock<boost::mutex> scoped_lock( mutex_ );
+  mailbox_statistics.pending_messages = pending_messages_count_;
+  mailbox_statistics.segments = segments_.size();
+  return mailbox_statistics;
+}
+
+//----------------------------------------------------------------------
+// Private methods.
+//----------------------------------------------------------------------
+
+bool im_mailbox::add_recipient( const std::string& nickname )
+{
+  if ( recipients_.find( nickname ) != recipients_.end() )
+  {
+    return true;
+  }
+
+  message_location location = append_record( known_user_record, 0,
+    nickname, boost::string_view(), boost::string_view() );
+  if ( location.length == 0 )
+  {
+    return false;
+  }
+  recipients_[nickname].known_segment_id = location.segment_id;
+  return true;
+}
+
+std::vector<im_message_ptr> im_mailbox::take_pending_messages(
+  const std::string& recipient, recipient_mailbox& mailbox )
+{
+  std::vector<im_message_ptr> messages;
+  if ( mailbox.pending.empty() )
+  {
+    return messages;
+  }
+
+  messages.reserve( mailbox.pending.size() );
+  for ( const message_location& location : mailbox.pending )
+  {
+    segment& segment = *segments_[location.segment_id];
+    record_view record;
+    if ( read_record( segment, location.offset, record ) )
+    {
+      messages.push_back( im_message::build_message_msg_to_destinatary(
+        record.originator, record.message ) );
+    }
+    segment.live_bytes -= location.length;
+  }
+
+  // Once it's on the disk, none of them is recovered again.
+  append_record( delivered_record, mailbox.pending.back().sequence,
+    recipient, boost::string_view(), boost::string_view() );
+
+  pending_messages_count_ -= mailbox.pending.size();
+  delivered_messages_count_ += mailbox.pending.size();
+  mailbox.pending.clear();
+  mailbox.pending_bytes = 0;
+  return messages;
+}
+
+void im_mailbox::recover()
+{
+  DIR* directory = ::opendir( options_.directory.c_str() );
+  if ( directory == nullptr )
+  {
+    report_error( "opendir", options_.directory );
+    throw std::runtime_error( "Unable to read the mailbox directory!" );
+  }
+
+  std::vector<std::uint64_t> segment_ids;
+  static const char prefix[] = "mailbox.";
+  while ( struct dirent* entry = ::readdir( directory ) )
+  {
+    const char* id_text = entry->d_name + sizeof( prefix ) - 1;
+    if ( ( std::strncmp( entry->d_name, prefix, sizeof( prefix ) - 1 ) != 0 )
+      || ( *id_text == '\0' )
+      || ( std::strspn( id_text, "0123456789" ) != std::strlen( id_text ) ) )
+    {
+      continue;
+    }
+    segment_ids.push_back( std::strtoull( id_text, nullptr, 10 ) );
+  }
+  ::closedir( directory );
+
+  // Replayed in the order they were written, so the latest records win.
+  std::sort( segment_ids.begin(), segment_ids.end() );
+  std::unordered_map<std::string, std::uint64_t> delivered_sequences;
+  for ( std::uint64_t id : segment_ids )
+  {
+    segment_ptr recovered_segment_ptr = open_segment( id, false );
+    if ( !recovered_segment_ptr )
+    {
+      throw std::runtime_error( "Unable to open a mailbox segment!" );
+    }
+    segments_[id] = recovered_segment_ptr;
+    recover_segment( *recovered_segment_ptr, delivered_sequences );
+  }
+
+  // A crash during a compaction may leave a message both in the segment
+  // being compacted and in the one it was being copied to.
+  //
+  for ( auto& entry : recipients_ )
+  {
+    recipient_mailbox& mailbox = entry.second;
+    std::uint64_t delivered_sequence = delivered_sequences[entry.first];
+
+    std::stable_sort( mailbox.pending.begin(), mailbox.pending.end(),
+      []( const message_location& left, const message_location& right )
+      { return left.sequence < right.sequence; } );
+
+    std::deque<message_location> pending;
+    for ( const message_location& location : mailbox.pending )
+    {
+      if ( location.sequence <= delivered_sequence )
+      {
+        continue;
+      }
+      if ( !pending.empty()
+        && ( pending.back().sequence == location.sequence ) )
+      {
+        pending.back() = location;
+        continue;
+      }
+      pending.push_back( location );
+    }
+
+    mailbox.pending.swap( pending );
+    for ( const message_location& location : mailbox.pending )
+    {
+      record_view record;
+      segment& segment = *segments_[location.segment_id];
+      read_record( segment, location.offset, record );
+      mailbox.pending_bytes += record.message.length();
+      segment.live_bytes += location.length;
+    }
+    pending_messages_count_ += mailbox.pending.size();
+  }
+}
+
+void im_mailbox::recover_segment( segment& segment,
+  std::unordered_map<std::string, std::uint64_t>& delivered_sequences )
+{
+  std::size_t offset = 0;
+  record_view record;
+  while ( read_record( segment, offset, record ) )
+  {
+    std::size_t length = decode_little_endian( segment.data + offset, 4 );
+    if ( record.type == known_user_record )
+    {
+      recipients_[record.recipient.to_string()].known_segment_id =
+        segment.id;
+    }
+    else if ( record.type == message_record )
+    {
+      message_location location = { segment.id, offset, length,
+        record.sequence };
+      recipients_[record.recipient.to_string()].pending.push_back(
+        location );
+    }
+    else
+    {
+      std::uint64_t& delivered_sequence =
+        delivered_sequences[record.recipient.to_string()];
+      delivered_sequence = std::max( delivered_sequence, record.sequence );
+    }
+    next_sequence_ = std::max( next_sequence_, record.sequence + 1 );
+    offset += length;
+  }
+
+  // Whatever follows was being written when the server stopped.
+  segment.used_bytes = offset;
+  segment.synced_bytes = offset;
+  if ( offset < segment.mapped_bytes )
+  {
+    std::cerr << "Mailbox -> \"" << get_segment_file_name( segment.id )
+      << "\" truncated at " << offset << " bytes.\n";
+    if ( ::ftruncate( segment.file_descriptor, offset ) != 0 )
+    {
+      report_error( "ftruncate", get_segment_file_name( segment.id ) );
+    }
+  }
+}
+
+im_mailbox::segment_ptr im_mailbox::open_segment( std::uint64_t id,
+  bool is_active )
+{
+  std::string file_name = get_segment_file_name( id );
+  int file_descriptor = ::open( file_name.c_str(),
+    O_RDWR | ( is_active ? O_CREAT | O_EXCL : 0 ) | O_CLOEXEC, 0644 );
+  if ( file_descriptor < 0 )
+  {
+    report_error( "open", file_name );
+    return segment_ptr();
+  }
+
+  // The active segment gets its whole size up front; the others are
+  // only read.
+  //
+  std::size_t file_bytes = options_.segment_bytes;
+  struct stat file_status;
+  if ( is_active )
+  {
+    if ( ::ftruncate( file_descriptor, file_bytes ) != 0 )
+    {
+      report_error( "ftruncate", file_name );
+      ::close( file_descriptor );
+      ::unlink( file_name.c_str() );
+      return segment_ptr();
+    }
+  }
+  else if ( ::fstat( file_descriptor, &file_status ) == 0 )
+  {
+    file_bytes = file_status.st_size;
+  }
+  else
+  {
+    report_error( "fstat", file_name );
+    ::close( file_descriptor );
+    return segment_ptr();
+  }
+
+  void* data = nullptr;
+  if ( file_bytes > 0 )
+  {
+    data = ::mmap( nullptr, file_bytes,
+      is_active ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+      file_descriptor, 0 );
+    if ( data == MAP_FAILED )
+    {
+      report_error( "mmap", file_name );
+      ::close( file_descriptor );
+      return segment_ptr();
+    }
+  }
+
+  segment_ptr new_segment_ptr = std::make_shared<segment>();
+  new_segment_ptr->id = id;
+  new_segment_ptr->file_descriptor = file_descriptor;
+  new_segment_ptr->data = static_cast<char*>( data );
+  new_segment_ptr->mapped_bytes = file_bytes;
+  new_segment_ptr->used_bytes = is_active ? 0 : file_bytes;
+  new_segment_ptr->synced_bytes = new_segment_ptr->used_bytes;
+  new_segment_ptr->live_bytes = 0;
+  return new_segment_ptr;
+}
+
+void im_mailbox::close_segment( segment& segment, bool remove_file )
+{
+  if ( segment.data != nullptr )
+  {
+    ::munmap( segment.data, segment.mapped_bytes );
+    segment.data = nullptr;
+  }
+
+  // Drops what the active segment didn't use.
+  if ( !remove_file && ( segment.used_bytes < segment.mapped_bytes ) )
+  {
+    ::ftruncate( segment.file_descriptor, segment.used_bytes );
+  }
+  ::close( segment.file_descriptor );
+
+  if ( remove_file )
+  {
+    ::unlink( get_segment_file_name( segment.id ).c_str() );
+  }
+}
+
+std::string im_mailbox::get_segment_file_name( std::uint64_t id ) const
+{
+  return options_.directory + "/mailbox." + std::to_string( id );
+}
+
+im_mailbox::message_location im_mailbox::append_record( int type,
+  std::uint64_t sequence, boost::string_view recipient,
+  boost::string_view originator, boost::string_view message )
+{
+  std::size_t fields_length = recipient.length() + originator.length()
+    + message.length();
+  std::size_t length = ( record_header_length + fields_length
+    + record_alignment - 1 ) & ~std::size_t( record_alignment - 1 );
+
+  // Written straight into the mapping, so the message is copied once.
+  message_location location;
+  char* record = reserve_record( length, location );
+  if ( record == nullptr )
+  {
+    return location;
+  }
+
+  encode_little_endian( record + 8, sequence, 8 );
+  encode_little_endian( record + 16, type, 1 );
+  encode_little_endian( record + 17, 0, 1 );
+  encode_little_endian( record + 18, recipient.length(), 2 );
+  encode_little_endian( record + 20, originator.length(), 2 );
+  encode_little_endian( record + 22, 0, 2 );
+  encode_little_endian( record + 24, message.length(), 4 );
+  encode_little_endian( record + 28, 0, 4 );
+
+  char* fields = record + record_header_length;
+  std::memcpy( fields, recipient.data(), recipient.length() );
+  fields += recipient.length();
+  std::memcpy( fields, originator.data(), originator.length() );
+  fields += originator.length();
+  std::memcpy( fields, message.data(), message.length() );
+  std::memset( fields + message.length(), 0,
+    length - record_header_length - fields_length );
+
+  encode_little_endian( record + 4,
+    get_checksum( record + 8, length - 8 ), 4 );
+  // The length goes last: until it's there, the record doesn't exist.
+  encode_little_endian( record, length, 4 );
+
+  location.sequence = sequence;
+  return location;
+}
+
+im_mailbox::message_location im_mailbox::append_copy( const char* record,
+  std::size_t length, std::uint64_t sequence )
+{
+  message_location location;
+  char* copy = reserve_record( length, location );
+  if ( copy != nullptr )
+  {
+    std::memcpy( copy, record, length );
+    location.sequence = sequence;
+  }
+  return location;
+}
+
+char* im_mailbox::reserve_record( std::size_t length,
+  message_location& location )
+{
+  location.segment_id = 0;
+  location.offset = 0;
+  location.length = 0;
+  location.sequence = 0;
+
+  if ( ( active_segment_ptr_->used_bytes + length
+    > active_segment_ptr_->mapped_bytes ) && !start_new_segment() )
+  {
+    return nullptr;
+  }
+
+  segment& segment = *active_segment_ptr_;
+  location.segment_id = segment.id;
+  location.offset = segment.used_bytes;
+  location.length = length;
+  segment.used_bytes += length;
+
+  // The worker sleeps until there's something to commit, and then
+  // waits for the group to fill up.
+  //
+  if ( ( uncommitted_bytes_ == 0 )
+    || ( uncommitted_bytes_ < options_.commit_bytes
+      && uncommitted_bytes_ + length >= options_.commit_bytes ) )
+  {
+    worker_condition_.notify_one();
+  }
+  uncommitted_bytes_ += length;
+
+  return segment.data + location.offset;
+}
+
+bool im_mailbox::start_new_segment()
+{
+  std::uint64_t id = 1;
+  if ( !segments_.empty() )
+  {
+    id = segments_.rbegin()->first + 1;
+  }
+
+  segment_ptr new_segment_ptr = open_segment( id, true );
+  if ( !new_segment_ptr )
+  {
+    return false;
+  }
+
+  // The segment being sealed keeps its mapping while it has pending
+  // messages; only its unused tail goes.
+  //
+  if ( active_segment_ptr_ && ( ::ftruncate(
+    active_segment_ptr_->file_descriptor,
+    active_segment_ptr_->used_bytes ) != 0 ) )
+  {
+    report_error( "ftruncate",
+      get_segment_file_name( active_segment_ptr_->id ) );
+  }
+
+  segments_[id] = new_segment_ptr;
+  active_segment_ptr_ = new_segment_ptr;
+  return true;
+}
+
+bool im_mailbox::read_record( const segment& segment, std::size_t offset,
+  record_view& record ) const
+{
+  if ( offset + record_header_length > segment.used_bytes )
+  {
+    return false;
+  }
+
+  const char* data = segment.data + offset;
+  std::size_t length = decode_little_endian( data, 4 );
+  if ( ( length < record_header_length )
+    || ( length % record_alignment != 0 )
+    || ( length > segment.used_bytes - offset )
+    || ( decode_little_endian( data + 4, 4 )
+      != get_checksum( data + 8, length - 8 ) ) )
+  {
+    return false;
+  }
+
+  record.sequence = decode_little_endian( data + 8, 8 );
+  record.type = static_cast<int>( decode_little_endian( data + 16, 1 ) );
+  std::size_t recipient_length = decode_little_endian( data + 18, 2 );
+  std::size_t originator_length = decode_little_endian( data + 20, 2 );
+  std::size_t message_length = decode_little_endian( data + 24, 4 );
+  if ( ( record.type < known_user_record )
+    || ( record.type > delivered_record )
+    || ( recipient_length + originator_length + message_length
+      > length - record_header_length ) )
+  {
+    return false;
+  }
+
+  const char* fields = data + record_header_length;
+  record.recipient = boost::string_view( fields, recipient_length );
+  fields += recipient_length;
+  record.originator = boost::string_view( fields, originator_length );
+  fields += originator_length;
+  record.message = boost::string_view( fields, message_length );
+  return true;
+}
+
+void im_mailbox::run_worker()
+{
+  boost::unique_lock<boost::mutex> scoped_lock( mutex_ );
+  for (;;)
+  {
+    if ( uncommitted_bytes_ == 0 )
+    {
+      if ( is_worker_done_ )
+      {
+        break;
+      }
+
+      // Nothing to commit; the timeout only paces compactions.
+      worker_condition_.timed_wait( scoped_lock,
+        boost::posix_time::seconds( 1 ) );
+    }
+
+    // Gives the records stored meanwhile a chance to share the commit.
+    if ( ( uncommitted_bytes_ > 0 )
+      && ( uncommitted_bytes_ < options_.commit_bytes ) && !is_worker_done_ )
+    {
+      worker_condition_.timed_wait( scoped_lock,
+        boost::posix_time::milliseconds(
+          options_.commit_interval_milliseconds ) );
+    }
+
+    scoped_lock.unlock();
+    commit();
+    if ( is_compaction_due() )
+    {
+      compact_oldest_segment();
+    }
+    scoped_lock.lock();
+  }
+}
+
+void im_mailbox::commit()
+{
+  struct sync_range
+  {
+    segment_ptr synced_segment_ptr;
+    std::size_t start;
+    std::size_t end;
+  };
+
+  std::vector<sync_range> sync_ranges;
+  std::vector<stored_callback> callbacks;
+  {
+    boost::unique_lock<boost::mutex> scoped_lock( mutex_ );
+    if ( uncommitted_bytes_ == 0 )
+    {
+      return;
+    }
+
+    for ( auto& entry : segments_ )
+    {
+      segment& segment = *entry.second;
+      if ( segment.synced_bytes < segment.used_bytes )
+      {
+        sync_ranges.push_back( sync_range{ entry.second,
+          segment.synced_bytes, segment.used_bytes } );
+        segment.synced_bytes = segment.used_bytes;
+      }
+    }
+    callbacks.swap( uncommitted_callbacks_ );
+    uncommitted_bytes_ = 0;
+  }
+
+  // Records are only appended past what's being synced, and segments are
+  // only unmapped by this thread, so the mutex isn't needed here.
+  //
+  std::size_t page_size = ::sysconf( _SC_PAGESIZE );
+  for ( const sync_range& range : sync_ranges )
+  {
+    // msync() wants a page aligned start.
+    std::size_t sync_start = range.start & ~( page_size - 1 );
+    if ( ( ::msync( range.synced_segment_ptr->data + sync_start,
+      range.end - sync_start, MS_SYNC ) != 0 ) && !is_sync_error_reported_ )
+    {
+      report_error( "msync",
+        get_segment_file_name( range.synced_segment_ptr->id ) );
+      is_sync_error_reported_ = true;
+    }
+  }
+  ++commits_count_;
+
+  for ( stored_callback& on_stored : callbacks )
+  {
+    if ( on_stored )
+    {
+      on_stored();
+    }
+  }
+}
+
+bool im_mailbox::is_compaction_due()
+{
+  boost::unique_lock<boost::mutex> scoped_lock( mutex_ );
+  if ( segments_.size() < 2 )
+  {
+    return false;
+  }
+
+  const segment& oldest_segment = *segments_.begin()->second;
+  return oldest_segment.live_bytes * 100
+    <= oldest_segment.used_bytes * options_.compaction_live_percent;
+}
+
+void im_mailbox::compact_oldest_segment()
+{
+  segment_ptr oldest_segment_ptr;
+  {
+    boost::unique_lock<boost::mutex> scoped_lock( mutex_ );
+    oldest_segment_ptr = segments_.begin()->second;
+    if ( oldest_segment_ptr == active_segment_ptr_ )
+    {
+      return;
+    }
+
+    // Its delivered records can go: anything they refer to is in this
+    // segment or in an older one, which is already gone.
+    //
+    std::uint64_t oldest_id = oldest_segment_ptr->id;
+    for ( auto& entry : recipients_ )
+    {
+      recipient_mailbox& mailbox = entry.second;
+      if ( mailbox.known_segment_id == oldest_id )
+      {
+        message_location location = append_record( known_user_record, 0,
+          entry.first, boost::string_view(), boost::string_view() );
+        if ( location.length == 0 )
+        {
+          return;
+        }
+        mailbox.known_segment_id = location.segment_id;
+      }
+
+      for ( message_location& location : mailbox.pending )
+      {
+        if ( location.segment_id != oldest_id )
+        {
+          continue;
+        }
+
+        message_location new_location = append_copy(
+          oldest_segment_ptr->data + location.offset, location.length,
+          location.sequence );
+        if ( new_location.length == 0 )
+        {
+          return;
+        }
+        oldest_segment_ptr->live_bytes -= location.length;
+        segments_[new_location.segment_id]->live_bytes +=
+          new_location.length;
+        location = new_location;
+      }
+    }
+    segments_.erase( oldest_id );
+  }
+
+  // The copies must be on the disk before the originals go.
+  commit();
+  close_segment( *oldest_segment_ptr, true );
+  ++compactions_count_;
+}
+
+std::uint32_t im_mailbox::get_checksum( const char* data,
+  std::size_t length )
+{
+  // FNV-1a: enough to tell a torn record from a whole one.
+  std::uint32_t checksum = 2166136261u;
+  for ( std::size_t i = 0; i < length; ++i )
+  {
+    checksum ^= static_cast<unsigned char>( data[i] );
+    checksum *= 16777619u;
+  }
+  return checksum;
+}
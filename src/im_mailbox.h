@@ -0,0 +1,263 @@
+//
+// im_mailbox.h
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#ifndef IM_MAILBOX_H
+#define IM_MAILBOX_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility/string_view.hpp>
+#include "im_message.hpp"
+
+//----------------------------------------------------------------------
+
+// Keeps the messages sent to users that are offline until they log in
+// again. Users are known once they logged in; messages to anybody else are
+// still refused.
+//
+// Everything goes to an append-only store of segment files
+// ("mailbox.<id>" in the mailbox directory), each one mapped in whole, so
+// storing a message is a copy into the active segment plus an index
+// update. Records are forced to the disk in groups by a worker thread,
+// which only then calls the "on_stored" callback of each of them: whoever
+// sent a message only gets it acknowledged once it's durable.
+//
+// Taking a user's messages leaves a record saying so, so messages are
+// never delivered twice. Users are marked online as they're taken at
+// login, so a message can't be stored after that and wait for the next
+// one. The same worker compacts the oldest segment once most of what it
+// holds was delivered: whatever is still pending there is copied to the
+// active segment, and the file is removed.
+//
+// All of it may be called from any thread.
+//
+class im_mailbox
+{
+public:
+  // Bounds what a single user can have waiting, so it's all handed to
+  // the session in one go without overflowing its write queue.
+  //
+  enum { max_pending_messages = 1000 };
+  enum { max_pending_bytes = 1024 * 1024 };
+
+  // Outcome of store_message().
+  //
+  enum store_result
+  {
+    stored,
+    unknown_recipient,
+    mailbox_full,
+    store_failed,
+    recipient_online  // logged in meanwhile: it should be relayed
+  };
+
+  struct options
+  {
+    options();
+
+    std::string directory;
+    // Size at which a new segment is started.
+    std::size_t segment_bytes;
+    // Group commit: stored records are forced to the disk once this many
+    // bytes are waiting, or once the oldest of them waited this long.
+    std::size_t commit_bytes;
+    unsigned int commit_interval_milliseconds;
+    // The oldest segment is compacted once no more than this percentage
+    // of it is still pending.
+    unsigned int compaction_live_percent;
+  };
+
+  struct statistics
+  {
+    std::uint64_t stored_messages;
+    std::uint64_t delivered_messages;
+    std::uint64_t pending_messages;
+    std::uint64_t commits;
+    std::uint64_t compactions;
+    std::uint64_t segments;
+  };
+
+  typedef std::function<void()> stored_callback;
+
+  // Reads the segments already in the directory, which is created if
+  // needed. Throws std::runtime_error if the store can't be opened.
+  //
+  explicit im_mailbox( const options& mailbox_options );
+  ~im_mailbox();
+
+  // Starts and stops the worker thread.
+  void start();
+  void stop();
+
+  // Called on every login; only appends a record the first time.
+  void add_known_user( const std::string& nickname );
+  bool is_known_user( boost::string_view nickname );
+
+  // Marks the user as known and online, and takes whatever was waiting 
+  // (see take_messages()). Must be called once the user can be found 
+  // online, and log_out() before it can't any more.
+  //
+  std::vector<im_message_ptr> log_in( const std::string& nickname );
+  void log_out( const std::string& nickname );
+
+  // "on_stored" is called from the worker thread once the message is on
+  // the disk, and only when the result is "stored".
+  //
+  store_result store_message( boost::string_view recipient,
+    boost::string_view originator, boost::string_view message,
+    stored_callback on_stored );
+
+  // Every message waiting for "recipient", oldest first, built as the
+  // MESSAGE_MSG it would have got had it been online.
+  //
+  std::vector<im_message_ptr> take_messages( const std::string& recipient );
+
+  statistics get_statistics();
+
+private:
+  enum record_type
+  {
+    known_user_record = 1,
+    message_record,
+    delivered_record
+  };
+
+  // Every record starts with this header (little-endian, like the binary
+  // protocol), followed by the recipient, the originator and the message,
+  // padded to "record_alignment" bytes. A zero length or a checksum that
+  // doesn't match ends a segment: it's what is left of a crash.
+  //
+  //   offset  size  field
+  //        0     4  record length, header and padding included
+  //        4     4  checksum of everything after it
+  //        8     8  sequence number (for delivered_record, the last one
+  //                 delivered)
+  //       16     1  record type
+  //       17     1  reserved
+  //       18     2  recipient length
+  //       20     2  originator length
+  //       22     2  reserved
+  //       24     4  message length
+  //       28     4  reserved
+  //
+  enum { record_header_length = 32 };
+  enum { record_alignment = 8 };
+
+  struct segment
+  {
+    std::uint64_t id;
+    int file_descriptor;
+    char* data;
+    std::size_t mapped_bytes;
+    // Appended so far, and what of it was already forced to the disk.
+    std::size_t used_bytes;
+    std::size_t synced_bytes;
+    // Bytes of pending messages in it.
+    std::size_t live_bytes;
+  };
+
+  typedef std::shared_ptr<segment> segment_ptr;
+
+  struct message_location
+  {
+    std::uint64_t segment_id;
+    std::size_t offset;
+    std::size_t length;
+    std::uint64_t sequence;
+  };
+
+  struct recipient_mailbox
+  {
+    recipient_mailbox();
+
+    std::deque<message_location> pending;
+    std::size_t pending_bytes;
+    std::uint64_t known_segment_id;
+    bool is_online;
+  };
+
+  struct record_view
+  {
+    int type;
+    std::uint64_t sequence;
+    boost::string_view recipient;
+    boost::string_view originator;
+    boost::string_view message;
+  };
+
+  // Must be called with "mutex_" held.
+  bool add_recipient( const std::string& nickname );
+  std::vector<im_message_ptr> take_pending_messages( 
+    const std::string& recipient, recipient_mailbox& mailbox );
+
+  void recover();
+  void recover_segment( segment& segment,
+    std::unordered_map<std::string, std::uint64_t>& delivered_sequences );
+  segment_ptr open_segment( std::uint64_t id, bool is_active );
+  void close_segment( segment& segment, bool remove_file );
+  std::string get_segment_file_name( std::uint64_t id ) const;
+
+  // Must be called with "mutex_" held. A location with no length means
+  // the record couldn't be appended.
+  //
+  message_location append_record( int type, std::uint64_t sequence,
+    boost::string_view recipient, boost::string_view originator,
+    boost::string_view message );
+  message_location append_copy( const char* record, std::size_t length,
+    std::uint64_t sequence );
+  char* reserve_record( std::size_t length, message_location& location );
+  bool start_new_segment();
+  bool read_record( const segment& segment, std::size_t offset,
+    record_view& record ) const;
+
+  void run_worker();
+  void commit();
+  void compact_oldest_segment();
+  bool is_compaction_due();
+
+  static std::uint32_t get_checksum( const char* data, std::size_t length );
+
+private:
+  const options options_;
+
+  // Guards everything below, up to the worker's own state.
+  boost::mutex mutex_;
+  std::map<std::uint64_t, segment_ptr> segments_;
+  segment_ptr active_segment_ptr_;
+  std::unordered_map<std::string, recipient_mailbox> recipients_;
+  std::uint64_t next_sequence_;
+  std::uint64_t pending_messages_count_;
+  // Callbacks of the records appended since the last commit.
+  std::vector<stored_callback> uncommitted_callbacks_;
+  std::size_t uncommitted_bytes_;
+
+  boost::condition_variable worker_condition_;
+  bool is_worker_done_;
+  boost::thread worker_thread_;
+  // Only touched by the worker.
+  bool is_sync_error_reported_;
+
+  std::atomic<std::uint64_t> stored_messages_count_;
+  std::atomic<std::uint64_t> delivered_messages_count_;
+  std::atomic<std::uint64_t> commits_count_;
+  std::atomic<std::uint64_t> compactions_count_;
+};
+
+//----------------------------------------------------------------------
+
+#endif // IM_MAILBOX_H
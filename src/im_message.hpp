@@ -14,12 +14,18 @@
 #ifndef IM_MESSAGE_HPP
 #define IM_MESSAGE_HPP
 
+#include <algorithm>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <deque>
 #include <list>
-#include <boost/algorithm/string.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+#include "im_message_pool.h"
 
 //----------------------------------------------------------------------
 
@@ -28,17 +34,100 @@ typedef std::shared_ptr<im_message> im_message_ptr;
 
 //----------------------------------------------------------------------
 
+// Walks a "|" separated value once, handing out views of its fields; 
+// nothing is copied or allocated. The value doesn't need a terminating 
+// NUL, since only its given length is looked at.
+//
+class im_field_parser
+{
+public:
+  explicit im_field_parser( boost::string_view value )
+    : value_( value ),
+      position_( 0 ),
+      is_done_( false )
+  {
+  }
+
+  // False once every field (an empty value having a single empty one) 
+  // was handed out.
+  //
+  bool next( boost::string_view& field )
+  {
+    if ( is_done_ )
+    {
+      return false;
+    }
+
+    const char* separator = static_cast<const char*>( std::memchr( 
+      value_.data() + position_, '|', value_.length() - position_ ) );
+    std::size_t field_end = ( separator == nullptr ) 
+      ? value_.length() : separator - value_.data();
+    field = value_.substr( position_, field_end - position_ );
+    position_ = field_end + 1;
+    is_done_ = ( separator == nullptr );
+    return true;
+  }
+
+  // What the following calls to "next" would walk through.
+  //
+  boost::string_view rest() const
+  {
+    return is_done_ ? boost::string_view() : value_.substr( position_ );
+  }
+
+private:
+  boost::string_view value_;
+  std::size_t position_;
+  bool is_done_;
+};
+
+//----------------------------------------------------------------------
+
 class im_message
 {
 public:
   enum { type_length = 2 };
   enum { length_length = 4 };
+  enum { header_length = type_length + length_length };
+  enum { binary_header_length = 16 };
   enum { max_destinatary_length = 128 };
   enum { max_message_length = 512 };
   enum { default_separator_length = 2 };
   enum { max_value_length = max_destinatary_length 
     + default_separator_length + max_message_length };
 
+  // Storage is sized to the frame: frames up to "inline_capacity" bytes 
+  // (header, value and the terminating NUL) live inside the object, larger 
+  // ones in a heap buffer rounded up to a size class, from 
+  // "min_size_class" growing 4x up to "max_size_class".
+  //
+  // "max_value_length" is still the largest value every build accepts, so 
+  // it is the limit for LEGACY_PROTOCOL peers; BINARY_PROTOCOL peers take 
+  // values up to "max_binary_value_length".
+  //
+  enum { inline_capacity = 64 };
+  enum { min_size_class = 256 };
+  enum { max_size_class = 64 * 1024 };
+  enum { max_binary_value_length = max_size_class - header_length - 1 };
+
+  // LIST_REQUEST_MSG may carry "<cursor>|<page size>" to ask for one page 
+  // of the (sorted) nicknames following <cursor>, an empty cursor meaning 
+  // the first page. Such requests are answered with 
+  // "<total>|<next cursor>|<nickname>|...", where an empty next cursor 
+  // means it was the last page. Empty requests get the whole list, 
+  // truncated to "max_value_length", as always.
+  //
+  enum { max_list_page_size = 1000 };
+
+  // Rooms are named like nicknames. JOIN_MSG, LEAVE_MSG and their answers 
+  // carry just the room name (JOIN_RFSD_MSG the reason instead); 
+  // ROOM_MESSAGE_MSG carries "<room>|<message>" when sent to the server, 
+  // and "<room>|<originator nickname>|<message>" when delivered to the 
+  // members, the room being the first field.
+  //
+  enum { max_room_name_length = max_destinatary_length };
+  enum { max_joined_rooms = 32 };
+
   enum MessageTypes {
     PRIOR_FIRST_MESSAGE = 0,
     CONNECT_MSG = 1,
@@ -52,16 +141,83 @@ public:
     DISCONNECT_MSG,
     DISCONNECT_ACK_MSG,
     BROADCAST_MSG,
+    STATS_REQUEST_MSG,
+    STATS_RESPONSE_MSG,
+    JOIN_MSG,
+    JOIN_ACK_MSG,
+    JOIN_RFSD_MSG,
+    LEAVE_MSG,
+    LEAVE_ACK_MSG,
+    ROOM_MESSAGE_MSG,
     AFTER_LAST_MESSAGE
   };
 
+  // Wire formats. LEGACY_PROTOCOL is the ASCII "TTLLLL" header every 
+  // build understands; BINARY_PROTOCOL is negotiated on CONNECT_MSG and 
+  // uses a fixed little-endian header:
+  //
+  //   offset  size  field
+  //        0     1  protocol version (2)
+  //        1     1  message type
+  //        2     2  flags
+  //        4     4  sequence number
+  //        8     4  value length
+  //       12     2  length of the first field (the nickname of MESSAGE_MSG)
+  //       14     2  reserved
+  //
+  // The value keeps the legacy layout, so a frame is encoded once and 
+  // either header can be put in front of it; with BINARY_PROTOCOL the 
+  // fields are delimited by the header and never by looking for "|".
+  //
+  enum ProtocolVersions {
+    LEGACY_PROTOCOL = 1,
+    BINARY_PROTOCOL = 2
+  };
+
   //static const std::string DEFAULT_SEPARATOR;
 
   //----------------------------------------------------------------------
 
   im_message()
-    : value_length_(0)
+    : data_(inline_data_),
+      capacity_(inline_capacity),
+      value_length_(0),
+      type_(PRIOR_FIRST_MESSAGE),
+      field_length_(0),
+      flags_(0),
+      sequence_(0)
+  {
+  }
+
+  im_message(const im_message& other)
+    : data_(inline_data_),
+      capacity_(inline_capacity),
+      value_length_(0)
+  {
+    *this = other;
+  }
+
+  im_message& operator=(const im_message& other)
+  {
+    if (this != &other)
+    {
+      reserve(other.length() + 1);
+      std::memcpy(data_, other.data_, other.length() + 1);
+      value_length_ = other.value_length_;
+      type_ = other.type_;
+      field_length_ = other.field_length_;
+      flags_ = other.flags_;
+      sequence_ = other.sequence_;
+    }
+    return *this;
+  }
+
+  ~im_message()
   {
+    if (data_ != inline_data_)
+    {
+      delete[] data_;
+    }
   }
 
   const char* data() const
@@ -109,11 +265,16 @@ public:
     return value_length_;
   }
 
+  // Also makes room for the value (and its terminating NUL), so value() 
+  // must only be taken after calling it. Longer values than any frame can 
+  // carry are cut short, so the server refuses to relay those instead.
+  //
   void value_length(std::size_t new_length)
   {
     value_length_ = new_length;
-    if (value_length_ > max_value_length)
-      value_length_ = max_value_length;
+    if (value_length_ > max_binary_value_length)
+      value_length_ = max_binary_value_length;
+    reserve(header_length + value_length_ + 1);
   }
 
   bool decode_length()
@@ -121,16 +282,25 @@ public:
     char length[length_length + 1] = "";
     std::strncat(length, data_ + type_length, length_length);
     value_length_ = std::atoi(length);
+    field_length_ = 0;
     if (value_length_ > max_value_length)
     {
       value_length_ = 0;
       return false;
     }
+    reserve(header_length + value_length_ + 1);
     return true;
   }
 
+  // Values only BINARY_PROTOCOL can carry get a header no build accepts.
+  //
   void encode_length()
   {
+    if (value_length_ > max_value_length)
+    {
+      std::memset(data_ + type_length, '?', length_length);
+      return;
+    }
     char length[length_length + 1] = "";
     std::sprintf(length, "%4d", static_cast<int>(value_length_));
     std::memcpy(data_ + type_length, length, length_length);
@@ -155,9 +325,58 @@ public:
     std::memcpy(data_, type, type_length);
   }
 
+  // Writes the BINARY_PROTOCOL header for this message into "header", 
+  // which must have room for "binary_header_length" bytes.
+  //
+  void encode_binary_header( char* header, std::uint32_t sequence, 
+    std::uint16_t flags = 0 ) const
+  {
+    header[0] = static_cast<char>( BINARY_PROTOCOL );
+    header[1] = static_cast<char>( type_ );
+    encode_little_endian( header + 2, flags, 2 );
+    encode_little_endian( header + 4, sequence, 4 );
+    encode_little_endian( header + 8, value_length_, 4 );
+    encode_little_endian( header + 12, field_length_, 2 );
+    encode_little_endian( header + 14, 0, 2 );
+  }
+
+  bool decode_binary_header( const char* header )
+  {
+    if ( static_cast<unsigned char>( header[0] ) != BINARY_PROTOCOL )
+    {
+      return false;
+    }
+    type_ = static_cast<unsigned char>( header[1] );
+    flags_ = static_cast<std::uint16_t>( decode_little_endian( header + 2, 2 ) );
+    sequence_ = static_cast<std::uint32_t>( decode_little_endian( header + 4, 4 ) );
+    value_length_ = decode_little_endian( header + 8, 4 );
+    field_length_ = decode_little_endian( header + 12, 2 );
+    if ( !is_valid_message() || ( value_length_ > max_binary_value_length ) 
+      || ( field_length_ > value_length_ ) )
+    {
+      value_length_ = 0;
+      field_length_ = 0;
+      return false;
+    }
+    reserve(header_length + value_length_ + 1);
+    return true;
+  }
+
+  std::uint16_t flags() const
+  {
+    return flags_;
+  }
+
+  std::uint32_t sequence() const
+  {
+    return sequence_;
+  }
+
   void clear()
   {
-    memset( data_, 0, type_length + length_length + max_value_length );
+    value_length_ = 0;
+    field_length_ = 0;
+    memset( data_, 0, header_length + 1 );
   }
 
   //----------------------------------------------------------------------
@@ -166,7 +385,7 @@ public:
   {
     type_ = CONNECT_MSG;
     value_length(std::strlen(nickname));
-    std::memcpy(value(), nickname, std::strlen(nickname));
+    std::memcpy(value(), nickname, value_length());
     encode_type();
     encode_length();
   }
@@ -183,7 +402,7 @@ public:
   {
     type_ = CONNECT_RFSD_MSG;
     value_length(std::strlen(error_message));
-    std::memcpy(value(), error_message, std::strlen(error_message));
+    std::memcpy(value(), error_message, value_length());
     encode_type();
     encode_length();
   }
@@ -193,8 +412,9 @@ public:
     type_ = MESSAGE_MSG;
     std::string message_value = build_message_value( 
       destinatary_nickname, message );
+    field_length_ = std::strlen( destinatary_nickname );
     value_length(message_value.length());
-    std::memcpy(value(), message_value.c_str(), message_value.length());
+    std::memcpy(value(), message_value.c_str(), value_length());
     encode_type();
     encode_length();
   }
@@ -211,7 +431,7 @@ public:
   {
     type_ = MESSAGE_RFSD_MSG;
     value_length(std::strlen(error_message));
-    std::memcpy(value(), error_message, std::strlen(error_message));
+    std::memcpy(value(), error_message, value_length());
     encode_type();
     encode_length();
   }
@@ -231,7 +451,7 @@ public:
       build_list_response_value( nicknames_list );
     value_length(list_response_value.length());
     std::memcpy(value(), list_response_value.c_str(), 
-      list_response_value.length());
+      value_length());
     encode_type();
     encode_length();
   }
@@ -256,30 +476,51 @@ public:
   {
     type_ = BROADCAST_MSG;
     value_length(std::strlen(broadcast_message));
-    std::memcpy(value(), broadcast_message, std::strlen(broadcast_message));
+    std::memcpy(value(), broadcast_message, value_length());
     encode_type();
     encode_length();
   }
 
   //----------------------------------------------------------------------
 
-  static im_message_ptr build_connect_msg( std::string nickname )
+  // New messages, together with their reference count, are taken from the 
+  // calling thread's im_message_pool and go back to it with the last 
+  // reference.
+  //
+  static im_message_ptr create()
   {
-    im_message_ptr new_message_ptr = std::make_shared<im_message>();
+    return std::allocate_shared<im_message>(
+      im_message_pool_allocator<im_message>());
+  }
+
+  // A "protocol_version" other than LEGACY_PROTOCOL is appended after a 
+  // NUL, where builds reading the value as a C string never look.
+  //
+  static im_message_ptr build_connect_msg( std::string nickname, 
+    int protocol_version = LEGACY_PROTOCOL )
+  {
+    im_message_ptr new_message_ptr = create();
     new_message_ptr->type_ = CONNECT_MSG;
-    new_message_ptr->value_length(nickname.length());
-    std::memcpy(new_message_ptr->value(), nickname.c_str(), nickname.length());
+    std::string connect_value = build_versioned_value( 
+      nickname, protocol_version );
+    new_message_ptr->value_length(connect_value.length());
+    std::memcpy(new_message_ptr->value(), connect_value.data(), 
+      new_message_ptr->value_length());
     new_message_ptr->encode_type();
     new_message_ptr->encode_length();
     return new_message_ptr;
   }
 
-  static im_message_ptr build_connect_ack_msg( std::string ack_message )
+  static im_message_ptr build_connect_ack_msg( std::string ack_message, 
+    int protocol_version = LEGACY_PROTOCOL )
   {
-    im_message_ptr new_message_ptr = std::make_shared<im_message>();
+    im_message_ptr new_message_ptr = create();
     new_message_ptr->type_ = CONNECT_ACK_MSG;
-    new_message_ptr->value_length(ack_message.length());
-    std::memcpy(new_message_ptr->value(), ack_message.c_str(), ack_message.length());
+    std::string ack_value = build_versioned_value( 
+      ack_message, protocol_version );
+    new_message_ptr->value_length(ack_value.length());
+    std::memcpy(new_message_ptr->value(), ack_value.data(), 
+      new_message_ptr->value_length());
     new_message_ptr->encode_type();
     new_message_ptr->encode_length();
     return new_message_ptr;
@@ -287,11 +528,11 @@ public:
 
   static im_message_ptr build_connect_rfsd_msg( std::string error_message )
   {
-    im_message_ptr new_message_ptr = std::make_shared<im_message>();
+    im_message_ptr new_message_ptr = create();
     new_message_ptr->type_ = CONNECT_RFSD_MSG;
     new_message_ptr->value_length(error_message.length());
     std::memcpy(new_message_ptr->value(), error_message.c_str(), 
-      error_message.length());
+      new_message_ptr->value_length());
     new_message_ptr->encode_type();
     new_message_ptr->encode_length();
     return new_message_ptr;
@@ -300,28 +541,36 @@ public:
   static im_message_ptr build_message_msg_from_originator( 
     std::string destinatary_nickname, std::string message )
   {
-    im_message_ptr new_message_ptr = std::make_shared<im_message>();
+    im_message_ptr new_message_ptr = create();
     new_message_ptr->type_ = MESSAGE_MSG;
     std::string message_value = build_message_value( 
       destinatary_nickname, message );
+    new_message_ptr->field_length_ = destinatary_nickname.length();
     new_message_ptr->value_length(message_value.length());
     std::memcpy(new_message_ptr->value(), message_value.c_str(), 
-      message_value.length());
+      new_message_ptr->value_length());
     new_message_ptr->encode_type();
     new_message_ptr->encode_length();
     return new_message_ptr;
   }
 
+  // Called for every relayed message, so the value is written straight 
+  // into the new message.
+  //
   static im_message_ptr build_message_msg_to_destinatary( 
-    std::string originator_nickname, std::string message )
+    boost::string_view originator_nickname, boost::string_view message )
   {
-    im_message_ptr new_message_ptr = std::make_shared<im_message>();
+    im_message_ptr new_message_ptr = create();
     new_message_ptr->type_ = MESSAGE_MSG;
-    std::string message_value = build_message_value( 
-      originator_nickname, message );
-    new_message_ptr->value_length(message_value.length());
-    std::memcpy(new_message_ptr->value(), message_value.c_str(), 
-      message_value.length());
+    new_message_ptr->field_length_ = originator_nickname.length();
+    new_message_ptr->value_length( 
+      originator_nickname.length() + 1 + message.length() );
+    char* value = new_message_ptr->value();
+    std::memcpy( value, originator_nickname.data(), 
+      originator_nickname.length() );
+    value[originator_nickname.length()] = '|';
+    std::memcpy( value + originator_nickname.length() + 1, message.data(), 
+      new_message_ptr->value_length() - originator_nickname.length() - 1 );
     new_message_ptr->encode_type();
     new_message_ptr->encode_length();
     return new_message_ptr;
@@ -329,10 +578,10 @@ public:
 
   static im_message_ptr build_message_ack_msg( std::string ack_message )
   {
-    im_message_ptr new_message_ptr = std::make_shared<im_message>();
+    im_message_ptr new_message_ptr = create();
     new_message_ptr->type_ = MESSAGE_ACK_MSG;
     new_message_ptr->value_length(ack_message.length());
-    std::memcpy(new_message_ptr->value(), ack_message.c_str(), ack_message.length());
+    std::memcpy(new_message_ptr->value(), ack_message.c_str(), new_message_ptr->value_length());
     new_message_ptr->encode_type();
     new_message_ptr->encode_length();
     return new_message_ptr;
@@ -340,11 +589,11 @@ public:
 
   static im_message_ptr build_message_rfsd_msg( std::string error_message )
   {
-    im_message_ptr new_message_ptr = std::make_shared<im_message>();
+    im_message_ptr new_message_ptr = create();
     new_message_ptr->type_ = MESSAGE_RFSD_MSG;
     new_message_ptr->value_length(error_message.length());
     std::memcpy(new_message_ptr->value(), error_message.c_str(), 
-      error_message.length());
+      new_message_ptr->value_length());
     new_message_ptr->encode_type();
     new_message_ptr->encode_length();
     return new_message_ptr;
@@ -352,7 +601,7 @@ public:
 
   static im_message_ptr build_list_request_msg()
   {
-    im_message_ptr new_message_ptr = std::make_shared<im_message>();
+    im_message_ptr new_message_ptr = create();
     new_message_ptr->type_ = LIST_REQUEST_MSG;
     new_message_ptr->value_length(0);
     new_message_ptr->encode_type();
@@ -360,16 +609,88 @@ public:
     return new_message_ptr;
   }
 
+  static im_message_ptr build_list_request_msg( std::string cursor, 
+    std::size_t page_size )
+  {
+    im_message_ptr new_message_ptr = create();
+    new_message_ptr->type_ = LIST_REQUEST_MSG;
+    std::string list_request_value = 
+      cursor + "|" + std::to_string( page_size );
+    new_message_ptr->value_length(list_request_value.length());
+    std::memcpy(new_message_ptr->value(), list_request_value.c_str(), 
+      new_message_ptr->value_length());
+    new_message_ptr->encode_type();
+    new_message_ptr->encode_length();
+    return new_message_ptr;
+  }
+
+  template <class Container>
   static im_message_ptr build_list_response_msg( 
-    const std::list<std::string> nicknames_list )
+    const Container& nicknames_list )
   {
-    im_message_ptr new_message_ptr = std::make_shared<im_message>();
+    im_message_ptr new_message_ptr = create();
     new_message_ptr->type_ = LIST_RESPONSE_MSG;
     std::string list_response_value = 
       build_list_response_value( nicknames_list );
     new_message_ptr->value_length(list_response_value.length());
     std::memcpy(new_message_ptr->value(), list_response_value.c_str(), 
-      list_response_value.length());
+      new_message_ptr->value_length());
+    new_message_ptr->encode_type();
+    new_message_ptr->encode_length();
+    return new_message_ptr;
+  }
+
+  // Fills a page with the sorted "nicknames" from position "first" on, 
+  // taking no more than "page_size" of them nor more than "max_length" 
+  // bytes of value.
+  //
+  static im_message_ptr build_list_page_response_msg( 
+    const std::vector<std::string>& nicknames, std::size_t first, 
+    std::size_t page_size, std::size_t max_length )
+  {
+    std::string total = std::to_string( nicknames.size() );
+    std::string page;
+    std::size_t last = first;
+    while ( ( last < nicknames.size() ) && ( last - first < page_size ) )
+    {
+      const std::string& nickname = nicknames[last];
+      // The nickname would also be the next cursor.
+      std::size_t page_length = total.length() + 1 + nickname.length() + 1 
+        + page.length() + ( page.empty() ? 0 : 1 ) + nickname.length();
+      if ( page_length > max_length )
+      {
+        break;
+      }
+      if ( !page.empty() )
+      {
+        page.push_back( '|' );
+      }
+      page.append( nickname );
+      ++last;
+    }
+
+    // Nicknames are short enough for a page of any protocol, but one that 
+    // isn't still mustn't end the listing: it's skipped instead, with the 
+    // cursor past it.
+    //
+    std::string next_cursor;
+    if ( ( last < nicknames.size() ) && ( last > first ) )
+    {
+      next_cursor = nicknames[last - 1];
+    }
+    else if ( ( last == first ) && ( last < nicknames.size() ) 
+      && ( page_size > 0 ) )
+    {
+      next_cursor = nicknames[first];
+    }
+
+    im_message_ptr new_message_ptr = create();
+    new_message_ptr->type_ = LIST_RESPONSE_MSG;
+    std::string list_response_value = 
+      total + "|" + next_cursor + "|" + page;
+    new_message_ptr->value_length(list_response_value.length());
+    std::memcpy(new_message_ptr->value(), list_response_value.c_str(), 
+      new_message_ptr->value_length());
     new_message_ptr->encode_type();
     new_message_ptr->encode_length();
     return new_message_ptr;
@@ -377,7 +698,7 @@ public:
 
   static im_message_ptr build_disconnect_msg()
   {
-    im_message_ptr new_message_ptr = std::make_shared<im_message>();
+    im_message_ptr new_message_ptr = create();
     new_message_ptr->type_ = DISCONNECT_MSG;
     new_message_ptr->value_length(0);
     new_message_ptr->encode_type();
@@ -387,11 +708,11 @@ public:
 
   static im_message_ptr build_disconnect_ack_msg( std::string ack_message )
   {
-    im_message_ptr new_message_ptr = std::make_shared<im_message>();
+    im_message_ptr new_message_ptr = create();
     new_message_ptr->type_ = DISCONNECT_ACK_MSG;
     new_message_ptr->value_length(ack_message.length());
     std::memcpy(new_message_ptr->value(), ack_message.c_str(), 
-      ack_message.length());
+      new_message_ptr->value_length());
     new_message_ptr->encode_type();
     new_message_ptr->encode_length();
     return new_message_ptr;
@@ -399,11 +720,84 @@ public:
 
   static im_message_ptr build_broadcast_msg( std::string broadcast_message )
   {
-    im_message_ptr new_message_ptr = std::make_shared<im_message>();
+    im_message_ptr new_message_ptr = create();
     new_message_ptr->type_ = BROADCAST_MSG;
     new_message_ptr->value_length(broadcast_message.length());
     std::memcpy(new_message_ptr->value(), broadcast_message.c_str(), 
-      broadcast_message.length());
+      new_message_ptr->value_length());
+    new_message_ptr->encode_type();
+    new_message_ptr->encode_length();
+    return new_message_ptr;
+  }
+
+  static im_message_ptr build_stats_request_msg()
+  {
+    im_message_ptr new_message_ptr = create();
+    new_message_ptr->type_ = STATS_REQUEST_MSG;
+    new_message_ptr->value_length(0);
+    new_message_ptr->encode_type();
+    new_message_ptr->encode_length();
+    return new_message_ptr;
+  }
+
+  // "<name> <value>" lines, cut at the last whole line fitting in 
+  // "max_length" bytes.
+  //
+  static im_message_ptr build_stats_response_msg( const std::string& stats, 
+    std::size_t max_length )
+  {
+    std::size_t stats_length = stats.length();
+    if ( stats_length > max_length )
+    {
+      std::size_t line_end = stats.rfind( '\n', max_length - 1 );
+      stats_length = ( line_end != std::string::npos ) ? line_end + 1 : 0;
+    }
+
+    im_message_ptr new_message_ptr = create();
+    new_message_ptr->type_ = STATS_RESPONSE_MSG;
+    new_message_ptr->value_length(stats_length);
+    std::memcpy(new_message_ptr->value(), stats.data(), 
+      new_message_ptr->value_length());
+    new_message_ptr->encode_type();
+    new_message_ptr->encode_length();
+    return new_message_ptr;
+  }
+
+  static im_message_ptr build_join_msg( std::string room )
+  {
+    return build_text_msg( JOIN_MSG, room );
+  }
+
+  static im_message_ptr build_join_ack_msg( std::string room )
+  {
+    return build_text_msg( JOIN_ACK_MSG, room );
+  }
+
+  static im_message_ptr build_join_rfsd_msg( std::string error_message )
+  {
+    return build_text_msg( JOIN_RFSD_MSG, error_message );
+  }
+
+  static im_message_ptr build_leave_msg( std::string room )
+  {
+    return build_text_msg( LEAVE_MSG, room );
+  }
+
+  static im_message_ptr build_leave_ack_msg( std::string room )
+  {
+    return build_text_msg( LEAVE_ACK_MSG, room );
+  }
+
+  static im_message_ptr build_room_message_msg( std::string room, 
+    std::string message )
+  {
+    im_message_ptr new_message_ptr = create();
+    new_message_ptr->type_ = ROOM_MESSAGE_MSG;
+    std::string message_value = build_message_value( room, message );
+    new_message_ptr->field_length_ = room.length();
+    new_message_ptr->value_length(message_value.length());
+    std::memcpy(new_message_ptr->value(), message_value.c_str(), 
+      new_message_ptr->value_length());
     new_message_ptr->encode_type();
     new_message_ptr->encode_length();
     return new_message_ptr;
@@ -416,7 +810,7 @@ public:
   {
     building_message.type_ = CONNECT_MSG;
     building_message.value_length(nickname.length());
-    std::memcpy(building_message.value(), nickname.c_str(), nickname.length());
+    std::memcpy(building_message.value(), nickname.c_str(), building_message.value_length());
     building_message.encode_type();
     building_message.encode_length();
   }
@@ -426,7 +820,7 @@ public:
   {
     building_message.type_ = CONNECT_ACK_MSG;
     building_message.value_length(ack_message.length());
-    std::memcpy(building_message.value(), ack_message.c_str(), ack_message.length());
+    std::memcpy(building_message.value(), ack_message.c_str(), building_message.value_length());
     building_message.encode_type();
     building_message.encode_length();
   }
@@ -437,7 +831,7 @@ public:
     building_message.type_ = CONNECT_RFSD_MSG;
     building_message.value_length(error_message.length());
     std::memcpy(building_message.value(), error_message.c_str(), 
-      error_message.length());
+      building_message.value_length());
     building_message.encode_type();
     building_message.encode_length();
   }
@@ -449,9 +843,10 @@ public:
     building_message.type_ = MESSAGE_MSG;
     std::string message_value = build_message_value( 
       destinatary_nickname, message );
+    building_message.field_length_ = destinatary_nickname.length();
     building_message.value_length(message_value.length());
     std::memcpy(building_message.value(), message_value.c_str(), 
-      message_value.length());
+      building_message.value_length());
     building_message.encode_type();
     building_message.encode_length();
   }
@@ -463,9 +858,10 @@ public:
     building_message.type_ = MESSAGE_MSG;
     std::string message_value = build_message_value( 
       originator_nickname, message );
+    building_message.field_length_ = originator_nickname.length();
     building_message.value_length(message_value.length());
     std::memcpy(building_message.value(), message_value.c_str(), 
-      message_value.length());
+      building_message.value_length());
     building_message.encode_type();
     building_message.encode_length();
   }
@@ -475,7 +871,7 @@ public:
   {
     building_message.type_ = MESSAGE_ACK_MSG;
     building_message.value_length(ack_message.length());
-    std::memcpy(building_message.value(), ack_message.c_str(), ack_message.length());
+    std::memcpy(building_message.value(), ack_message.c_str(), building_message.value_length());
     building_message.encode_type();
     building_message.encode_length();
   }
@@ -486,7 +882,7 @@ public:
     building_message.type_ = MESSAGE_RFSD_MSG;
     building_message.value_length(error_message.length());
     std::memcpy(building_message.value(), error_message.c_str(), 
-      error_message.length());
+      building_message.value_length());
     building_message.encode_type();
     building_message.encode_length();
   }
@@ -507,7 +903,7 @@ public:
       build_list_response_value( nicknames_list );
     building_message.value_length(list_response_value.length());
     std::memcpy(building_message.value(), list_response_value.c_str(), 
-      list_response_value.length());
+      building_message.value_length());
     building_message.encode_type();
     building_message.encode_length();
   }
@@ -526,7 +922,7 @@ public:
     building_message.type_ = DISCONNECT_ACK_MSG;
     building_message.value_length(ack_message.length());
     std::memcpy(building_message.value(), ack_message.c_str(), 
-      ack_message.length());
+      building_message.value_length());
     building_message.encode_type();
     building_message.encode_length();
   }
@@ -537,7 +933,7 @@ public:
     building_message.type_ = BROADCAST_MSG;
     building_message.value_length(broadcast_message.length());
     std::memcpy(building_message.value(), broadcast_message.c_str(), 
-      broadcast_message.length());
+      building_message.value_length());
     building_message.encode_type();
     building_message.encode_length();
   }
@@ -599,46 +995,339 @@ public:
     return type_ == BROADCAST_MSG;
   }
 
+  bool is_stats_request_msg() const
+  {
+    return type_ == STATS_REQUEST_MSG;
+  }
+
+  bool is_stats_response_msg() const
+  {
+    return type_ == STATS_RESPONSE_MSG;
+  }
+
+  bool is_join_msg() const
+  {
+    return type_ == JOIN_MSG;
+  }
+
+  bool is_join_ack_msg() const
+  {
+    return type_ == JOIN_ACK_MSG;
+  }
+
+  bool is_join_rfsd_msg() const
+  {
+    return type_ == JOIN_RFSD_MSG;
+  }
+
+  bool is_leave_msg() const
+  {
+    return type_ == LEAVE_MSG;
+  }
+
+  bool is_leave_ack_msg() const
+  {
+    return type_ == LEAVE_ACK_MSG;
+  }
+
+  bool is_room_message_msg() const
+  {
+    return type_ == ROOM_MESSAGE_MSG;
+  }
+
   //----------------------------------------------------------------------
 
-  std::string get_destinatary_nickname() const
+  // Getters return views of the received frame: they are only valid while 
+  // the message is, so whatever must outlive it has to be copied.
+  //
+  // Text values end at their first NUL, since CONNECT_MSG and 
+  // CONNECT_ACK_MSG carry the protocol version after it.
+  //
+  boost::string_view get_text_value() const
+  {
+    return boost::string_view( value(), strnlen( value(), value_length_ ) );
+  }
+
+  // Splits a MESSAGE_MSG value into the nickname that starts it and the 
+  // body, which is everything after it ("|" included), in a single pass. 
+  // ROOM_MESSAGE_MSG values are split the same way, the room taking the 
+  // place of the nickname.
+  //
+  bool get_message_fields( boost::string_view& nickname, 
+    boost::string_view& body ) const
   {
-    if ( is_message_msg() )
+    if ( !is_message_msg() && !is_room_message_msg() )
+    {
+      nickname.clear();
+      body.clear();
+      return false;
+    }
+
+    std::size_t field_length = get_first_field_length();
+    nickname = boost::string_view( value(), field_length );
+    if ( field_length >= value_length_ )
     {
-      std::vector<std::string> message_elements = 
-        extract_message_elements();
-      
-      return message_elements.at( 0 );
+      body.clear();
     }
     else
     {
-      return "";
+      body = boost::string_view( value() + field_length + 1, 
+        value_length_ - field_length - 1 );
     }
+    return true;
+  }
+
+  boost::string_view get_destinatary_nickname() const
+  {
+    boost::string_view nickname, body;
+    get_message_fields( nickname, body );
+    return nickname;
   }
   
-  std::string get_message_body() const
+  boost::string_view get_message_body() const
   {
-    if ( is_message_msg() )
+    boost::string_view nickname, body;
+    get_message_fields( nickname, body );
+    return body;
+  }
+
+  // Protocol version carried by CONNECT_MSG (requested) or by 
+  // CONNECT_ACK_MSG (accepted).
+  //
+  int get_protocol_version() const
+  {
+    std::size_t text_length = strnlen( value(), value_length_ );
+    if ( ( is_connect_msg() || is_connect_ack_msg() ) 
+      && ( text_length + 1 < value_length_ ) )
     {
-      std::vector<std::string> message_elements = 
-        extract_message_elements();
-      
-      return message_elements.at( 1 );
+      return static_cast<unsigned char>( value()[text_length + 1] );
     }
-    else
+    return LEGACY_PROTOCOL;
+  }
+  
+  // Turns a received MESSAGE_MSG into the one its destinatary gets, in 
+  // place: the destinatary nickname in front of the body is replaced by 
+  // "originator_nickname", the body only being moved when their lengths 
+  // differ (and the storage only grown when the new value doesn't fit). 
+  // Same value as "build_message_msg_to_destinatary" would have built.
+  //
+  void readdress_message_msg( boost::string_view originator_nickname )
+  {
+    std::size_t field_length = get_first_field_length();
+    std::size_t body_length = ( field_length < value_length_ ) 
+      ? value_length_ - field_length - 1 : 0;
+    std::size_t new_length = originator_nickname.length() + 1 + body_length;
+    if ( new_length > max_binary_value_length )
     {
-      return "";
+      body_length -= new_length - max_binary_value_length;
+      new_length = max_binary_value_length;
     }
+
+    reserve( header_length + new_length + 1, header_length + value_length_ );
+    char* body = value() + originator_nickname.length() + 1;
+    if ( body_length > 0 )
+    {
+      std::memmove( body, value() + field_length + 1, body_length );
+    }
+    std::memcpy( value(), originator_nickname.data(), 
+      originator_nickname.length() );
+    value()[originator_nickname.length()] = '|';
+    value()[new_length] = '\0';
+
+    type_ = MESSAGE_MSG;
+    value_length_ = new_length;
+    field_length_ = originator_nickname.length();
+    encode_type();
+    encode_length();
   }
-  
-  std::vector<std::string> get_nicknames_list() const
+
+  // Turns a received ROOM_MESSAGE_MSG into the one every member gets, in 
+  // place: "originator_nickname" goes in between the room and the body, 
+  // which is moved just once (and the storage only grown when the new 
+  // value doesn't fit).
+  //
+  void readdress_room_message_msg( boost::string_view originator_nickname )
+  {
+    std::size_t field_length = get_first_field_length();
+    std::size_t body_length = ( field_length < value_length_ ) 
+      ? value_length_ - field_length - 1 : 0;
+    std::size_t prefix_length = 
+      field_length + 1 + originator_nickname.length() + 1;
+    std::size_t new_length = prefix_length + body_length;
+    if ( new_length > max_binary_value_length )
+    {
+      body_length -= std::min( body_length, 
+        new_length - max_binary_value_length );
+      new_length = prefix_length + body_length;
+    }
+
+    reserve( header_length + new_length + 1, header_length + value_length_ );
+    if ( body_length > 0 )
+    {
+      std::memmove( value() + prefix_length, value() + field_length + 1, 
+        body_length );
+    }
+    value()[field_length] = '|';
+    std::memcpy( value() + field_length + 1, originator_nickname.data(), 
+      originator_nickname.length() );
+    value()[prefix_length - 1] = '|';
+    value()[new_length] = '\0';
+
+    type_ = ROOM_MESSAGE_MSG;
+    value_length_ = new_length;
+    field_length_ = field_length;
+    encode_type();
+    encode_length();
+  }
+
+  // The "|" separated list, to be walked with an "im_field_parser".
+  //
+  boost::string_view get_nicknames_list() const
   {
-    return extract_message_elements();
+    return get_text_value();
+  }
+
+  // Page requested by a LIST_REQUEST_MSG; a page size of zero means the 
+  // whole list was requested.
+  //
+  void get_list_request( boost::string_view& cursor, 
+    std::size_t& page_size ) const
+  {
+    cursor.clear();
+    page_size = 0;
+    if ( !is_list_request_msg() )
+    {
+      return;
+    }
+
+    im_field_parser parser( boost::string_view( value(), value_length_ ) );
+    boost::string_view field;
+    if ( !parser.next( field ) || parser.rest().empty() )
+    {
+      return;
+    }
+    cursor = field;
+
+    // Leading digits only, like strtoul() would, but bounded by the value.
+    for ( char digit : parser.rest() )
+    {
+      if ( ( digit < '0' ) || ( digit > '9' ) 
+        || ( page_size > max_list_page_size ) )
+      {
+        break;
+      }
+      page_size = page_size * 10 + ( digit - '0' );
+    }
+  }
+
+  boost::string_view get_list_cursor() const
+  {
+    boost::string_view cursor;
+    std::size_t page_size;
+    get_list_request( cursor, page_size );
+    return cursor;
+  }
+
+  std::size_t get_list_page_size() const
+  {
+    boost::string_view cursor;
+    std::size_t page_size;
+    get_list_request( cursor, page_size );
+    return page_size;
   }
 
   //----------------------------------------------------------------------
 
 private:
+  // Grows the storage to at least "size" bytes, keeping the first 
+  // "kept_length" (the header, unless told otherwise).
+  //
+  void reserve( std::size_t size, std::size_t kept_length = header_length )
+  {
+    if ( size <= capacity_ )
+    {
+      return;
+    }
+
+    std::size_t size_class = min_size_class;
+    while ( size_class < size )
+    {
+      size_class *= 4;
+    }
+
+    char* new_data = new char[size_class];
+    std::memcpy( new_data, data_, kept_length );
+    if ( data_ != inline_data_ )
+    {
+      delete[] data_;
+    }
+    data_ = new_data;
+    capacity_ = size_class;
+  }
+
+  static void encode_little_endian( char* buffer, std::uint64_t number, 
+    std::size_t bytes_count )
+  {
+    for ( std::size_t i = 0; i < bytes_count; ++i )
+    {
+      buffer[i] = static_cast<char>( ( number >> ( 8 * i ) ) & 0xff );
+    }
+  }
+
+  static std::uint64_t decode_little_endian( const char* buffer, 
+    std::size_t bytes_count )
+  {
+    std::uint64_t number = 0;
+    for ( std::size_t i = 0; i < bytes_count; ++i )
+    {
+      number |= static_cast<std::uint64_t>( 
+        static_cast<unsigned char>( buffer[i] ) ) << ( 8 * i );
+    }
+    return number;
+  }
+
+  static im_message_ptr build_text_msg( int type, const std::string& text )
+  {
+    im_message_ptr new_message_ptr = create();
+    new_message_ptr->type_ = type;
+    new_message_ptr->value_length(text.length());
+    std::memcpy(new_message_ptr->value(), text.c_str(), 
+      new_message_ptr->value_length());
+    new_message_ptr->encode_type();
+    new_message_ptr->encode_length();
+    return new_message_ptr;
+  }
+
+  static std::string build_versioned_value( std::string text, 
+    int protocol_version )
+  {
+    std::string versioned_value( text );
+    if ( protocol_version != LEGACY_PROTOCOL )
+    {
+      versioned_value.push_back( '\0' );
+      versioned_value.push_back( static_cast<char>( protocol_version ) );
+    }
+    return versioned_value;
+  }
+
+  // Length of the nickname that starts a MESSAGE_MSG value. Frames built 
+  // here and BINARY_PROTOCOL frames carry it; LEGACY_PROTOCOL frames are 
+  // split on their first separator (nicknames can't contain it).
+  //
+  std::size_t get_first_field_length() const
+  {
+    if ( field_length_ > 0 )
+    {
+      return field_length_;
+    }
+    const void* separator = std::memchr( value(), '|', value_length_ );
+    if ( separator == nullptr )
+    {
+      return value_length_;
+    }
+    return static_cast<const char*>( separator ) - value();
+  }
+
   static std::string build_message_value( std::string destinatary_nickname, 
       std::string message )
   {
@@ -646,12 +1335,13 @@ private:
       .append( "|" ).append( message );
   }
 
+  template <class Container>
   static std::string build_list_response_value( 
-      const std::list<std::string> nicknames_list )
+      const Container& nicknames_list )
   {
     std::string list_response;
 
-    for ( auto nickname : nicknames_list )
+    for ( auto& nickname : nicknames_list )
     {
       std::string next_addition;
 
@@ -664,9 +1354,8 @@ private:
         next_addition = "|" + nickname;
       }
 
-      // TODO: Validate a better way to handle the necessity to send more 
-      //       than one response given that the number of nicknames could 
-      //       overcome the space available to send them in just one message.
+      // Whatever doesn't fit is left out; clients wanting the full list 
+      // ask for it in pages (see "max_list_page_size").
       //
       if ( ( list_response.length() + next_addition.length() ) 
         < max_value_length )
@@ -678,17 +1367,6 @@ private:
     return list_response;
   }
 
-  std::vector<std::string> extract_message_elements() const
-  {
-    std::vector<std::string> command_elements;
-    const std::string value_str( value() );
-
-    boost::algorithm::split( command_elements, value_str, 
-      boost::is_any_of( "|" ) );
-
-    return command_elements;
-  }
-
   bool is_valid_message()
   {
     //if ( ( type_ != CONNECT_MSG) && ( type_ != CONNECT_ACK_MSG ) 
@@ -708,9 +1386,14 @@ private:
   }
 
 private:
-  char data_[type_length + length_length + max_value_length];
+  char* data_;
+  std::size_t capacity_;
+  char inline_data_[inline_capacity];
   std::size_t value_length_;
   int type_;
+  std::size_t field_length_;
+  std::uint16_t flags_;
+  std::uint32_t sequence_;
 };
 
 //----------------------------------------------------------------------
@@ -0,0 +1,142 @@
+//
+// im_message_audit.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#include <algorithm>
+#include "im_message_audit.h"
+#include "logger.h"
+
+//----------------------------------------------------------------------
+// Constructor
+//----------------------------------------------------------------------
+
+im_message_audit::options::options()
+  : mode( audit_full ),
+    sample_every( 1 ),
+    sender_rate( 0 )
+{
+}
+
+im_message_audit::im_message_audit()
+  : audited_( 0 ),
+    sampled_out_( 0 ),
+    rate_limited_( 0 ),
+    next_report_time_( ( std::chrono::steady_clock::now() 
+      + std::chrono::seconds( report_interval_seconds ) )
+      .time_since_epoch().count() )
+{
+}
+
+//----------------------------------------------------------------------
+// Public methods.
+//----------------------------------------------------------------------
+
+void im_message_audit::set_options( const options& audit_options )
+{
+  options_ = audit_options;
+  if ( options_.sample_every < 1 )
+  {
+    options_.sample_every = 1;
+  }
+}
+
+int im_message_audit::get_mode()
+{
+  return options_.mode;
+}
+
+bool im_message_audit::is_enabled()
+{
+  // Audit records are INFO records.
+  return ( IM_LOG_MIN_LEVEL <= Logger::INFO_LEVEL )
+    && ( options_.mode != audit_off )
+    && Logger::isEnabled( Logger::INFO_LEVEL );
+}
+
+bool im_message_audit::admit( sender_state& state )
+{
+  if ( ( options_.sample_every > 1 )
+    && ( state.sample_counter++ % options_.sample_every != 0 ) )
+  {
+    ++state.sampled_out;
+    return false;
+  }
+
+  if ( options_.sender_rate > 0 )
+  {
+    // Token bucket, holding up to a second's worth of messages.
+    //
+    auto now = std::chrono::steady_clock::now();
+    double capacity = std::max( options_.sender_rate, 1.0 );
+    if ( !state.is_bucket_primed )
+    {
+      state.tokens = capacity;
+      state.is_bucket_primed = true;
+    }
+    else
+    {
+      std::chrono::duration<double> elapsed = now - state.refill_time;
+      state.tokens = std::min( capacity,
+        state.tokens + elapsed.count() * options_.sender_rate );
+    }
+    state.refill_time = now;
+
+    if ( state.tokens < 1 )
+    {
+      ++state.rate_limited;
+      return false;
+    }
+    state.tokens -= 1;
+  }
+
+  audited_.fetch_add( 1, std::memory_order_relaxed );
+  return true;
+}
+
+std::uint64_t im_message_audit::settle( sender_state& state )
+{
+  std::uint64_t left_out = state.sampled_out + state.rate_limited;
+  if ( left_out > 0 )
+  {
+    sampled_out_.fetch_add( state.sampled_out, std::memory_order_relaxed );
+    rate_limited_.fetch_add( state.rate_limited, std::memory_order_relaxed );
+    state.sampled_out = 0;
+    state.rate_limited = 0;
+  }
+  return left_out;
+}
+
+im_message_audit::statistics im_message_audit::get_statistics() const
+{
+  statistics audit_statistics;
+  audit_statistics.audited = audited_.load( std::memory_order_relaxed );
+  audit_statistics.sampled_out =
+    sampled_out_.load( std::memory_order_relaxed );
+  audit_statistics.rate_limited =
+    rate_limited_.load( std::memory_order_relaxed );
+  return audit_statistics;
+}
+
+bool im_message_audit::is_report_due()
+{
+  std::chrono::steady_clock::time_point now = 
+    std::chrono::steady_clock::now();
+  std::chrono::steady_clock::rep next_report_time = next_report_time_;
+  if ( now.time_since_epoch().count() < next_report_time )
+  {
+    return false;
+  }
+
+  return next_report_time_.compare_exchange_strong( next_report_time,
+    ( now + std::chrono::seconds( report_interval_seconds ) )
+      .time_since_epoch().count() );
+}
+
+//----------------------------------------------------------------------
+// Private fields initialization.
+//----------------------------------------------------------------------
+
+im_message_audit::options im_message_audit::options_;
@@ -0,0 +1,108 @@
+//
+// im_message_audit.h
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#ifndef IM_MESSAGE_AUDIT_H
+#define IM_MESSAGE_AUDIT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+
+//----------------------------------------------------------------------
+
+// Decides which relayed messages make it to the log, and with how much of
+// them, so logging keeps up with the traffic and message bodies can be
+// kept out of the log altogether.
+//
+// Sampling and rate limiting are done per sender, on state the sender's
+// session keeps, so the decision shares nothing between threads. What was
+// left out is counted there as well, and added to the totals the next
+// time the sender's messages are logged (or when it logs out). Totals are
+// logged every now and then along with an audited message.
+//
+class im_message_audit
+{
+public:
+  enum { report_interval_seconds = 60 };
+
+  enum audit_mode
+  {
+    audit_off,
+    audit_metadata,   // sizes, nicknames and latency, but not the body
+    audit_full
+  };
+
+  struct options
+  {
+    options();
+
+    int mode;
+    // Only one in "sample_every" messages of each sender is logged.
+    std::size_t sample_every;
+    // Most messages logged per second for each sender (0: no limit), in
+    // bursts of up to a second's worth.
+    double sender_rate;
+  };
+
+  // Only touched from the owning session's handlers.
+  //
+  struct sender_state
+  {
+    sender_state()
+      : sample_counter( 0 ), tokens( 0 ), is_bucket_primed( false ),
+        sampled_out( 0 ), rate_limited( 0 )
+    {
+    }
+
+    std::uint64_t sample_counter;
+    double tokens;
+    std::chrono::steady_clock::time_point refill_time;
+    bool is_bucket_primed;
+    // Left out since the sender's last logged message.
+    std::uint64_t sampled_out;
+    std::uint64_t rate_limited;
+  };
+
+  struct statistics
+  {
+    std::uint64_t audited;
+    std::uint64_t sampled_out;
+    std::uint64_t rate_limited;
+  };
+
+  im_message_audit();
+
+  // Meant to be set before serving; applies to every session manager.
+  static void set_options( const options& audit_options );
+  static int get_mode();
+
+  // Whether relayed messages are audited at all. Cheap enough to be asked
+  // for every message.
+  static bool is_enabled();
+
+  // False if the message is to be left out.
+  bool admit( sender_state& state );
+  // Adds what "state" left out to the totals; returns how much that was.
+  std::uint64_t settle( sender_state& state );
+
+  statistics get_statistics() const;
+  // True for a single caller once every "report_interval_seconds".
+  bool is_report_due();
+
+private:
+  static options options_;
+
+  std::atomic<std::uint64_t> audited_;
+  std::atomic<std::uint64_t> sampled_out_;
+  std::atomic<std::uint64_t> rate_limited_;
+  std::atomic<std::chrono::steady_clock::rep> next_report_time_;
+};
+
+//----------------------------------------------------------------------
+
+#endif // IM_MESSAGE_AUDIT_H
@@ -34,61 +34,18 @@ void im_message_handler::start(
   callback_ptr_ = callback_ptr;
 }
 
-void im_message_handler::process_message( im_session_ptr im_session_ptr, 
-  const im_message& msg )
+void im_message_handler::process_message( 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
 {
   if ( !callback_ptr_)
   {
     std::cerr << "IM message handler callback must be set first!\n";
   }
-  else
+  else if ( ( msg.type() > im_message::PRIOR_FIRST_MESSAGE ) 
+    && ( msg.type() < im_message::AFTER_LAST_MESSAGE ) 
+    && ( dispatch_table_[msg.type()] != nullptr ) )
   {
-    if ( msg.is_connect_msg() )
-    {
-      callback_ptr_->on_connect_msg( im_session_ptr, msg.value() );
-    }
-    else if ( msg.is_connect_ack_msg() )
-    {
-      callback_ptr_->on_connect_ack_msg( im_session_ptr, msg.value() );
-    }
-    else if ( msg.is_connect_rfsd_msg() )
-    {
-      callback_ptr_->on_connect_rfsd_msg( im_session_ptr, msg.value() );
-    }
-    else if ( msg.is_message_msg() )
-    {
-      callback_ptr_->on_message_msg( im_session_ptr, 
-        msg.get_destinatary_nickname(), msg.get_message_body() );
-    }
-    else if ( msg.is_message_ack_msg() )
-    {
-      callback_ptr_->on_message_ack_msg( im_session_ptr, msg.value() );
-    }
-    else if ( msg.is_message_rfsd_msg() )
-    {
-      callback_ptr_->on_message_rfsd_msg( im_session_ptr, msg.value() );
-    }
-    else if ( msg.is_list_request_msg() )
-    {
-      callback_ptr_->on_list_request_msg( im_session_ptr );
-    }
-    else if ( msg.is_list_response_msg() )
-    {
-      callback_ptr_->on_list_response_msg( 
-        im_session_ptr, msg.get_nicknames_list() );
-    }
-    else if ( msg.is_disconnect_msg() )
-    {
-      callback_ptr_->on_disconnect_msg( im_session_ptr );
-    }
-    else if ( msg.is_disconnect_ack_msg() )
-    {
-      callback_ptr_->on_disconnect_ack_msg( im_session_ptr, msg.value() );
-    }
-    else if ( msg.is_broadcast_msg() )
-    {
-      callback_ptr_->on_broadcast_msg( im_session_ptr, msg.value() );
-    }
+    dispatch_table_[msg.type()]( *callback_ptr_, im_session_ptr, msg );
   }
 }
 
@@ -96,3 +53,180 @@ void im_message_handler::process_message( im_session_ptr im_session_ptr,
 // Private methods.
 //----------------------------------------------------------------------
 
+// Filled by type rather than by position, so no handler can end up under 
+// the wrong type. Types without an entry (like PRIOR_FIRST_MESSAGE) are 
+// ignored, as unknown types always were.
+//
+im_message_handler::dispatch_table im_message_handler::build_dispatch_table()
+{
+  dispatch_table table;
+  table.fill( nullptr );
+  table[im_message::CONNECT_MSG] = &dispatch_connect_msg;
+  table[im_message::CONNECT_ACK_MSG] = &dispatch_connect_ack_msg;
+  table[im_message::CONNECT_RFSD_MSG] = &dispatch_connect_rfsd_msg;
+  table[im_message::MESSAGE_MSG] = &dispatch_message_msg;
+  table[im_message::MESSAGE_ACK_MSG] = &dispatch_message_ack_msg;
+  table[im_message::MESSAGE_RFSD_MSG] = &dispatch_message_rfsd_msg;
+  table[im_message::LIST_REQUEST_MSG] = &dispatch_list_request_msg;
+  table[im_message::LIST_RESPONSE_MSG] = &dispatch_list_response_msg;
+  table[im_message::DISCONNECT_MSG] = &dispatch_disconnect_msg;
+  table[im_message::DISCONNECT_ACK_MSG] = &dispatch_disconnect_ack_msg;
+  table[im_message::BROADCAST_MSG] = &dispatch_broadcast_msg;
+  table[im_message::STATS_REQUEST_MSG] = &dispatch_stats_request_msg;
+  table[im_message::STATS_RESPONSE_MSG] = &dispatch_stats_response_msg;
+  table[im_message::JOIN_MSG] = &dispatch_join_msg;
+  table[im_message::JOIN_ACK_MSG] = &dispatch_join_ack_msg;
+  table[im_message::JOIN_RFSD_MSG] = &dispatch_join_rfsd_msg;
+  table[im_message::LEAVE_MSG] = &dispatch_leave_msg;
+  table[im_message::LEAVE_ACK_MSG] = &dispatch_leave_ack_msg;
+  table[im_message::ROOM_MESSAGE_MSG] = &dispatch_room_message_msg;
+  return table;
+}
+
+void im_message_handler::dispatch_connect_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  callback.on_connect_msg( im_session_ptr, msg.get_text_value() );
+}
+
+void im_message_handler::dispatch_connect_ack_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  callback.on_connect_ack_msg( im_session_ptr, msg.get_text_value() );
+}
+
+void im_message_handler::dispatch_connect_rfsd_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  callback.on_connect_rfsd_msg( im_session_ptr, msg.get_text_value() );
+}
+
+void im_message_handler::dispatch_message_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  boost::string_view destinatary_nickname, message;
+  msg.get_message_fields( destinatary_nickname, message );
+  callback.on_message_msg( im_session_ptr, destinatary_nickname, message );
+}
+
+void im_message_handler::dispatch_message_ack_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  callback.on_message_ack_msg( im_session_ptr, msg.get_text_value() );
+}
+
+void im_message_handler::dispatch_message_rfsd_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  callback.on_message_rfsd_msg( im_session_ptr, msg.get_text_value() );
+}
+
+void im_message_handler::dispatch_list_request_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  boost::string_view cursor;
+  std::size_t page_size;
+  msg.get_list_request( cursor, page_size );
+  callback.on_list_request_msg( im_session_ptr, cursor, page_size );
+}
+
+void im_message_handler::dispatch_list_response_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  callback.on_list_response_msg( im_session_ptr, msg.get_nicknames_list() );
+}
+
+void im_message_handler::dispatch_disconnect_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& /*msg*/ )
+{
+  callback.on_disconnect_msg( im_session_ptr );
+}
+
+void im_message_handler::dispatch_disconnect_ack_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  callback.on_disconnect_ack_msg( im_session_ptr, msg.get_text_value() );
+}
+
+void im_message_handler::dispatch_broadcast_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  callback.on_broadcast_msg( im_session_ptr, msg.get_text_value() );
+}
+
+void im_message_handler::dispatch_stats_request_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& /*msg*/ )
+{
+  callback.on_stats_request_msg( im_session_ptr );
+}
+
+void im_message_handler::dispatch_stats_response_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  callback.on_stats_response_msg( im_session_ptr, msg.get_text_value() );
+}
+
+void im_message_handler::dispatch_join_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  callback.on_join_msg( im_session_ptr, msg.get_text_value() );
+}
+
+void im_message_handler::dispatch_join_ack_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  callback.on_join_ack_msg( im_session_ptr, msg.get_text_value() );
+}
+
+void im_message_handler::dispatch_join_rfsd_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  callback.on_join_rfsd_msg( im_session_ptr, msg.get_text_value() );
+}
+
+void im_message_handler::dispatch_leave_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  callback.on_leave_msg( im_session_ptr, msg.get_text_value() );
+}
+
+void im_message_handler::dispatch_leave_ack_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  callback.on_leave_ack_msg( im_session_ptr, msg.get_text_value() );
+}
+
+void im_message_handler::dispatch_room_message_msg( 
+  im_message_handler_callback& callback, 
+  const im_session_ptr& im_session_ptr, const im_message& msg )
+{
+  boost::string_view room, message;
+  msg.get_message_fields( room, message );
+  callback.on_room_message_msg( im_session_ptr, room, message );
+}
+
+//----------------------------------------------------------------------
+// Private fields initialization.
+//----------------------------------------------------------------------
+
+const im_message_handler::dispatch_table 
+  im_message_handler::dispatch_table_ = 
+    im_message_handler::build_dispatch_table();
@@ -8,40 +8,64 @@
 #ifndef IM_MESSAGE_HANDLER_H
 #define IM_MESSAGE_HANDLER_H
 
+#include <array>
 #include <cstdlib>
 #include <memory>
 #include <vector>
 #include <string>
 #include <boost/asio.hpp>
+#include <boost/utility/string_view.hpp>
 #include "im_message.hpp"
 #include "im_session.h"
 
 //----------------------------------------------------------------------
 
+// Payloads are views of the frame being dispatched, valid only until the 
+// callback returns; implementations copy whatever they keep.
+//
 class im_message_handler_callback
 {
 public:
   virtual ~im_message_handler_callback() {}
-  virtual void on_connect_msg( im_session_ptr im_session_ptr, 
-    std::string nickname ) = 0;
-  virtual void on_connect_ack_msg( im_session_ptr im_session_ptr, 
-    std::string ack_message ) = 0;
-  virtual void on_connect_rfsd_msg( im_session_ptr im_session_ptr, 
-    std::string error_message ) = 0;
-  virtual void on_message_msg( im_session_ptr im_session_ptr, 
-    std::string destinatary_nickname, std::string message ) = 0;
-  virtual void on_message_ack_msg( im_session_ptr im_session_ptr, 
-    std::string ack_message ) = 0;
-  virtual void on_message_rfsd_msg( im_session_ptr im_session_ptr, 
-    std::string error_message ) = 0;
-  virtual void on_list_request_msg( im_session_ptr im_session_ptr ) = 0;
-  virtual void on_list_response_msg( im_session_ptr im_session_ptr, 
-    std::vector<std::string> nicknames_list ) = 0;
-  virtual void on_disconnect_msg( im_session_ptr im_session_ptr ) = 0;
-  virtual void on_disconnect_ack_msg( im_session_ptr im_session_ptr, 
-    std::string ack_message ) = 0;
-  virtual void on_broadcast_msg( im_session_ptr im_session_ptr, 
-    std::string broadcast_message ) = 0;
+  virtual void on_connect_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view nickname ) = 0;
+  virtual void on_connect_ack_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view ack_message ) = 0;
+  virtual void on_connect_rfsd_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view error_message ) = 0;
+  virtual void on_message_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view destinatary_nickname, boost::string_view message ) = 0;
+  virtual void on_message_ack_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view ack_message ) = 0;
+  virtual void on_message_rfsd_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view error_message ) = 0;
+  virtual void on_list_request_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view cursor, std::size_t page_size ) = 0;
+  virtual void on_list_response_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view nicknames_list ) = 0;
+  virtual void on_disconnect_msg( const im_session_ptr& im_session_ptr ) = 0;
+  virtual void on_disconnect_ack_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view ack_message ) = 0;
+  virtual void on_broadcast_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view broadcast_message ) = 0;
+  virtual void on_stats_request_msg( 
+    const im_session_ptr& im_session_ptr ) = 0;
+  virtual void on_stats_response_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view stats ) = 0;
+  virtual void on_join_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view room ) = 0;
+  virtual void on_join_ack_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view room ) = 0;
+  virtual void on_join_rfsd_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view error_message ) = 0;
+  virtual void on_leave_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view room ) = 0;
+  virtual void on_leave_ack_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view room ) = 0;
+  // "message" is "<originator nickname>|<message>" when delivered by the 
+  // server.
+  virtual void on_room_message_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view room, boost::string_view message ) = 0;
 };
 
 typedef std::shared_ptr<im_message_handler_callback> im_message_handler_callback_ptr;
@@ -54,9 +78,70 @@ public:
   im_message_handler();
 
   void start( im_message_handler_callback_ptr callback_ptr );
-  void process_message( im_session_ptr im_session_ptr, const im_message& msg );
+  void process_message( const im_session_ptr& im_session_ptr, 
+    const im_message& msg );
 
 private:
+  typedef void (*dispatch_function)( im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+
+  typedef std::array<dispatch_function, im_message::AFTER_LAST_MESSAGE> 
+    dispatch_table;
+
+  // Indexed by message type.
+  static const dispatch_table dispatch_table_;
+
+  static dispatch_table build_dispatch_table();
+
+  static void dispatch_connect_msg( im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_connect_ack_msg( 
+    im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_connect_rfsd_msg( 
+    im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_message_msg( im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_message_ack_msg( 
+    im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_message_rfsd_msg( 
+    im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_list_request_msg( 
+    im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_list_response_msg( 
+    im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_disconnect_msg( im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_disconnect_ack_msg( 
+    im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_broadcast_msg( im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_stats_request_msg( 
+    im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_stats_response_msg( 
+    im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_join_msg( im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_join_ack_msg( im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_join_rfsd_msg( im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_leave_msg( im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_leave_ack_msg( im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+  static void dispatch_room_message_msg( 
+    im_message_handler_callback& callback, 
+    const im_session_ptr& im_session_ptr, const im_message& msg );
+
   im_message_handler_callback_ptr callback_ptr_;
 };
 
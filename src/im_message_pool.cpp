@@ -0,0 +1,178 @@
+//
+// im_message_pool.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#include <cstdlib>
+#include <new>
+#include "im_message_pool.h"
+
+//----------------------------------------------------------------------
+// Constructor
+//----------------------------------------------------------------------
+
+im_message_pool::im_message_pool()
+  : free_list_( nullptr ),
+    free_count_( 0 ),
+    remote_free_list_( nullptr ),
+    hits_( 0 ),
+    misses_( 0 ),
+    remote_frees_( 0 )
+{
+}
+
+//----------------------------------------------------------------------
+// Public methods.
+//----------------------------------------------------------------------
+
+void* im_message_pool::allocate( std::size_t size )
+{
+  if ( !fits_in_block( size ) )
+  {
+    return ::operator new( size );
+  }
+  return get_local_pool().allocate_block();
+}
+
+void im_message_pool::deallocate( void* pointer, std::size_t size )
+{
+  if ( !fits_in_block( size ) )
+  {
+    ::operator delete( pointer );
+    return;
+  }
+
+  block_header* block_ptr = static_cast<block_header*>( pointer ) - 1;
+  im_message_pool& local_pool = get_local_pool();
+  if ( block_ptr->owner_ptr == &local_pool )
+  {
+    local_pool.free_local_block( block_ptr );
+  }
+  else
+  {
+    local_pool.remote_frees_.store( local_pool.remote_frees_.load(
+      std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+    block_ptr->owner_ptr->free_remote_block( block_ptr );
+  }
+}
+
+im_message_pool::statistics im_message_pool::get_statistics()
+{
+  statistics pool_statistics = statistics();
+
+  boost::unique_lock<boost::mutex> scoped_lock( pools_mutex_ );
+  for ( auto pool_ptr : pools_ )
+  {
+    pool_statistics.hits += pool_ptr->hits_.load( std::memory_order_relaxed );
+    pool_statistics.misses +=
+      pool_ptr->misses_.load( std::memory_order_relaxed );
+    pool_statistics.remote_frees +=
+      pool_ptr->remote_frees_.load( std::memory_order_relaxed );
+  }
+  pool_statistics.blocks_count = blocks_count_;
+  pool_statistics.blocks_high_water = blocks_high_water_;
+
+  return pool_statistics;
+}
+
+//----------------------------------------------------------------------
+// Private methods.
+//----------------------------------------------------------------------
+
+im_message_pool& im_message_pool::get_local_pool()
+{
+  static thread_local im_message_pool* local_pool_ptr = nullptr;
+
+  if ( local_pool_ptr == nullptr )
+  {
+    local_pool_ptr = new im_message_pool();
+
+    boost::unique_lock<boost::mutex> scoped_lock( pools_mutex_ );
+    pools_.push_back( local_pool_ptr );
+  }
+
+  return *local_pool_ptr;
+}
+
+bool im_message_pool::fits_in_block( std::size_t size )
+{
+  return size <= block_size - sizeof( block_header );
+}
+
+void* im_message_pool::allocate_block()
+{
+  if ( free_list_ == nullptr )
+  {
+    // Take back everything other threads have freed so far.
+    //
+    block_header* block_ptr = remote_free_list_.exchange( nullptr,
+      std::memory_order_acquire );
+    while ( block_ptr != nullptr )
+    {
+      block_header* next_ptr = block_ptr->next_ptr;
+      free_local_block( block_ptr );
+      block_ptr = next_ptr;
+    }
+  }
+
+  block_header* block_ptr = free_list_;
+  if ( block_ptr != nullptr )
+  {
+    free_list_ = block_ptr->next_ptr;
+    --free_count_;
+    hits_.store( hits_.load( std::memory_order_relaxed ) + 1,
+      std::memory_order_relaxed );
+  }
+  else
+  {
+    block_ptr = static_cast<block_header*>( ::operator new( block_size ) );
+    block_ptr->owner_ptr = this;
+    misses_.store( misses_.load( std::memory_order_relaxed ) + 1,
+      std::memory_order_relaxed );
+
+    std::uint64_t blocks_count = ++blocks_count_;
+    std::uint64_t high_water = blocks_high_water_;
+    while ( ( blocks_count > high_water )
+      && !blocks_high_water_.compare_exchange_weak( high_water, blocks_count ) )
+    {
+    }
+  }
+
+  return block_ptr + 1;
+}
+
+void im_message_pool::free_local_block( block_header* block_ptr )
+{
+  if ( free_count_ >= max_cached_blocks )
+  {
+    --blocks_count_;
+    ::operator delete( block_ptr );
+    return;
+  }
+
+  block_ptr->next_ptr = free_list_;
+  free_list_ = block_ptr;
+  ++free_count_;
+}
+
+void im_message_pool::free_remote_block( block_header* block_ptr )
+{
+  block_header* head_ptr = remote_free_list_.load( std::memory_order_relaxed );
+  do
+  {
+    block_ptr->next_ptr = head_ptr;
+  }
+  while ( !remote_free_list_.compare_exchange_weak( head_ptr, block_ptr,
+    std::memory_order_release, std::memory_order_relaxed ) );
+}
+
+//----------------------------------------------------------------------
+// Private fields initialization.
+//----------------------------------------------------------------------
+
+boost::mutex im_message_pool::pools_mutex_;
+std::vector<im_message_pool*> im_message_pool::pools_;
+std::atomic<std::uint64_t> im_message_pool::blocks_count_( 0 );
+std::atomic<std::uint64_t> im_message_pool::blocks_high_water_( 0 );
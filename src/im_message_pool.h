@@ -0,0 +1,131 @@
+//
+// im_message_pool.h
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#ifndef IM_MESSAGE_POOL_H
+#define IM_MESSAGE_POOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+
+//----------------------------------------------------------------------
+
+// Recycles the memory of messages (the im_message together with its
+// shared_ptr control block) instead of going to the heap for each one.
+//
+// Every thread gets its own pool, so allocating and freeing on the same
+// thread takes no lock nor atomic operation. A block freed by another
+// thread is pushed on a lock-free list of the pool it came from, which
+// the owner takes back as a whole when its own free list runs dry.
+//
+// Pools live as long as the process (threads using them are expected to
+// be long lived, like the io_service threads), so a block can always be
+// given back to the pool that allocated it.
+//
+class im_message_pool
+{
+public:
+  enum { block_size = 256 };
+  enum { max_cached_blocks = 4096 };
+
+  struct statistics
+  {
+    std::uint64_t hits;
+    std::uint64_t misses;
+    std::uint64_t remote_frees;
+    std::uint64_t blocks_count;
+    std::uint64_t blocks_high_water;
+  };
+
+  static void* allocate( std::size_t size );
+  static void deallocate( void* pointer, std::size_t size );
+  static statistics get_statistics();
+
+private:
+  struct block_header
+  {
+    im_message_pool* owner_ptr;
+    block_header* next_ptr;
+  };
+
+  im_message_pool();
+
+  static im_message_pool& get_local_pool();
+  static bool fits_in_block( std::size_t size );
+
+  void* allocate_block();
+  void free_local_block( block_header* block_ptr );
+  void free_remote_block( block_header* block_ptr );
+
+private:
+  // Only touched by the owner thread.
+  block_header* free_list_;
+  std::size_t free_count_;
+
+  // Pushed by any thread, emptied at once by the owner.
+  std::atomic<block_header*> remote_free_list_;
+
+  // Written by the owner thread only, read by get_statistics().
+  std::atomic<std::uint64_t> hits_;
+  std::atomic<std::uint64_t> misses_;
+  std::atomic<std::uint64_t> remote_frees_;
+
+  static boost::mutex pools_mutex_;
+  static std::vector<im_message_pool*> pools_;
+  static std::atomic<std::uint64_t> blocks_count_;
+  static std::atomic<std::uint64_t> blocks_high_water_;
+};
+
+//----------------------------------------------------------------------
+
+// Allocator handing out im_message_pool blocks, for std::allocate_shared.
+//
+template <class T>
+class im_message_pool_allocator
+{
+public:
+  typedef T value_type;
+
+  im_message_pool_allocator()
+  {
+  }
+
+  template <class U>
+  im_message_pool_allocator( const im_message_pool_allocator<U>& )
+  {
+  }
+
+  T* allocate( std::size_t count )
+  {
+    return static_cast<T*>( im_message_pool::allocate( count * sizeof( T ) ) );
+  }
+
+  void deallocate( T* pointer, std::size_t count )
+  {
+    im_message_pool::deallocate( pointer, count * sizeof( T ) );
+  }
+};
+
+template <class T, class U>
+bool operator==( const im_message_pool_allocator<T>&,
+  const im_message_pool_allocator<U>& )
+{
+  return true;
+}
+
+template <class T, class U>
+bool operator!=( const im_message_pool_allocator<T>&,
+  const im_message_pool_allocator<U>& )
+{
+  return false;
+}
+
+//----------------------------------------------------------------------
+
+#endif // IM_MESSAGE_POOL_H
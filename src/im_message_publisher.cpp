@@ -6,8 +6,10 @@
 //
 
 #include <cstdlib>
+#include <iostream>
 #include <memory>
 #include "im_message_publisher.h"
+#include "im_metrics.h"
 #include "im_session.h"
 
 //----------------------------------------------------------------------
@@ -15,8 +17,12 @@
 //----------------------------------------------------------------------
 
 im_message_publisher::im_message_publisher()
+  : broadcast_subscribers_ptr( std::make_shared<topic_subscribers>() )
 {
-
+  broadcast_subscribers_ptr->snapshot_ptr = 
+    std::make_shared<const subscribers_snapshot>();
+  topics_map.insert( std::pair<std::string, topic_subscribers_ptr>( 
+    BROADCAST_TOPIC, broadcast_subscribers_ptr ) );
 }
 
 //----------------------------------------------------------------------
@@ -26,115 +32,170 @@ im_message_publisher::im_message_publisher()
 void im_message_publisher::subscribe( 
   std::string topic, im_message_subscriber_ptr subscriber_ptr )
 {
-  boost::unique_lock<boost::mutex> scoped_lock( subscribers_list_map_mutex );
-  try
+  im_metered_lock<boost::mutex> writers_lock( subscribers_writers_mutex );
+
+  // Publishers finding the new topic before its first member is added 
+  // wait on its members mutex to build its snapshot.
+  //
+  topic_subscribers_ptr entry_ptr = find_topic( topic );
+  bool is_new_topic = !entry_ptr;
+  if ( is_new_topic )
   {
-    auto subscribers_list = subscribers_list_map.at( topic );
-    subscribers_list.push_back( subscriber_ptr );
-    // Remove the map entry and reinsert updated list.
-    subscribers_list_map.erase( topic );
-    subscribers_list_map.insert( 
-      std::pair<std::string, subscribers_ptr_list>( 
-        topic, subscribers_list ) );
-
-    //std::cout << "subscribers_list size for topic \"" << topic << "\" is: " 
-      //<< subscribers_list.size() << ".\n";
+    entry_ptr = std::make_shared<topic_subscribers>();
   }
-  catch (std::out_of_range e)
-  {
-    subscribers_ptr_list subscribers_list;
-    subscribers_list.push_back( subscriber_ptr );
-
-    subscribers_list_map.insert( 
-      std::pair<std::string, subscribers_ptr_list>( 
-        topic, subscribers_list ) );
 
-    //std::cout << "new subscribers_list size for topic \"" << topic << "\" is: " 
-      //<< subscribers_list.size() << ".\n";
+  im_metered_lock<boost::mutex> members_lock( entry_ptr->members_mutex );
+  if ( is_new_topic )
+  {
+    boost::unique_lock<boost::shared_mutex> map_lock( topics_map_mutex );
+    topics_map.insert( std::pair<std::string, topic_subscribers_ptr>( 
+      topic, entry_ptr ) );
   }
 
-  //std::cout << "subscribers_list_map size is: " 
-    //<< subscribers_list_map.size() << ".\n";
+  if ( !entry_ptr->positions.insert( std::make_pair( subscriber_ptr.get(), 
+    entry_ptr->members.size() ) ).second )
+  {
+    // Already subscribed.
+    return;
+  }
+  entry_ptr->members.push_back( subscriber_ptr );
+  std::atomic_store( &entry_ptr->snapshot_ptr, subscribers_snapshot_ptr() );
 }
 
 void im_message_publisher::unsubscribe( 
   std::string topic, im_message_subscriber_ptr subscriber_ptr )
 {
-  boost::unique_lock<boost::mutex> scoped_lock( subscribers_list_map_mutex );
-  try
-  {
-    auto subscribers_list = subscribers_list_map.at( topic );
-    subscribers_list.remove( subscriber_ptr );
-    if ( subscribers_list.empty() )
-    {
-      subscribers_list_map.erase( topic );
-    }
-    else
-    {
-      // Remove the map entry and reinsert updated list.
-      subscribers_list_map.erase( topic );
-      subscribers_list_map.insert( 
-        std::pair<std::string, subscribers_ptr_list>( 
-          topic, subscribers_list ) );
-    }
+  im_metered_lock<boost::mutex> writers_lock( subscribers_writers_mutex );
 
-    //std::cout << "subscribers_list size for topic \"" << topic << "\" is: " 
-      //<< subscribers_list.size() << ".\n";
-  }
-  catch (std::out_of_range e)
+  topic_subscribers_ptr entry_ptr = find_topic( topic );
+  if ( !entry_ptr )
   {
     std::cerr << "Unsubscribe -> subscription for subscriber \"" 
       << subscriber_ptr << "\" at topic \"" << topic 
       << "\" could not be found.";
+    return;
   }
 
-  //std::cout << "subscribers_list_map size is: " 
-    //<< subscribers_list_map.size() << ".\n";
+  im_metered_lock<boost::mutex> members_lock( entry_ptr->members_mutex );
+  auto position_it = entry_ptr->positions.find( subscriber_ptr.get() );
+  if ( position_it == entry_ptr->positions.end() )
+  {
+    return;
+  }
+
+  // The last member takes the place of the one leaving.
+  subscribers_snapshot& members = entry_ptr->members;
+  std::size_t position = position_it->second;
+  entry_ptr->positions.erase( position_it );
+  if ( position + 1 < members.size() )
+  {
+    members[position] = std::move( members.back() );
+    entry_ptr->positions[members[position].get()] = position;
+  }
+  members.pop_back();
+
+  if ( members.empty() && ( entry_ptr != broadcast_subscribers_ptr ) )
+  {
+    // Publishers still holding the previous snapshot finish delivering 
+    // to it; new ones won't find the topic anymore.
+    boost::unique_lock<boost::shared_mutex> map_lock( topics_map_mutex );
+    topics_map.erase( topic );
+  }
+
+  std::atomic_store( &entry_ptr->snapshot_ptr, subscribers_snapshot_ptr() );
 }
 
 void im_message_publisher::publish_message( std::string topic, 
   im_message_subscriber_ptr subscriber_ptr, im_message_ptr im_message_ptr )
 {
-  boost::unique_lock<boost::mutex> scoped_lock( subscribers_list_map_mutex );
-  try
+  bool is_room = ( topic.compare( 0, ROOM_TOPIC_PREFIX.length(), 
+    ROOM_TOPIC_PREFIX ) == 0 );
+
+  topic_subscribers_ptr entry_ptr = find_topic( topic );
+  if ( !entry_ptr )
   {
-    auto subscribers_list = subscribers_list_map.at( topic );
-    //std::cout << "subscribers_list size for topic \"" << topic << "\" is: " 
-      //<< subscribers_list.size() << ".\n";
-    for ( auto subscriber : subscribers_list )
+    if ( !is_room )
     {
-      //std::shared_ptr<im_session> session_ptr = 
-        //std::static_pointer_cast<im_session>(subscriber);
-      if ( ( topic.compare( BROADCAST_TOPIC ) != 0 ) 
-        || ( subscriber_ptr != subscriber ) )
-      {
-        //std::cout << "Sending message to subscriber " 
-          //<< session_ptr->get_session_owner() << ".\n";
-        subscriber->process_message( im_message_ptr );
-      }
-      else
-      {
-        //std::cout << "Message to subscriber " 
-          //<< session_ptr->get_session_owner() << " won't be sent.\n";
-      }
+      std::cerr << "Notify message -> subscription for subscriber \"" 
+        << subscriber_ptr << "\" at topic \"" << topic 
+        << "\" could not be found.";
     }
+    return;
   }
-  catch (std::out_of_range e)
+
+  subscribers_snapshot_ptr snapshot_ptr = get_snapshot( *entry_ptr );
+  bool is_publisher_left_out = is_room 
+    || ( entry_ptr == broadcast_subscribers_ptr );
+  std::size_t deliveries_count = 0;
+  for ( auto& subscriber : *snapshot_ptr )
   {
-    std::cerr << "Notify message -> subscription for subscriber \"" 
-      << subscriber_ptr << "\" at topic \"" << topic 
-      << "\" could not be found.";
+    if ( !is_publisher_left_out || ( subscriber_ptr != subscriber ) )
+    {
+      subscriber->process_message( im_message_ptr );
+      ++deliveries_count;
+    }
   }
+
+  im_metrics::add( im_metrics::publishes );
+  im_metrics::add( im_metrics::publish_deliveries, deliveries_count );
+  im_metrics::record( im_metrics::publish_fan_out, deliveries_count );
+}
+
+std::string im_message_publisher::get_room_topic( boost::string_view room )
+{
+  return ROOM_TOPIC_PREFIX + room.to_string();
 }
 
 //----------------------------------------------------------------------
 // Private methods.
 //----------------------------------------------------------------------
 
+im_message_publisher::topic_subscribers_ptr im_message_publisher::find_topic( 
+  const std::string& topic )
+{
+  if ( topic.compare( BROADCAST_TOPIC ) == 0 )
+  {
+    return broadcast_subscribers_ptr;
+  }
+
+  boost::shared_lock<boost::shared_mutex> map_lock( topics_map_mutex );
+  auto topic_it = topics_map.find( topic );
+  if ( topic_it == topics_map.end() )
+  {
+    return topic_subscribers_ptr();
+  }
+  return topic_it->second;
+}
+
+subscribers_snapshot_ptr im_message_publisher::get_snapshot( 
+  topic_subscribers& subscribers )
+{
+  subscribers_snapshot_ptr snapshot_ptr = 
+    std::atomic_load( &subscribers.snapshot_ptr );
+  if ( snapshot_ptr )
+  {
+    return snapshot_ptr;
+  }
+
+  // Changed since the last publish: the first publisher to get here 
+  // rebuilds it, the others wait for it.
+  //
+  im_metered_lock<boost::mutex> members_lock( subscribers.members_mutex );
+  snapshot_ptr = std::atomic_load( &subscribers.snapshot_ptr );
+  if ( !snapshot_ptr )
+  {
+    snapshot_ptr = 
+      std::make_shared<const subscribers_snapshot>( subscribers.members );
+    std::atomic_store( &subscribers.snapshot_ptr, snapshot_ptr );
+  }
+  return snapshot_ptr;
+}
+
 //----------------------------------------------------------------------
 // Private fields initialization.
 //----------------------------------------------------------------------
 
 // Allowed commands.
 const std::string im_message_publisher::BROADCAST_TOPIC = "broadcast_topic";
+const std::string im_message_publisher::ROOM_TOPIC_PREFIX = "|room|";
 
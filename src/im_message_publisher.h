@@ -10,16 +10,39 @@
 
 #include <cstdlib>
 #include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
 #include <boost/thread/mutex.hpp>
+#include <boost/utility/string_view.hpp>
+#include <boost/thread/shared_mutex.hpp>
 #include "im_message_subscriber.h"
 
 //----------------------------------------------------------------------
 
+// Subscribers of every topic are kept as immutable snapshots. Publishing 
+// only loads the current snapshot of the topic and delivers to it with no 
+// lock held. Subscribe/unsubscribe only change the packed list of members 
+// (O(1), whatever the size of the topic) and drop the snapshot, which the 
+// next publish rebuilds from it and swaps in (copy-on-write), so a burst 
+// of joins or leaves costs a single copy. Rebuilding only locks its own 
+// topic, so it doesn't hold up subscribers of any other one (e.g. logins 
+// while a big room is published to). The broadcast topic is looked up 
+// once, at construction, so broadcasting doesn't even touch the topics map.
+//
+// Room topics (see get_room_topic()) are like the broadcast one: the 
+// publisher isn't delivered its own message, and publishing to a room 
+// nobody is in isn't an error.
+//
 class im_message_publisher
 {
 public:
 
   static const std::string BROADCAST_TOPIC;
+  // Starts with the separator, so room topics never clash with nicknames.
+  static const std::string ROOM_TOPIC_PREFIX;
+
+  static std::string get_room_topic( boost::string_view room );
 
   im_message_publisher();
 
@@ -31,8 +54,33 @@ public:
     im_message_subscriber_ptr subscriber_ptr, im_message_ptr im_message_ptr );
 
 private:
-  boost::mutex subscribers_list_map_mutex;
-  std::map<std::string, subscribers_ptr_list> subscribers_list_map;
+  struct topic_subscribers
+  {
+    // Only accessed through std::atomic_load/std::atomic_store; empty 
+    // while it has to be rebuilt from "members".
+    subscribers_snapshot_ptr snapshot_ptr;
+    // Guards "members" and "positions", and rebuilding the snapshot.
+    boost::mutex members_mutex;
+    // Whoever leaves has its place taken by the last member, and 
+    // "positions" tells where each member is.
+    subscribers_snapshot members;
+    std::unordered_map<im_message_subscriber*, std::size_t> positions;
+  };
+
+  typedef std::shared_ptr<topic_subscribers> topic_subscribers_ptr;
+
+  topic_subscribers_ptr find_topic( const std::string& topic );
+  subscribers_snapshot_ptr get_snapshot( topic_subscribers& subscribers );
+
+private:
+  // Serializes subscribe/unsubscribe, so topics are only added to and 
+  // removed from "topics_map" by one of them at a time.
+  boost::mutex subscribers_writers_mutex;
+  // Guards the structure of "topics_map"; readers hold it just for the 
+  // lookup.
+  boost::shared_mutex topics_map_mutex;
+  std::unordered_map<std::string, topic_subscribers_ptr> topics_map;
+  topic_subscribers_ptr broadcast_subscribers_ptr;
 };
 
 //----------------------------------------------------------------------
@@ -9,6 +9,9 @@
 #define IM_MESSAGE_SUBSCRIBER_H
 
 #include <cstdlib>
+#include <list>
+#include <memory>
+#include <vector>
 #include "im_message.hpp"
 
 //----------------------------------------------------------------------
@@ -26,6 +29,10 @@ typedef std::shared_ptr<im_message_subscriber> im_message_subscriber_ptr;
 
 typedef std::list<im_message_subscriber_ptr> subscribers_ptr_list;
 
+// Immutable list of the subscribers of a topic at some point in time.
+typedef std::vector<im_message_subscriber_ptr> subscribers_snapshot;
+typedef std::shared_ptr<const subscribers_snapshot> subscribers_snapshot_ptr;
+
 //----------------------------------------------------------------------
 
 #endif // IM_MESSAGE_SUBSCRIBER_H
@@ -0,0 +1,224 @@
+//
+// im_metrics.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#include <cstdlib>
+#include "im_message_pool.h"
+#include "im_metrics.h"
+#include "im_session.h"
+
+//----------------------------------------------------------------------
+
+namespace
+{
+  // Same order as im_message::MessageTypes.
+  const char* const message_type_names[im_message::AFTER_LAST_MESSAGE] =
+  {
+    nullptr,
+    "connect",
+    "connect_ack",
+    "connect_rfsd",
+    "message",
+    "message_ack",
+    "message_rfsd",
+    "list_request",
+    "list_response",
+    "disconnect",
+    "disconnect_ack",
+    "broadcast",
+    "stats_request",
+    "stats_response",
+    "join",
+    "join_ack",
+    "join_rfsd",
+    "leave",
+    "leave_ack",
+    "room_message"
+  };
+}
+
+//----------------------------------------------------------------------
+// Constructor
+//----------------------------------------------------------------------
+
+im_metrics::thread_counters::thread_counters()
+{
+  for ( auto& value : values )
+  {
+    value.store( 0, std::memory_order_relaxed );
+  }
+}
+
+//----------------------------------------------------------------------
+// Public methods.
+//----------------------------------------------------------------------
+
+std::int64_t im_metrics::get( int counter )
+{
+  std::int64_t value = 0;
+
+  boost::unique_lock<boost::mutex> scoped_lock( threads_mutex_ );
+  for ( auto counters_ptr : threads_counters_ )
+  {
+    value += counters_ptr->values[counter].load( std::memory_order_relaxed );
+  }
+
+  return value;
+}
+
+void im_metrics::record( int histogram, std::uint64_t value )
+{
+  histograms_[histogram].record( value );
+}
+
+const im_latency_histogram& im_metrics::get_histogram( int histogram )
+{
+  return histograms_[histogram];
+}
+
+void im_metrics::add_gauge( const std::string& name,
+  gauge_function function )
+{
+  boost::unique_lock<boost::mutex> scoped_lock( gauges_mutex_ );
+  gauges_.push_back( std::make_pair( name, function ) );
+}
+
+std::string im_metrics::get_snapshot_text()
+{
+  std::string text;
+
+  append_line( text, "uptime_seconds",
+    std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::steady_clock::now() - start_time_ ).count() );
+
+  std::int64_t connections_opened_count = get( connections_opened );
+  std::int64_t connections_closed_count = get( connections_closed );
+  append_line( text, "connections_open",
+    connections_opened_count - connections_closed_count );
+  append_line( text, "connections_opened", connections_opened_count );
+  append_line( text, "connections_closed", connections_closed_count );
+
+  for ( int type = im_message::PRIOR_FIRST_MESSAGE + 1;
+    type < im_message::AFTER_LAST_MESSAGE; ++type )
+  {
+    append_line( text, std::string( "messages_in." )
+      + message_type_names[type], get( messages_in + type ) );
+  }
+  for ( int type = im_message::PRIOR_FIRST_MESSAGE + 1;
+    type < im_message::AFTER_LAST_MESSAGE; ++type )
+  {
+    append_line( text, std::string( "messages_out." )
+      + message_type_names[type], get( messages_out + type ) );
+  }
+
+  append_line( text, "bytes_read", get( bytes_read ) );
+  append_line( text, "bytes_written", get( bytes_written ) );
+  append_line( text, "writes", im_session::get_writes_count() );
+  append_line( text, "written_frames", im_session::get_written_frames_count() );
+
+  append_line( text, "write_queue_messages", get( write_queue_messages ) );
+  append_line( text, "write_queue_bytes", get( write_queue_bytes ) );
+  append_line( text, "write_queue_dropped_messages",
+    im_session::get_total_dropped_messages_count() );
+  append_line( text, "slow_consumer_disconnects",
+    im_session::get_slow_consumer_disconnects_count() );
+  append_line( text, "oversized_frames_dropped",
+    im_session::get_oversized_frames_count() );
+
+  append_line( text, "publishes", get( publishes ) );
+  append_line( text, "publish_deliveries", get( publish_deliveries ) );
+  append_histogram( text, "publish_fan_out", histograms_[publish_fan_out] );
+
+  append_line( text, "locks_acquired", get( locks_acquired ) );
+  append_line( text, "locks_contended", get( locks_contended ) );
+  append_histogram( text, "lock_wait_ns",
+    histograms_[lock_wait_nanoseconds] );
+
+  im_message_pool::statistics pool_statistics =
+    im_message_pool::get_statistics();
+  append_line( text, "message_pool_hits", pool_statistics.hits );
+  append_line( text, "message_pool_misses", pool_statistics.misses );
+  append_line( text, "message_pool_remote_frees",
+    pool_statistics.remote_frees );
+  append_line( text, "message_pool_blocks", pool_statistics.blocks_count );
+  append_line( text, "message_pool_blocks_high_water",
+    pool_statistics.blocks_high_water );
+
+  // Gauges with the same name are reported once, with their sum, where the
+  // first of them was added.
+  //
+  boost::unique_lock<boost::mutex> scoped_lock( gauges_mutex_ );
+  for ( std::size_t i = 0; i < gauges_.size(); ++i )
+  {
+    bool is_reported = false;
+    for ( std::size_t j = 0; ( j < i ) && !is_reported; ++j )
+    {
+      is_reported = ( gauges_[j].first == gauges_[i].first );
+    }
+    if ( is_reported )
+    {
+      continue;
+    }
+
+    std::int64_t value = 0;
+    for ( std::size_t j = i; j < gauges_.size(); ++j )
+    {
+      if ( gauges_[j].first == gauges_[i].first )
+      {
+        value += gauges_[j].second();
+      }
+    }
+    append_line( text, gauges_[i].first, value );
+  }
+
+  return text;
+}
+
+//----------------------------------------------------------------------
+// Private methods.
+//----------------------------------------------------------------------
+
+void im_metrics::add_local_counters()
+{
+  local_counters_ptr_ = new thread_counters();
+
+  boost::unique_lock<boost::mutex> scoped_lock( threads_mutex_ );
+  threads_counters_.push_back( local_counters_ptr_ );
+}
+
+void im_metrics::append_line( std::string& text, const std::string& name,
+  std::int64_t value )
+{
+  text.append( name ).append( " " ).append( std::to_string( value ) )
+    .append( "\n" );
+}
+
+void im_metrics::append_histogram( std::string& text,
+  const std::string& name, const im_latency_histogram& histogram )
+{
+  append_line( text, name + ".count", histogram.get_count() );
+  append_line( text, name + ".p50", histogram.get_percentile( 50 ) );
+  append_line( text, name + ".p99", histogram.get_percentile( 99 ) );
+  append_line( text, name + ".p99.9", histogram.get_percentile( 99.9 ) );
+  append_line( text, name + ".max", histogram.get_max() );
+  append_line( text, name + ".mean",
+    static_cast<std::int64_t>( histogram.get_mean() ) );
+}
+
+//----------------------------------------------------------------------
+// Private fields initialization.
+//----------------------------------------------------------------------
+
+thread_local im_metrics::thread_counters* im_metrics::local_counters_ptr_ =
+  nullptr;
+boost::mutex im_metrics::threads_mutex_;
+std::vector<im_metrics::thread_counters*> im_metrics::threads_counters_;
+im_latency_histogram im_metrics::histograms_[im_metrics::histograms_count];
+boost::mutex im_metrics::gauges_mutex_;
+std::vector<std::pair<std::string, im_metrics::gauge_function>>
+  im_metrics::gauges_;
+const std::chrono::steady_clock::time_point im_metrics::start_time_ =
+  std::chrono::steady_clock::now();
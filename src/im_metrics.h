@@ -0,0 +1,157 @@
+//
+// im_metrics.h
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#ifndef IM_METRICS_H
+#define IM_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include "im_latency_histogram.h"
+#include "im_message.hpp"
+
+//----------------------------------------------------------------------
+
+// Numbers of the whole process, read by STATS_REQUEST_MSG and by the
+// server's periodic dump.
+//
+// Counters are kept per thread, like im_message_pool's statistics: adding
+// is a plain load and store on a slot only the calling thread writes, and
+// reading sums the slots of every thread. Counters may go down as well,
+// so gauges that are sums (like the depth of every write queue) are
+// counters too. Histograms take any value (not only latencies), recorded
+// without a lock by any thread. Numbers owned by someone else (the
+// logger, each session manager) are read through gauges added with
+// add_gauge().
+//
+class im_metrics
+{
+public:
+  enum counter_id
+  {
+    connections_opened,
+    connections_closed,
+    bytes_read,
+    bytes_written,
+    // Sums of the write queues of every session.
+    write_queue_messages,
+    write_queue_bytes,
+    publishes,
+    publish_deliveries,
+    locks_acquired,
+    // Acquisitions that had to wait for another thread.
+    locks_contended,
+    // One counter per message type, received and sent.
+    messages_in,
+    messages_out = messages_in + im_message::AFTER_LAST_MESSAGE,
+    counters_count = messages_out + im_message::AFTER_LAST_MESSAGE
+  };
+
+  enum histogram_id
+  {
+    // Subscribers each published message went to.
+    publish_fan_out,
+    // How long contended acquisitions waited, in nanoseconds.
+    lock_wait_nanoseconds,
+    histograms_count
+  };
+
+  typedef std::function<std::int64_t()> gauge_function;
+
+  static void add( int counter, std::int64_t value = 1 );
+  static std::int64_t get( int counter );
+
+  static void record( int histogram, std::uint64_t value );
+  static const im_latency_histogram& get_histogram( int histogram );
+
+  // Gauges with the same name are added up, so each shard may add its own.
+  static void add_gauge( const std::string& name, gauge_function function );
+
+  // A "<name> <value>" line for every number.
+  static std::string get_snapshot_text();
+
+private:
+  struct thread_counters
+  {
+    thread_counters();
+
+    // Written by the owner thread only, read by get().
+    std::atomic<std::int64_t> values[counters_count];
+  };
+
+  static void add_local_counters();
+  static void append_line( std::string& text, const std::string& name,
+    std::int64_t value );
+  static void append_histogram( std::string& text, const std::string& name,
+    const im_latency_histogram& histogram );
+
+private:
+  // Counters of threads are kept as long as the process, like message
+  // pools.
+  static thread_local thread_counters* local_counters_ptr_;
+  static boost::mutex threads_mutex_;
+  static std::vector<thread_counters*> threads_counters_;
+  static im_latency_histogram histograms_[histograms_count];
+  static boost::mutex gauges_mutex_;
+  static std::vector<std::pair<std::string, gauge_function>> gauges_;
+  static const std::chrono::steady_clock::time_point start_time_;
+};
+
+//----------------------------------------------------------------------
+
+inline void im_metrics::add( int counter, std::int64_t value )
+{
+  if ( local_counters_ptr_ == nullptr )
+  {
+    add_local_counters();
+  }
+
+  std::atomic<std::int64_t>& local_value =
+    local_counters_ptr_->values[counter];
+  local_value.store( local_value.load( std::memory_order_relaxed ) + value,
+    std::memory_order_relaxed );
+}
+
+//----------------------------------------------------------------------
+
+// Locks "mutex" for its scope, like boost::unique_lock, counting the
+// acquisitions and how long the ones finding it taken had to wait.
+//
+template <class Mutex>
+class im_metered_lock
+{
+public:
+  explicit im_metered_lock( Mutex& mutex )
+    : lock_( mutex, boost::try_to_lock )
+  {
+    im_metrics::add( im_metrics::locks_acquired );
+    if ( !lock_.owns_lock() )
+    {
+      std::chrono::steady_clock::time_point wait_start =
+        std::chrono::steady_clock::now();
+      lock_.lock();
+      im_metrics::add( im_metrics::locks_contended );
+      im_metrics::record( im_metrics::lock_wait_nanoseconds,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - wait_start ).count() );
+    }
+  }
+
+private:
+  boost::unique_lock<Mutex> lock_;
+};
+
+//----------------------------------------------------------------------
+
+#endif // IM_METRICS_H
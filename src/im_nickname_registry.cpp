@@ -0,0 +1,216 @@
+//
+// im_nickname_registry.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <boost/functional/hash.hpp>
+#include "im_metrics.h"
+#include "im_nickname_registry.h"
+
+//----------------------------------------------------------------------
+// Constructor
+//----------------------------------------------------------------------
+
+im_nickname_registry::im_nickname_registry()
+  : entries_version( 0 )
+{
+  rebuild_directory( min_directory_buckets_count );
+}
+
+//----------------------------------------------------------------------
+// Public methods.
+//----------------------------------------------------------------------
+
+bool im_nickname_registry::try_register( const std::string& nickname,
+  im_session_ptr session_ptr )
+{
+  im_metered_lock<boost::mutex> scoped_lock( registry_mutex );
+  if ( !entries_index.insert( std::pair<std::string, std::size_t>(
+    nickname, entries.size() ) ).second )
+  {
+    return false;
+  }
+
+  registry_entry entry;
+  entry.nickname = nickname;
+  entry.session_ptr = session_ptr;
+  entries.push_back( entry );
+  insert_directory_entry( entry );
+  ++entries_version;
+  nicknames_snapshot_ptr_.reset();
+  return true;
+}
+
+bool im_nickname_registry::unregister( const std::string& nickname,
+  im_session_ptr session_ptr )
+{
+  im_metered_lock<boost::mutex> scoped_lock( registry_mutex );
+  auto index_it = entries_index.find( nickname );
+  if ( ( index_it == entries_index.end() )
+    || ( entries[index_it->second].session_ptr != session_ptr ) )
+  {
+    return false;
+  }
+
+  // Move the last entry into the hole.
+  //
+  std::size_t position = index_it->second;
+  entries_index.erase( index_it );
+  remove_directory_entry( nickname );
+  if ( position != entries.size() - 1 )
+  {
+    entries[position] = std::move( entries.back() );
+    entries_index[entries[position].nickname] = position;
+  }
+  entries.pop_back();
+  ++entries_version;
+  nicknames_snapshot_ptr_.reset();
+  return true;
+}
+
+im_session_ptr im_nickname_registry::find( boost::string_view nickname )
+{
+  directory_table_ptr table_ptr = std::atomic_load( &directory_table_ptr_ );
+  directory_bucket_ptr bucket_ptr = std::atomic_load( 
+    &table_ptr->buckets[get_bucket_index( *table_ptr, nickname )] );
+  if ( bucket_ptr )
+  {
+    for ( auto& entry : *bucket_ptr )
+    {
+      if ( entry.nickname == nickname )
+      {
+        return entry.session_ptr;
+      }
+    }
+  }
+  return im_session_ptr();
+}
+
+std::size_t im_nickname_registry::size()
+{
+  im_metered_lock<boost::mutex> scoped_lock( registry_mutex );
+  return entries.size();
+}
+
+im_nickname_registry::nicknames_snapshot_ptr
+  im_nickname_registry::get_nicknames_snapshot()
+{
+  auto snapshot_ptr = std::make_shared<nicknames_snapshot>();
+  std::uint64_t snapshot_version;
+  {
+    im_metered_lock<boost::mutex> scoped_lock( registry_mutex );
+    if ( nicknames_snapshot_ptr_ )
+    {
+      return nicknames_snapshot_ptr_;
+    }
+
+    snapshot_ptr->reserve( entries.size() );
+    for ( auto& entry : entries )
+    {
+      snapshot_ptr->push_back( entry.nickname );
+    }
+    snapshot_version = entries_version;
+  }
+
+  std::sort( snapshot_ptr->begin(), snapshot_ptr->end() );
+
+  // Only cached if nothing changed while sorting; it's a consistent view 
+  // of the registry either way.
+  //
+  im_metered_lock<boost::mutex> scoped_lock( registry_mutex );
+  if ( snapshot_version == entries_version )
+  {
+    nicknames_snapshot_ptr_ = snapshot_ptr;
+  }
+  return snapshot_ptr;
+}
+
+//----------------------------------------------------------------------
+// Private methods.
+//----------------------------------------------------------------------
+
+std::size_t im_nickname_registry::get_bucket_index(
+  const directory_table& table, boost::string_view nickname )
+{
+  // The number of buckets is always a power of two.
+  return boost::hash_range( nickname.begin(), nickname.end() ) 
+    & ( table.buckets.size() - 1 );
+}
+
+void im_nickname_registry::insert_directory_entry(
+  const registry_entry& entry )
+{
+  // Must be called with "registry_mutex" held.
+  //
+  directory_table& table = *directory_table_ptr_;
+  if ( entries.size() > table.buckets.size() )
+  {
+    // "entries" already has the new one.
+    rebuild_directory( table.buckets.size() * 2 );
+    return;
+  }
+
+  std::size_t bucket_index = get_bucket_index( table, entry.nickname );
+  auto new_bucket_ptr = table.buckets[bucket_index]
+    ? std::make_shared<directory_bucket>( *table.buckets[bucket_index] )
+    : std::make_shared<directory_bucket>();
+  new_bucket_ptr->push_back( entry );
+  std::atomic_store( &table.buckets[bucket_index],
+    directory_bucket_ptr( new_bucket_ptr ) );
+}
+
+void im_nickname_registry::remove_directory_entry(
+  const std::string& nickname )
+{
+  // Must be called with "registry_mutex" held.
+  //
+  directory_table& table = *directory_table_ptr_;
+  std::size_t bucket_index = get_bucket_index( table, nickname );
+  if ( !table.buckets[bucket_index] )
+  {
+    return;
+  }
+
+  auto new_bucket_ptr = std::make_shared<directory_bucket>();
+  for ( auto& entry : *table.buckets[bucket_index] )
+  {
+    if ( entry.nickname != nickname )
+    {
+      new_bucket_ptr->push_back( entry );
+    }
+  }
+  std::atomic_store( &table.buckets[bucket_index], new_bucket_ptr->empty()
+    ? directory_bucket_ptr() : directory_bucket_ptr( new_bucket_ptr ) );
+}
+
+void im_nickname_registry::rebuild_directory( std::size_t buckets_count )
+{
+  // Must be called with "registry_mutex" held. Readers keep using the 
+  // previous table (whose buckets don't change anymore) until they load 
+  // the new one.
+  //
+  auto new_table_ptr = std::make_shared<directory_table>();
+  new_table_ptr->buckets.resize( buckets_count );
+
+  std::vector<std::shared_ptr<directory_bucket>> new_buckets( buckets_count );
+  for ( auto& entry : entries )
+  {
+    std::size_t bucket_index = get_bucket_index( *new_table_ptr, 
+      entry.nickname );
+    if ( !new_buckets[bucket_index] )
+    {
+      new_buckets[bucket_index] = std::make_shared<directory_bucket>();
+    }
+    new_buckets[bucket_index]->push_back( entry );
+  }
+  for ( std::size_t i = 0; i < buckets_count; ++i )
+  {
+    new_table_ptr->buckets[i] = new_buckets[i];
+  }
+
+  std::atomic_store( &directory_table_ptr_, new_table_ptr );
+}
@@ -0,0 +1,96 @@
+//
+// im_nickname_registry.h
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#ifndef IM_NICKNAME_REGISTRY_H
+#define IM_NICKNAME_REGISTRY_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility/string_view.hpp>
+#include "im_session.h"
+
+//----------------------------------------------------------------------
+
+// Registered nicknames and the sessions owning them, the single source of
+// truth of who is online on a server (or shard).
+//
+// Entries are kept in a dense vector indexed by a hash map, so register,
+// lookup and unregister are O(1): an entry is removed by moving the last
+// one into its place. LIST is served from an immutable sorted snapshot,
+// rebuilt (sorting outside the lock) only the first time it's asked for
+// after the registry changed, so paging through it never holds up logins.
+//
+// Lookups, on the path of every message, take no lock at all: they read
+// a separate directory of immutable hash buckets, published RCU style.
+// Writers (still serialized by "registry_mutex") replace the bucket they
+// change with an updated copy, and shared_ptr reference counts keep old
+// buckets alive until the last reader lets go of them.
+//
+class im_nickname_registry
+{
+public:
+  typedef std::vector<std::string> nicknames_snapshot;
+  typedef std::shared_ptr<const nicknames_snapshot> nicknames_snapshot_ptr;
+
+  enum { min_directory_buckets_count = 64 };
+
+  im_nickname_registry();
+
+  // Registers "nickname" to "session_ptr" unless it's already taken;
+  // checking and registering are a single atomic step.
+  bool try_register( const std::string& nickname, im_session_ptr session_ptr );
+  // Only removes the entry if it still belongs to "session_ptr".
+  bool unregister( const std::string& nickname, im_session_ptr session_ptr );
+  im_session_ptr find( boost::string_view nickname );
+  std::size_t size();
+
+  nicknames_snapshot_ptr get_nicknames_snapshot();
+
+private:
+  struct registry_entry
+  {
+    std::string nickname;
+    im_session_ptr session_ptr;
+  };
+
+  typedef std::vector<registry_entry> directory_bucket;
+  typedef std::shared_ptr<const directory_bucket> directory_bucket_ptr;
+
+  // Buckets are only accessed through std::atomic_load/std::atomic_store.
+  struct directory_table
+  {
+    std::vector<directory_bucket_ptr> buckets;
+  };
+
+  typedef std::shared_ptr<directory_table> directory_table_ptr;
+
+  static std::size_t get_bucket_index( const directory_table& table,
+    boost::string_view nickname );
+  void insert_directory_entry( const registry_entry& entry );
+  void remove_directory_entry( const std::string& nickname );
+  void rebuild_directory( std::size_t buckets_count );
+
+private:
+  boost::mutex registry_mutex;
+  std::unordered_map<std::string, std::size_t> entries_index;
+  std::vector<registry_entry> entries;
+  // Bumped whenever "entries" changes, which also resets the snapshot.
+  std::uint64_t entries_version;
+  nicknames_snapshot_ptr nicknames_snapshot_ptr_;
+  // Only accessed through std::atomic_load/std::atomic_store.
+  directory_table_ptr directory_table_ptr_;
+};
+
+//----------------------------------------------------------------------
+
+#endif // IM_NICKNAME_REGISTRY_H
@@ -23,16 +23,40 @@ using boost::asio::ip::tcp;
 //----------------------------------------------------------------------
 
 im_server::im_server(boost::asio::io_service& io_service,
-    const tcp::endpoint& endpoint)
-  : acceptor_(io_service, endpoint),
+    const tcp::endpoint& endpoint, bool reuse_port)
+  : acceptor_(io_service),
     socket_(io_service)
 {
+  // With "reuse_port" several servers (one per shard) listen on the same 
+  // port and the kernel spreads the incoming connections among them.
+  //
+  typedef boost::asio::detail::socket_option::boolean<
+    SOL_SOCKET, SO_REUSEPORT> reuse_port_option;
+
+  acceptor_.open(endpoint.protocol());
+  acceptor_.set_option(tcp::acceptor::reuse_address(true));
+  if (reuse_port)
+  {
+    acceptor_.set_option(reuse_port_option(true));
+  }
+  acceptor_.bind(endpoint);
+  acceptor_.listen();
+
   im_session_manager_ptr_ = std::make_shared<im_session_manager>();
   im_session_manager_ptr_->start();
   do_accept();
   Logger::instance();
 }
 
+//----------------------------------------------------------------------
+// Public methods.
+//----------------------------------------------------------------------
+
+im_session_manager_ptr im_server::get_session_manager() const
+{
+  return im_session_manager_ptr_;
+}
+
 //----------------------------------------------------------------------
 // Private methods.
 //----------------------------------------------------------------------
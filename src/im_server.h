@@ -21,7 +21,9 @@ class im_server
 {
 public:
   im_server(boost::asio::io_service& io_service,
-      const tcp::endpoint& endpoint);
+      const tcp::endpoint& endpoint, bool reuse_port = false);
+
+  im_session_manager_ptr get_session_manager() const;
 
 private:
   void do_accept();
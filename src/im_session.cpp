@@ -8,10 +8,13 @@
 // Kohlhoff (chris at kohlhoff dot com)
 //
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include "im_session.h"
 #include "im_message.hpp"
+#include "im_metrics.h"
 
 using boost::asio::ip::tcp;
 
@@ -21,8 +24,33 @@ using boost::asio::ip::tcp;
 
 im_session::im_session(socket_ptr socket_ptr)
     : socket_ptr_(socket_ptr),
+      strand_(socket_ptr->get_executor()),
+      read_buffer_(read_buffer_size),
+      read_buffer_length_(0),
+      read_protocol_version_(im_message::LEGACY_PROTOCOL),
+      requested_protocol_version_(im_message::LEGACY_PROTOCOL),
+      write_protocol_version_(im_message::LEGACY_PROTOCOL),
+      relay_max_value_length_(im_message::max_value_length),
+      write_sequence_(0),
+      writing_frames_count_(0),
+      write_queue_length_(0),
+      write_queue_bytes_(0),
+      queued_bytes_(0),
+      write_queue_policy_(default_write_queue_policy_),
+      dropped_messages_count_(0),
+      is_write_queue_closed_(false),
       is_connected_(true)
 {
+  im_metrics::add( im_metrics::connections_opened );
+}
+
+im_session::~im_session()
+{
+  // Whatever was still queued leaves the totals with the session.
+  im_metrics::add( im_metrics::write_queue_messages, 
+    -static_cast<std::int64_t>( write_queue_length_.load() ) );
+  im_metrics::add( im_metrics::write_queue_bytes, 
+    -static_cast<std::int64_t>( write_queue_bytes_.load() ) );
 }
 
 //----------------------------------------------------------------------
@@ -32,35 +60,58 @@ im_session::im_session(socket_ptr socket_ptr)
 void im_session::start(im_session_handler_callback_ptr callback_ptr)
 {
   callback_ptr_ = callback_ptr;
-  do_read_type();
+  do_read();
 }
 
 void im_session::send_message(im_message_ptr im_message_ptr)
 {
-  boost::unique_lock<boost::mutex> scoped_lock( write_msgs_mutex_ );
-  //std::cout << "im_session::send_message -> Sending message...\n";
-  bool write_in_progress = !write_msgs_.empty();
-  //std::cout << "Pushed back message: \"" << im_message_ptr->data() << "\"\n";
-  write_msgs_.push_back(im_message_ptr);
-  if (!write_in_progress)
-  {
-    do_write();
-  }
+  // May be called from any thread (other sessions' handlers publish to 
+  // this one), so the write queue is only touched from inside the strand.
+  //
+  auto self(shared_from_this());
+  boost::asio::post(strand_,
+      [this, self, im_message_ptr]()
+      {
+        //std::cout << "im_session::send_message -> Sending message...\n";
+        enqueue_message(im_message_ptr);
+      });
+}
+
+void im_session::send_messages(std::vector<im_message_ptr> im_messages)
+{
+  auto self(shared_from_this());
+  auto im_messages_ptr = 
+    std::make_shared<std::vector<im_message_ptr>>(std::move(im_messages));
+  boost::asio::dispatch(strand_,
+      [this, self, im_messages_ptr]()
+      {
+        for (im_message_ptr& im_message_ptr : *im_messages_ptr)
+        {
+          enqueue_message(im_message_ptr);
+        }
+      });
 }
 
 const bool im_session::is_connected()
 {
-  boost::unique_lock<boost::mutex> scoped_lock( is_connected_mutex_ );
   return is_connected_;
 }
 
 void im_session::disconnect( bool close_socket )
 {
-  boost::unique_lock<boost::mutex> scoped_lock( is_connected_mutex_ );
-  is_connected_ = false;
+  if ( is_connected_.exchange( false ) )
+  {
+    im_metrics::add( im_metrics::connections_closed );
+  }
   if ( close_socket )
   {
-    socket_ptr_->close();
+    auto self(shared_from_this());
+    boost::asio::dispatch(strand_,
+        [this, self]()
+        {
+          boost::system::error_code ignored_ec;
+          socket_ptr_->close( ignored_ec );
+        });
   }
 }
 
@@ -69,44 +120,193 @@ void im_session::set_session_owner( const std::string session_owner )
   session_owner_ = session_owner;
 }
 
-std::string im_session::get_session_owner() const
+const std::string& im_session::get_session_owner() const
 {
   return session_owner_;
 }
 
+int im_session::negotiate_protocol_version() const
+{
+  return std::min( requested_protocol_version_, max_protocol_version_ );
+}
+
+std::size_t im_session::get_max_value_length() const
+{
+  return get_max_value_length( read_protocol_version_ );
+}
+
+std::size_t im_session::get_max_value_length( int protocol_version )
+{
+  return ( protocol_version == im_message::BINARY_PROTOCOL ) 
+    ? static_cast<std::size_t>( im_message::max_binary_value_length ) 
+    : static_cast<std::size_t>( im_message::max_value_length );
+}
+
+void im_session::set_relay_max_value_length( std::size_t max_value_length )
+{
+  relay_max_value_length_ = max_value_length;
+}
+
+std::size_t im_session::get_relay_max_value_length() const
+{
+  return relay_max_value_length_;
+}
+
+im_message_audit::sender_state& im_session::get_audit_state()
+{
+  return audit_state_;
+}
+
+std::vector<std::string>& im_session::get_joined_rooms()
+{
+  return joined_rooms_;
+}
+
+im_message_ptr im_session::take_received_message()
+{
+  im_message_ptr received_msg_ptr;
+  received_msg_ptr.swap( read_msg_ptr_ );
+  return received_msg_ptr;
+}
+
+void im_session::switch_protocol_version( int protocol_version, 
+  im_message_ptr handshake_msg_ptr )
+{
+  read_protocol_version_ = protocol_version;
+
+  // Called from the session's own handlers, so the answer is queued right 
+  // away, ahead of whatever other threads send once they can find the 
+  // session.
+  //
+  auto self(shared_from_this());
+  boost::asio::dispatch(strand_,
+      [this, self, protocol_version, handshake_msg_ptr]()
+      {
+        if (handshake_msg_ptr)
+        {
+          enqueue_message(handshake_msg_ptr);
+        }
+        write_protocol_version_ = protocol_version;
+      });
+}
+
 //----------------------------------------------------------------------
 
 void im_session::process_message( im_message_ptr im_message_ptr )
 {
-  boost::unique_lock<boost::mutex> scoped_lock( is_connected_mutex_ );
   if ( is_connected_ )
   {
     send_message( im_message_ptr );
   }
 }
 
+//----------------------------------------------------------------------
+
+void im_session::set_write_queue_policy( int policy )
+{
+  write_queue_policy_ = policy;
+}
+
+std::size_t im_session::get_write_queue_length() const
+{
+  return write_queue_length_.load( std::memory_order_relaxed );
+}
+
+std::size_t im_session::get_write_queue_bytes() const
+{
+  return write_queue_bytes_.load( std::memory_order_relaxed );
+}
+
+std::uint64_t im_session::get_dropped_messages_count() const
+{
+  return dropped_messages_count_.load( std::memory_order_relaxed );
+}
+
+//----------------------------------------------------------------------
+
+void im_session::set_write_batch_limits( std::size_t max_bytes, 
+  std::size_t max_frames )
+{
+  max_write_batch_bytes_ = max_bytes;
+  max_write_batch_frames_ = ( max_frames > 0 ) ? max_frames : 1;
+}
+
+std::uint64_t im_session::get_writes_count()
+{
+  return writes_count_;
+}
+
+std::uint64_t im_session::get_written_frames_count()
+{
+  return written_frames_count_;
+}
+
+void im_session::set_write_queue_limits( std::size_t max_messages, 
+  std::size_t max_bytes )
+{
+  max_write_queue_messages_ = ( max_messages > 0 ) ? max_messages : 1;
+  max_write_queue_bytes_ = max_bytes;
+}
+
+void im_session::set_default_write_queue_policy( int policy )
+{
+  default_write_queue_policy_ = policy;
+}
+
+std::uint64_t im_session::get_total_dropped_messages_count()
+{
+  return total_dropped_messages_count_;
+}
+
+std::uint64_t im_session::get_slow_consumer_disconnects_count()
+{
+  return slow_consumer_disconnects_count_;
+}
+
+std::uint64_t im_session::get_oversized_frames_count()
+{
+  return oversized_frames_count_;
+}
+
+void im_session::set_max_protocol_version( int protocol_version )
+{
+  max_protocol_version_ = protocol_version;
+}
+
 //----------------------------------------------------------------------
 // Private methods.
 //----------------------------------------------------------------------
 
-void im_session::do_read_type()
+void im_session::do_read()
 {
   if ( !callback_ptr_)
   {
     std::cerr << "IM message handler must be set first!\n";
   }
   else {
-    //std::cout << "Call Reading type...\n";
+    // Read whatever the socket already has, after any partial frame left 
+    // over from the previous read.
+    //
     auto self(shared_from_this());
-    boost::asio::async_read(*socket_ptr_,
-        boost::asio::buffer(read_msg_.data(), im_message::type_length),
-        [this, self](boost::system::error_code ec, std::size_t /*length*/)
+    socket_ptr_->async_read_some(
+        boost::asio::buffer(read_buffer_.data() + read_buffer_length_, 
+          read_buffer_.size() - read_buffer_length_),
+        boost::asio::bind_executor(strand_,
+        [this, self](boost::system::error_code ec, std::size_t length)
         {
-          //std::cout << "Read type..." << read_msg_.data() << "\n";
-          if (!ec && read_msg_.decode_type())
+          if (!ec)
+          {
+            read_buffer_length_ += length;
+            im_metrics::add( im_metrics::bytes_read, length );
+            if (!decode_frames())
+            {
+              ec = boost::asio::error::invalid_argument;
+            }
+          }
+
+          if (!ec)
           {
-            //std::cout << "Type is: " << read_msg_.type() << "\n";
-            do_read_length();
+            do_read();
           }
           else
           {
@@ -116,79 +316,144 @@ void im_session::do_read_type()
             }
             disconnect( true );
           }
-        });
+        }));
   }
 }
 
-void im_session::do_read_length()
+bool im_session::decode_frames()
 {
-  if ( !callback_ptr_)
+  // Hands over every complete frame in the buffer, then moves the partial 
+  // frame (if any) to the beginning so the next read completes it.
+  //
+  std::size_t frame_begin = 0;
+  while ( true )
   {
-    std::cerr << "IM message handler must be set first!\n";
+    std::size_t header_length = 
+      ( read_protocol_version_ == im_message::BINARY_PROTOCOL ) 
+        ? static_cast<std::size_t>( im_message::binary_header_length ) 
+        : static_cast<std::size_t>( im_message::header_length );
+
+    if ( read_buffer_length_ - frame_begin < header_length )
+    {
+      break;
+    }
+
+    // Payloads are handed over as C strings, so the message must start 
+    // zeroed rather than with whatever the allocator left in it.
+    //
+    if ( !read_msg_ptr_ )
+    {
+      read_msg_ptr_ = im_message::create();
+      read_msg_ptr_->clear();
+    }
+
+    if ( !decode_header( read_buffer_.data() + frame_begin, header_length ) )
+    {
+      return false;
+    }
+
+    if ( read_buffer_length_ - frame_begin 
+      < header_length + read_msg_ptr_->value_length() )
+    {
+      // Frames bigger than the receive buffer (only possible with the 
+      // binary protocol) make it grow to hold them.
+      //
+      if ( header_length + read_msg_ptr_->value_length() 
+        > read_buffer_.size() )
+      {
+        std::memmove( read_buffer_.data(), read_buffer_.data() + frame_begin, 
+          read_buffer_length_ - frame_begin );
+        read_buffer_length_ -= frame_begin;
+        frame_begin = 0;
+        read_buffer_.resize( 
+          header_length + read_msg_ptr_->value_length() );
+      }
+      break;
+    }
+
+    std::memcpy( read_msg_ptr_->value(), 
+      read_buffer_.data() + frame_begin + header_length, 
+      read_msg_ptr_->value_length() );
+    read_msg_ptr_->value()[read_msg_ptr_->value_length()] = '\0';
+    frame_begin += header_length + read_msg_ptr_->value_length();
+
+    im_metrics::add( im_metrics::messages_in + read_msg_ptr_->type() );
+
+    if ( read_msg_ptr_->is_connect_msg() )
+    {
+      requested_protocol_version_ = 
+        read_msg_ptr_->get_protocol_version();
+    }
+
+    callback_ptr_->on_message_received(shared_from_this(), 
+      *read_msg_ptr_);
   }
-  else {
-    //std::cout << "Call Reading length...\n";
-    auto self(shared_from_this());
-    boost::asio::async_read(*socket_ptr_,
-        boost::asio::buffer(read_msg_.header(), im_message::length_length),
-        [this, self](boost::system::error_code ec, std::size_t /*length*/)
-        {
-          //std::cout << "Read length..." << read_msg_.header() << "\n";
-          if (!ec && read_msg_.decode_length())
-          {
-            if (read_msg_.value_length() > 0)
-            {
-              //std::cout << "Length: " << read_msg_.value_length() << "\n";
-              do_read_value();
-            }
-            else
-            {
-              callback_ptr_->on_message_received(self, read_msg_);
-              do_read_type();
-            }
-          }
-          else
-          {
-            if ( is_connected_ )
-            {
-              callback_ptr_->on_error(self, ec);
-            }
-            disconnect( true );
-          }
-        });
+
+  if ( frame_begin > 0 )
+  {
+    std::memmove( read_buffer_.data(), read_buffer_.data() + frame_begin, 
+      read_buffer_length_ - frame_begin );
+    read_buffer_length_ -= frame_begin;
   }
+
+  return true;
 }
 
-void im_session::do_read_value()
+bool im_session::decode_header( const char* header, 
+  std::size_t header_length )
 {
-  if ( !callback_ptr_)
+  if ( read_protocol_version_ == im_message::BINARY_PROTOCOL )
   {
-    std::cerr << "IM message handler must be set first!\n";
+    return read_msg_ptr_->decode_binary_header( header );
   }
-  else {
-    //std::cout << "Call Reading value...\n";
-    auto self(shared_from_this());
-    boost::asio::async_read(*socket_ptr_,
-        boost::asio::buffer(read_msg_.value(), read_msg_.value_length()),
-        [this, self](boost::system::error_code ec, std::size_t /*length*/)
-        {
-          //std::cout << "Read value...\n";
-          if (!ec)
-          {
-            callback_ptr_->on_message_received(self, read_msg_);
-            read_msg_.clear();
-            //std::cout << "read_msg_ was cleared an now is: " << read_msg_.data() << "\n";
-            do_read_type();
-          }
-          else
-          {
-            if ( is_connected_ )
-            {
-              callback_ptr_->on_error(self, ec);
-            }
-            disconnect( true );
-          }
-        });
+
+  std::memcpy( read_msg_ptr_->data(), header, header_length );
+  return read_msg_ptr_->decode_type() && read_msg_ptr_->decode_length();
+}
+
+void im_session::enqueue_message( im_message_ptr im_message_ptr )
+{
+  // The header is chosen when the frame is queued, not when it is written, 
+  // so a protocol switch never changes frames queued before it.
+  //
+  if ( ( write_protocol_version_ == im_message::LEGACY_PROTOCOL ) 
+    && ( im_message_ptr->value_length() > im_message::max_value_length ) )
+  {
+    ++oversized_frames_count_;
+    if ( callback_ptr_ )
+    {
+      callback_ptr_->on_oversized_frame( shared_from_this(), 
+        *im_message_ptr );
+    }
+    return;
+  }
+
+  std::size_t frame_length = 
+    ( write_protocol_version_ == im_message::BINARY_PROTOCOL ) 
+      ? im_message::binary_header_length + im_message_ptr->value_length() 
+      : im_message_ptr->length();
+  if ( is_write_queue_closed_ || !make_room_in_write_queue( frame_length ) )
+  {
+    return;
+  }
+
+  bool write_in_progress = !write_msgs_.empty();
+  write_msgs_.push_back( queued_message() );
+  queued_message& queued_msg = write_msgs_.back();
+  queued_msg.message_ptr = im_message_ptr;
+  queued_msg.protocol_version = write_protocol_version_;
+  queued_msg.frame_length = frame_length;
+  if ( write_protocol_version_ == im_message::BINARY_PROTOCOL )
+  {
+    // A dropped frame leaves a gap in the sequence numbers.
+    im_message_ptr->encode_binary_header( queued_msg.binary_header, 
+      ++write_sequence_ );
+  }
+  set_write_queue_depth( write_msgs_.size(), queued_bytes_ + frame_length );
+
+  if (!write_in_progress)
+  {
+    do_write();
   }
 }
 
@@ -200,19 +465,65 @@ void im_session::do_write()
   }
   else {
     auto self(shared_from_this());
+
+    // Gather everything queued so far (up to the batch limits) into a 
+    // single write, instead of one write per frame. The first frame always 
+    // goes, even if it alone is bigger than the byte limit.
+    //
+    std::size_t batch_bytes = 0;
+    write_buffers_.clear();
+    writing_frames_count_ = 0;
+    for ( auto& queued_msg : write_msgs_ )
+    {
+      const im_message& msg = *queued_msg.message_ptr;
+      std::size_t frame_length = queued_msg.frame_length;
+
+      if ( ( writing_frames_count_ > 0 ) 
+        && ( ( writing_frames_count_ >= max_write_batch_frames_ ) 
+          || ( batch_bytes + frame_length > max_write_batch_bytes_ ) ) )
+      {
+        break;
+      }
+
+      if ( queued_msg.protocol_version == im_message::BINARY_PROTOCOL )
+      {
+        write_buffers_.push_back( boost::asio::buffer( 
+          queued_msg.binary_header, im_message::binary_header_length ) );
+        write_buffers_.push_back( 
+          boost::asio::buffer( msg.value(), msg.value_length() ) );
+      }
+      else
+      {
+        write_buffers_.push_back( 
+          boost::asio::buffer( msg.data(), msg.length() ) );
+      }
+      batch_bytes += frame_length;
+      ++writing_frames_count_;
+    }
+
     //std::cout << "Preparing to send the message...\n";
-    //std::cout << "Which is: \"" << write_msgs_.front()->data() << "\"\n";
-    //std::cout << "Total size: \"" << write_msgs_.front()->length() << 
-      //", and value_length :" << write_msgs_.front()->value_length() << "\"\n";
     boost::asio::async_write(*socket_ptr_,
-        boost::asio::buffer(write_msgs_.front()->data(),
-          write_msgs_.front()->length()),
+        write_buffers_,
+        boost::asio::bind_executor(strand_,
         [this, self](boost::system::error_code ec, std::size_t /*length*/)
         {
           if (!ec)
           {
-            boost::unique_lock<boost::mutex> scoped_lock( write_msgs_mutex_ );
-            write_msgs_.pop_front();
+            ++writes_count_;
+            written_frames_count_ += writing_frames_count_;
+            std::size_t written_bytes = 0;
+            for ( std::size_t i = 0; i < writing_frames_count_; ++i )
+            {
+              written_bytes += write_msgs_[i].frame_length;
+              im_metrics::add( im_metrics::messages_out 
+                + write_msgs_[i].message_ptr->type() );
+            }
+            im_metrics::add( im_metrics::bytes_written, written_bytes );
+            write_msgs_.erase( write_msgs_.begin(), 
+              write_msgs_.begin() + writing_frames_count_ );
+            writing_frames_count_ = 0;
+            set_write_queue_depth( write_msgs_.size(), 
+              queued_bytes_ - written_bytes );
             if (!write_msgs_.empty())
             {
               do_write();
@@ -226,6 +537,128 @@ void im_session::do_write()
             }
             disconnect( true );
           }
-        });
+        }));
+  }
+}
+
+bool im_session::make_room_in_write_queue( std::size_t frame_length )
+{
+  // A frame too big for the byte limit on its own still goes when the 
+  // queue is empty, like the first frame of a write batch.
+  //
+  while ( !write_msgs_.empty() 
+    && ( ( write_msgs_.size() >= max_write_queue_messages_ ) 
+      || ( queued_bytes_ + frame_length > max_write_queue_bytes_ ) ) )
+  {
+    int policy = write_queue_policy_;
+    if ( policy == disconnect_consumer )
+    {
+      disconnect_slow_consumer();
+      return false;
+    }
+
+    if ( policy == drop_oldest_broadcast )
+    {
+      auto broadcast_it = std::find_if( 
+        write_msgs_.begin() + writing_frames_count_, write_msgs_.end(), 
+        []( const queued_message& queued_msg )
+        { 
+          return queued_msg.message_ptr->is_broadcast_msg(); 
+        } );
+      if ( broadcast_it != write_msgs_.end() )
+      {
+        // The frames being written must stay where they are, since the 
+        // write buffers point into them (binary headers included), but 
+        // deque::erase() may shift the front elements instead of the back 
+        // ones. Only the frames queued after the dropped one are moved.
+        //
+        std::size_t remaining_bytes = queued_bytes_ 
+          - broadcast_it->frame_length;
+        std::move( broadcast_it + 1, write_msgs_.end(), broadcast_it );
+        write_msgs_.pop_back();
+        set_write_queue_depth( write_msgs_.size(), remaining_bytes );
+        count_dropped_message();
+        continue;
+      }
+    }
+
+    // Nothing (else) can make room: the new message is the one dropped.
+    count_dropped_message();
+    return false;
   }
+  return true;
 }
+
+void im_session::count_dropped_message()
+{
+  if ( dropped_messages_count_.fetch_add( 1, std::memory_order_relaxed ) 
+    == 0 )
+  {
+    std::cerr << "Write queue of \"" << session_owner_ 
+      << "\" is full; dropping messages.\n";
+  }
+  ++total_dropped_messages_count_;
+}
+
+void im_session::disconnect_slow_consumer()
+{
+  std::cerr << "Write queue of \"" << session_owner_ 
+    << "\" is full; disconnecting it.\n";
+  ++slow_consumer_disconnects_count_;
+  is_write_queue_closed_ = true;
+
+  // Frees everything that isn't being written already.
+  //
+  std::size_t remaining_bytes = 0;
+  for ( std::size_t i = 0; i < writing_frames_count_; ++i )
+  {
+    remaining_bytes += write_msgs_[i].frame_length;
+  }
+  write_msgs_.erase( write_msgs_.begin() + writing_frames_count_, 
+    write_msgs_.end() );
+  set_write_queue_depth( write_msgs_.size(), remaining_bytes );
+
+  if ( is_connected_ && callback_ptr_ )
+  {
+    callback_ptr_->on_error( shared_from_this(), 
+      boost::asio::error::no_buffer_space );
+  }
+  disconnect( true );
+}
+
+void im_session::set_write_queue_depth( std::size_t length, 
+  std::size_t bytes )
+{
+  im_metrics::add( im_metrics::write_queue_messages, 
+    static_cast<std::int64_t>( length ) 
+      - static_cast<std::int64_t>( write_queue_length_.load( 
+        std::memory_order_relaxed ) ) );
+  im_metrics::add( im_metrics::write_queue_bytes, 
+    static_cast<std::int64_t>( bytes ) 
+      - static_cast<std::int64_t>( queued_bytes_ ) );
+
+  queued_bytes_ = bytes;
+  write_queue_length_.store( length, std::memory_order_relaxed );
+  write_queue_bytes_.store( bytes, std::memory_order_relaxed );
+}
+
+//----------------------------------------------------------------------
+// Private fields initialization.
+//----------------------------------------------------------------------
+
+std::size_t im_session::max_write_batch_bytes_ = 
+  im_session::default_max_write_batch_bytes;
+std::size_t im_session::max_write_batch_frames_ = 
+  im_session::default_max_write_batch_frames;
+int im_session::max_protocol_version_ = im_message::BINARY_PROTOCOL;
+std::atomic<std::uint64_t> im_session::writes_count_( 0 );
+std::atomic<std::uint64_t> im_session::written_frames_count_( 0 );
+std::size_t im_session::max_write_queue_messages_ = 
+  im_session::default_max_write_queue_messages;
+std::size_t im_session::max_write_queue_bytes_ = 
+  im_session::default_max_write_queue_bytes;
+int im_session::default_write_queue_policy_ = 
+  im_session::drop_oldest_broadcast;
+std::atomic<std::uint64_t> im_session::total_dropped_messages_count_( 0 );
+std::atomic<std::uint64_t> im_session::slow_consumer_disconnects_count_( 0 );
+std::atomic<std::uint64_t> im_session::oversized_frames_count_( 0 );
@@ -11,11 +11,17 @@
 #ifndef IM_SESSION_H
 #define IM_SESSION_H
 
+#include <atomic>
+#include <cstdint>
 #include <cstdlib>
+#include <deque>
 #include <memory>
+#include <string>
+#include <vector>
 #include <boost/asio.hpp>
-#include <boost/thread/mutex.hpp>
+#include <boost/asio/strand.hpp>
 #include "im_message.hpp"
+#include "im_message_audit.h"
 #include "im_message_subscriber.h"
 
 using boost::asio::ip::tcp;
@@ -39,6 +45,10 @@ public:
     const im_message& msg) = 0;
   virtual void on_error(im_session_ptr im_session_ptr, 
     boost::system::error_code ec) = 0;
+  // A frame the session's protocol can't carry was dropped instead of 
+  // sent (see im_session::get_oversized_frames_count()).
+  virtual void on_oversized_frame(im_session_ptr /*im_session_ptr*/, 
+    const im_message& /*msg*/) {}
 };
 
 typedef std::shared_ptr<im_session_handler_callback> im_session_handler_callback_ptr;
@@ -50,33 +60,189 @@ class im_session
     public im_message_subscriber
 {
 public:
+  enum { default_max_write_batch_bytes = 64 * 1024 };
+  enum { default_max_write_batch_frames = 64 };
+  enum { read_buffer_size = 8 * 1024 };
+  enum { default_max_write_queue_messages = 4096 };
+  enum { default_max_write_queue_bytes = 4 * 1024 * 1024 };
+
+  // What a session does with a message that doesn't fit in its write 
+  // queue, so a peer that stops reading can't make the process run out 
+  // of memory. Frames already being written are never taken back.
+  //
+  enum write_queue_policy
+  {
+    drop_newest,            // the message is dropped
+    drop_oldest_broadcast,  // queued broadcasts make room, oldest first
+    disconnect_consumer     // the peer is disconnected
+  };
+
   im_session(socket_ptr socket_ptr);
+  ~im_session();
   void start(im_session_handler_callback_ptr callback_ptr);
   void send_message(im_message_ptr im_message_ptr);
+  // Queues them all at once, in order (e.g. a mailbox being drained). 
+  // Called from the session's own handlers, they're queued right away, 
+  // ahead of anything other threads send meanwhile.
+  //
+  void send_messages(std::vector<im_message_ptr> im_messages);
   const bool is_connected();
   void disconnect( bool close_socket );
   void set_session_owner( const std::string session_owner );
-  std::string get_session_owner() const;
+  const std::string& get_session_owner() const;
+
+  // Protocol version asked for by the peer on its CONNECT_MSG, limited to 
+  // the highest one this process speaks.
+  //
+  int negotiate_protocol_version() const;
+
+  // Switches the wire format of the session. Must be called from one of 
+  // the session's own handlers (i.e. while processing a received message): 
+  // frames still in the receive buffer are decoded with the new version 
+  // right away, while writes switch after "handshake_msg_ptr" (if any) is 
+  // queued with the old one, so nothing published meanwhile gets between 
+  // the handshake answer and the switch.
+  //
+  void switch_protocol_version( int protocol_version, 
+    im_message_ptr handshake_msg_ptr = im_message_ptr() );
+
+  // Hands the frame being dispatched over to the caller, which may then 
+  // change it and send it on instead of building a copy; the next frame 
+  // is read into a new message. Only for the session's own handlers, while 
+  // processing a received message.
+  //
+  im_message_ptr take_received_message();
+
+  // Largest value the peer accepts with the protocol switched to. Like 
+  // switch_protocol_version(), only meant for the session's own handlers.
+  //
+  std::size_t get_max_value_length() const;
+
+  // Largest value the peer accepts with "protocol_version".
+  static std::size_t get_max_value_length( int protocol_version );
+
+  // Largest value other sessions' handlers may relay to the peer. Like the 
+  // owner, it's set for the negotiated protocol before the session can be 
+  // found (see im_session_manager::register_nickname()), so it already 
+  // holds while the acknowledge that switches to it is being queued.
+  //
+  void set_relay_max_value_length( std::size_t max_value_length );
+  std::size_t get_relay_max_value_length() const;
+
+  // Audit bookkeeping of the messages this session sends; also only for
+  // the session's own handlers.
+  //
+  im_message_audit::sender_state& get_audit_state();
+
+  // Rooms the session's owner is in (at most im_message::max_joined_rooms 
+  // of them); also only for the session's own handlers.
+  //
+  std::vector<std::string>& get_joined_rooms();
 
   // Inherited from im_message_subscriber.
   //
   void process_message( im_message_ptr im_message_ptr );
 
+  void set_write_queue_policy( int policy );
+
+  // Depth of the write queue and how many messages it dropped so far. May
+  // be asked from any thread.
+  //
+  std::size_t get_write_queue_length() const;
+  std::size_t get_write_queue_bytes() const;
+  std::uint64_t get_dropped_messages_count() const;
+
+  // Limits for how much of the write queue is gathered into a single 
+  // write. They apply to every session in the process.
+  //
+  static void set_write_batch_limits( std::size_t max_bytes, 
+    std::size_t max_frames );
+
+  // Totals for every session in the process, so the average number of 
+  // frames sent per write can be followed.
+  //
+  static std::uint64_t get_writes_count();
+  static std::uint64_t get_written_frames_count();
+
+  static void set_max_protocol_version( int protocol_version );
+
+  // Limits of every session's write queue, and the policy sessions start 
+  // with.
+  //
+  static void set_write_queue_limits( std::size_t max_messages, 
+    std::size_t max_bytes );
+  static void set_default_write_queue_policy( int policy );
+
+  // Totals for every session in the process.
+  //
+  static std::uint64_t get_total_dropped_messages_count();
+  static std::uint64_t get_slow_consumer_disconnects_count();
+  // Frames too big for the legacy protocol of the session they went to.
+  static std::uint64_t get_oversized_frames_count();
+
 private:
-  void do_read_type();
-  void do_read_length();
-  void do_read_value();
+  struct queued_message
+  {
+    im_message_ptr message_ptr;
+    int protocol_version;
+    std::size_t frame_length;
+    char binary_header[im_message::binary_header_length];
+  };
+
+  void do_read();
+  bool decode_frames();
+  bool decode_header( const char* header, std::size_t header_length );
+  void enqueue_message( im_message_ptr im_message_ptr );
+  bool make_room_in_write_queue( std::size_t frame_length );
+  void count_dropped_message();
+  void disconnect_slow_consumer();
+  void set_write_queue_depth( std::size_t length, std::size_t bytes );
   void do_write();
 
 private:
   socket_ptr socket_ptr_;
+
+  // Every read and write handler of the session runs through this strand, 
+  // so the io_service may be run by any number of threads while the 
+  // session state below is still only touched by one handler at a time.
+  //
+  boost::asio::strand<tcp::socket::executor_type> strand_;
   im_session_handler_callback_ptr callback_ptr_;
-  im_message read_msg_;
-  im_message_queue write_msgs_;
-  boost::mutex write_msgs_mutex_;
-  bool is_connected_;
-  boost::mutex is_connected_mutex_;
+  std::vector<char> read_buffer_;
+  std::size_t read_buffer_length_;
+  im_message_ptr read_msg_ptr_;
+  int read_protocol_version_;
+  int requested_protocol_version_;
+  std::deque<queued_message> write_msgs_;
+  int write_protocol_version_;
+  std::atomic<std::size_t> relay_max_value_length_;
+  std::uint32_t write_sequence_;
+  std::vector<boost::asio::const_buffer> write_buffers_;
+  std::size_t writing_frames_count_;
+  // Mirrors of the write queue depth, for other threads.
+  std::atomic<std::size_t> write_queue_length_;
+  std::atomic<std::size_t> write_queue_bytes_;
+  std::size_t queued_bytes_;
+  std::atomic<int> write_queue_policy_;
+  std::atomic<std::uint64_t> dropped_messages_count_;
+  // Set once the session was disconnected for not keeping up.
+  bool is_write_queue_closed_;
+  std::atomic<bool> is_connected_;
   std::string session_owner_;
+  im_message_audit::sender_state audit_state_;
+  std::vector<std::string> joined_rooms_;
+
+  static std::size_t max_write_batch_bytes_;
+  static std::size_t max_write_batch_frames_;
+  static int max_protocol_version_;
+  static std::atomic<std::uint64_t> writes_count_;
+  static std::atomic<std::uint64_t> written_frames_count_;
+  static std::size_t max_write_queue_messages_;
+  static std::size_t max_write_queue_bytes_;
+  static int default_write_queue_policy_;
+  static std::atomic<std::uint64_t> total_dropped_messages_count_;
+  static std::atomic<std::uint64_t> slow_consumer_disconnects_count_;
+  static std::atomic<std::uint64_t> oversized_frames_count_;
 };
 
 //----------------------------------------------------------------------
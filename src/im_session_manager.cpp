@@ -5,7 +5,9 @@
 // Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
 //
 
+#include <algorithm>
 #include <cstdlib>
+#include "im_metrics.h"
 #include "im_session_manager.h"
 #include "logger.h"
 
@@ -14,6 +16,9 @@
 //----------------------------------------------------------------------
 
 im_session_manager::im_session_manager()
+  : shard_router_ptr_( nullptr ),
+    shard_index_( 0 ),
+    mailbox_ptr_( nullptr )
 {
 
 }
@@ -25,18 +30,19 @@ im_session_manager::im_session_manager()
 void im_session_manager::start()
 {
   im_message_handler_.start( shared_from_this() );
+  add_metrics_gauges();
 }
 
-void im_session_manager::add_session( im_session_ptr im_session_ptr )
+void im_session_manager::set_shard( im_shard_router* shard_router_ptr, 
+  std::size_t shard_index )
 {
-  boost::unique_lock<boost::mutex> scoped_lock( sessions_list_mutex );
-  sessions_list.push_back( im_session_ptr );
+  shard_router_ptr_ = shard_router_ptr;
+  shard_index_ = shard_index;
 }
 
-void im_session_manager::remove_session( im_session_ptr im_session_ptr )
+void im_session_manager::set_mailbox( im_mailbox* mailbox_ptr )
 {
-  boost::unique_lock<boost::mutex> scoped_lock( sessions_list_mutex );
-  sessions_list.remove( im_session_ptr );
+  mailbox_ptr_ = mailbox_ptr;
 }
 
 //----------------------------------------------------------------------
@@ -61,121 +67,276 @@ void im_session_manager::on_error(im_session_ptr im_session_ptr,
     //<< "messages are not shown any more if it's a manual disconnect.\n";
   im_session_ptr->disconnect( false );
 
-  LOG_INFO( "Connection with user with nickname \"" 
-    + im_session_ptr->get_session_owner() + "\" was lost." );
+  LOG_INFO( "Connection with user with nickname \"", 
+    im_session_ptr->get_session_owner(), "\" was lost." );
+}
+
+void im_session_manager::on_oversized_frame(im_session_ptr im_session_ptr, 
+  const im_message& msg)
+{
+  LOG_ERROR( "A frame of type ", msg.type(), " with a value of ", 
+    msg.value_length(), " bytes was dropped instead of sent to user with "
+    "nickname \"", im_session_ptr->get_session_owner(), 
+    "\", whose protocol takes up to ", 
+    static_cast<std::size_t>( im_message::max_value_length ), " bytes." );
 }
 
 //----------------------------------------------------------------------
 
-void im_session_manager::on_connect_msg( im_session_ptr im_session_ptr, 
-  std::string nickname )
+void im_session_manager::on_connect_msg( 
+  const im_session_ptr& im_session_ptr, boost::string_view nickname_view )
 {
-  // First we validate if the provided nickname is already registered.
+  // Kept by the registry, so it's copied here.
+  const std::string nickname( nickname_view.to_string() );
+
+  // A session holds a single nickname for as long as it lasts; it's only 
+  // ever set here, while nothing else can find the session yet.
+  //
+  if ( !im_session_ptr->get_session_owner().empty() )
+  {
+    im_session_ptr->send_message( 
+      im_message::build_connect_rfsd_msg( 
+        get_already_logged_in_message( 
+          im_session_ptr->get_session_owner() ) ) );
+  }
+  // The nickname is the first field of MESSAGE_MSG values, so it can't 
+  // contain the separator. It's also bounded like destinataries, which 
+  // leaves room in any LIST page for the total, the next cursor and at 
+  // least one nickname.
+  //
+  else if ( nickname.empty() 
+    || ( nickname.length() > im_message::max_destinatary_length ) 
+    || ( nickname.find( '|' ) != std::string::npos ) )
+  {
+    im_session_ptr->send_message( 
+      im_message::build_connect_rfsd_msg( 
+        get_invalid_nickname_message( nickname ) ) );
+  }
+  // Checking and registering the nickname is a single step, otherwise two 
+  // sessions handled by different threads could both claim the same one.
   //
-  if ( is_nickname_already_registered( nickname ) )
+  else if ( !register_nickname( im_session_ptr, nickname ) )
   {
-    publish_message( nickname, im_session_ptr, 
+    // The refused session isn't subscribed to anything, so the answer 
+    // goes straight to it instead of through the nickname topic (which 
+    // belongs to the user already holding that nickname).
+    //
+    im_session_ptr->send_message( 
       im_message::build_connect_rfsd_msg( 
         get_nickname_already_connect_message( nickname ) ) );
   }
   else
   {
     //std::cout << "Registering new nickname...\n";
-    register_nickname( im_session_ptr, nickname );
     subscribe_session( im_session_ptr );
     //std::cout << "Sending acknowledge...\n";
-    publish_message( nickname, im_session_ptr, 
+    // The acknowledge tells the client which protocol was accepted, and is 
+    // the last frame sent with the one used so far.
+    //
+    int protocol_version = im_session_ptr->negotiate_protocol_version();
+    im_session_ptr->switch_protocol_version( protocol_version, 
       im_message::build_connect_ack_msg( 
-        get_connection_accepted_message() ) );
+        get_connection_accepted_message(), protocol_version ) );
+
+    // Whatever was kept while the user was away goes right after the 
+    // acknowledge, in a single hand over to the session. Both are queued 
+    // before this handler returns, so nothing relayed by other sessions 
+    // (which can find this one by now) gets ahead of them.
+    //
+    if ( mailbox_ptr_ != nullptr )
+    {
+      std::vector<im_message_ptr> stored_messages = 
+        mailbox_ptr_->log_in( nickname );
+      if ( !stored_messages.empty() )
+      {
+        LOG_INFO( stored_messages.size(), 
+          " stored messages delivered to user with nickname \"", nickname, 
+          "\"." );
+        im_session_ptr->send_messages( std::move( stored_messages ) );
+      }
+    }
     //std::cout << "Sending user logged in broadcast...\n";
-    publish_message( BROADCAST_TOPIC, im_session_ptr, 
+    publish_broadcast( im_session_ptr, 
       im_message::build_broadcast_msg( 
         get_logged_in_broadcast_message( nickname ) ) );
 
-    LOG_INFO( "User with nickname \"" + nickname + "\" has logged in." );
-
-    //std::cout << "sessions_list size is: " 
-      //<< get_sessions_list_size() << ".\n";
-    //std::cout << "nicknames_list size is: " 
-      //<< get_nicknames_list_size() << ".\n";
-    //std::cout << "nicknames_sessions_map size is: " 
-      //<< get_nicknames_sessions_map_size() << ".\n";
+    LOG_INFO( "User with nickname \"", nickname, "\" has logged in." );
   }
 }
 
-void im_session_manager::on_connect_ack_msg( im_session_ptr im_session_ptr, 
-  std::string ack_message )
+void im_session_manager::on_connect_ack_msg( 
+  const im_session_ptr& /*im_session_ptr*/, 
+  boost::string_view /*ack_message*/ )
 {
   // Handled by client.
 }
 
-void im_session_manager::on_connect_rfsd_msg( im_session_ptr im_session_ptr, 
-  std::string error_message )
+void im_session_manager::on_connect_rfsd_msg( 
+  const im_session_ptr& /*im_session_ptr*/, 
+  boost::string_view /*error_message*/ )
 {
   // Handled by client.
 }
 
-void im_session_manager::on_message_msg( im_session_ptr im_session_ptr, 
-  std::string destinatary_nickname, std::string message )
+void im_session_manager::on_message_msg( 
+  const im_session_ptr& im_session_ptr, 
+  boost::string_view destinatary_nickname, boost::string_view message )
 {
-  boost::unique_lock<boost::mutex> scoped_lock( nicknames_resources_mutex );
-
-  try 
-  { 
-    //std::cout << "Retrieving the destinatary session...\n";
-    auto destinatary_session = nicknames_sessions_map.at( destinatary_nickname );
-    //std::cout << "Destinatary session retrieved: " << destinatary_session << "\n";
-
-    //std::cout << "Sending message to destinatary...\n";
-    publish_message( destinatary_session->get_session_owner(), 
-      destinatary_session, im_message::build_message_msg_to_destinatary( 
-        im_session_ptr->get_session_owner(), message ) );
+  bool is_audited = im_message_audit::is_enabled();
+  std::chrono::steady_clock::time_point relay_start;
+  if ( is_audited )
+  {
+    relay_start = std::chrono::steady_clock::now();
+  }
 
-    //std::cout << "Sending message acknowledge to originator...\n";
-    publish_message( im_session_ptr->get_session_owner(), im_session_ptr, 
-      im_message::build_message_ack_msg( 
-        get_message_accepted_message() ) );
+  // Relayed, the value carries the sender's nickname instead of the 
+  // destinatary's, so it may no longer fit even the binary protocol; it's 
+  // refused rather than cut short.
+  //
+  std::size_t relayed_value_length = 
+    im_session_ptr->get_session_owner().length() + 1 + message.length();
+  if ( relayed_value_length > im_message::max_binary_value_length )
+  {
+    im_session_ptr->process_message( 
+      im_message::build_message_rfsd_msg( get_message_too_long_message( 
+        im_message::max_binary_value_length ) ) );
+    return;
+  }
 
-    LOG_INFO( "Message [" + message + "] sent from user \"" 
-      + im_session_ptr->get_session_owner() + "\" to user \"" 
-      + destinatary_session->get_session_owner() + "\"." );
+  if ( relay_to_online_user( im_session_ptr, destinatary_nickname, 
+    relayed_value_length, is_audited, relay_start ) )
+  {
+    return;
   }
-  catch (std::out_of_range e)
+
+  if ( mailbox_ptr_ == nullptr )
   {
     //std::cout << "Destinatary session not found! Sending message refused.\n";
-    publish_message( im_session_ptr->get_session_owner(), im_session_ptr, 
+    im_session_ptr->process_message( 
       im_message::build_message_rfsd_msg( 
-        get_destinatary_not_found_message( destinatary_nickname ) ) );
+        get_destinatary_not_found_message( 
+          destinatary_nickname.to_string() ) ) );
+    return;
+  }
+
+  // Offline, so the message waits in the mailbox; it's only acknowledged 
+  // once the mailbox has it on the disk. The user may have logged in since 
+  // the lookup above, though, in which case the mailbox refuses it and it 
+  // goes straight to the user after all (and, if it logged out again 
+  // meanwhile, back to the mailbox).
+  //
+  // The user may log back in with any protocol, so only what all of them 
+  // take is kept.
+  //
+  if ( ( relayed_value_length > im_message::max_value_length ) 
+    && mailbox_ptr_->is_known_user( destinatary_nickname ) )
+  {
+    im_session_ptr->process_message( 
+      im_message::build_message_rfsd_msg( get_message_too_long_message( 
+        im_message::max_value_length ) ) );
+    return;
+  }
+
+  std::string destinatary = destinatary_nickname.to_string();
+  std::string ack_message = get_message_stored_message( destinatary );
+  im_mailbox::store_result result = im_mailbox::recipient_online;
+  for ( int attempt = 0; 
+    ( attempt < 3 ) && ( result == im_mailbox::recipient_online ); 
+    ++attempt )
+  {
+    result = mailbox_ptr_->store_message( destinatary_nickname, 
+      im_session_ptr->get_session_owner(), message, 
+      [im_session_ptr, ack_message]()
+      {
+        im_session_ptr->process_message( 
+          im_message::build_message_ack_msg( ack_message ) );
+      } );
+
+    if ( ( result == im_mailbox::recipient_online ) 
+      && relay_to_online_user( im_session_ptr, destinatary_nickname, 
+        relayed_value_length, is_audited, relay_start ) )
+    {
+      return;
+    }
+  }
+
+  if ( result == im_mailbox::stored )
+  {
+    if ( is_audited )
+    {
+      audit_message( im_session_ptr, "user", destinatary, message, 
+        relay_start );
+    }
+    return;
   }
+
+  std::string error_message;
+  if ( result == im_mailbox::mailbox_full )
+  {
+    error_message = get_mailbox_full_message( destinatary );
+  }
+  else if ( result == im_mailbox::store_failed )
+  {
+    error_message = get_mailbox_failed_message( destinatary );
+  }
+  else
+  {
+    error_message = get_destinatary_not_found_message( destinatary );
+  }
+  im_session_ptr->process_message( 
+    im_message::build_message_rfsd_msg( error_message ) );
 }
 
-void im_session_manager::on_message_ack_msg( im_session_ptr im_session_ptr, 
-  std::string ack_message )
+void im_session_manager::on_message_ack_msg( 
+  const im_session_ptr& /*im_session_ptr*/, 
+  boost::string_view /*ack_message*/ )
 {
   // Handled by client.
 }
 
-void im_session_manager::on_message_rfsd_msg( im_session_ptr im_session_ptr, 
-  std::string error_message )
+void im_session_manager::on_message_rfsd_msg( 
+  const im_session_ptr& /*im_session_ptr*/, 
+  boost::string_view /*error_message*/ )
 {
   // Handled by client.
 }
 
-void im_session_manager::on_list_request_msg( im_session_ptr im_session_ptr )
+void im_session_manager::on_list_request_msg( 
+  const im_session_ptr& im_session_ptr, boost::string_view cursor, 
+  std::size_t page_size )
 {
-  boost::unique_lock<boost::mutex> scoped_lock( nicknames_resources_mutex );
   //std::cout << "List request received. Sending the list...\n";
+  auto nicknames_ptr = get_nicknames_snapshot();
+
+  if ( page_size == 0 )
+  {
+    publish_message( im_session_ptr->get_session_owner(), im_session_ptr, 
+      im_message::build_list_response_msg( *nicknames_ptr ) );
+    return;
+  }
+
+  // The cursor is the last nickname of the previous page (or empty, which 
+  // sorts before any nickname), so paging goes on from the right place 
+  // even if the list changed in between.
+  //
+  std::size_t first = std::upper_bound( nicknames_ptr->begin(), 
+    nicknames_ptr->end(), cursor ) - nicknames_ptr->begin();
+
   publish_message( im_session_ptr->get_session_owner(), im_session_ptr, 
-    im_message::build_list_response_msg( nicknames_list ) );
+    im_message::build_list_page_response_msg( *nicknames_ptr, first, 
+      std::min<std::size_t>( page_size, im_message::max_list_page_size ), 
+      im_session_ptr->get_max_value_length() ) );
 }
 
-void im_session_manager::on_list_response_msg( im_session_ptr im_session_ptr, 
-  std::vector<std::string> nicknames_list )
+void im_session_manager::on_list_response_msg( 
+  const im_session_ptr& /*im_session_ptr*/, 
+  boost::string_view /*nicknames_list*/ )
 {
   // Handled by client.
 }
 
-void im_session_manager::on_disconnect_msg( im_session_ptr im_session_ptr )
+void im_session_manager::on_disconnect_msg( 
+  const im_session_ptr& im_session_ptr )
 {
   //std::cout << "Received disconnect message.\n";
   unregister_session( im_session_ptr );
@@ -191,92 +352,460 @@ void im_session_manager::on_disconnect_msg( im_session_ptr im_session_ptr )
 
   unsubscribe_session( im_session_ptr );
 
-  LOG_INFO( "User with nickname \"" 
-    + im_session_ptr->get_session_owner() + "\" has logged out." );
+  LOG_INFO( "User with nickname \"", 
+    im_session_ptr->get_session_owner(), "\" has logged out." );
 }
 
-void im_session_manager::on_disconnect_ack_msg( im_session_ptr im_session_ptr, 
-  std::string ack_message )
+void im_session_manager::on_disconnect_ack_msg( 
+  const im_session_ptr& /*im_session_ptr*/, 
+  boost::string_view /*ack_message*/ )
 {
   // Handled by client.
 }
 
-void im_session_manager::on_broadcast_msg( im_session_ptr im_session_ptr, 
-  std::string broadcast_message )
+void im_session_manager::on_broadcast_msg( 
+  const im_session_ptr& /*im_session_ptr*/, 
+  boost::string_view /*broadcast_message*/ )
 {
   // Handled by client.
 }
 
-//----------------------------------------------------------------------
-// Private methods.
-//----------------------------------------------------------------------
+void im_session_manager::on_stats_request_msg( 
+  const im_session_ptr& im_session_ptr )
+{
+  // Answered straight to the session, so it works before logging in too.
+  im_session_ptr->process_message( 
+    im_message::build_stats_response_msg( im_metrics::get_snapshot_text(), 
+      im_session_ptr->get_max_value_length() ) );
+}
 
-bool im_session_manager::is_nickname_already_registered( std::string nickname )
+void im_session_manager::on_stats_response_msg( 
+  const im_session_ptr& /*im_session_ptr*/, 
+  boost::string_view /*stats*/ )
 {
-  boost::unique_lock<boost::mutex> scoped_lock( nicknames_resources_mutex );
-  
-  std::list<std::string>::iterator nickname_it = 
-    std::find( nicknames_list.begin(), nicknames_list.end(), nickname );
+  // Handled by client.
+}
 
-  if ( nickname_it != nicknames_list.end() )
+void im_session_manager::on_join_msg( 
+  const im_session_ptr& im_session_ptr, boost::string_view room_view )
+{
+  const std::string room( room_view.to_string() );
+  std::vector<std::string>& joined_rooms = im_session_ptr->get_joined_rooms();
+
+  // Like nicknames, room names are the first field of ROOM_MESSAGE_MSG 
+  // values, so they can't contain the separator.
+  //
+  if ( im_session_ptr->get_session_owner().empty() )
   {
-    return true;
+    im_session_ptr->process_message( 
+      im_message::build_join_rfsd_msg( get_not_logged_in_message() ) );
+  }
+  else if ( room.empty() || ( room.find( '|' ) != std::string::npos ) 
+    || ( room.length() > im_message::max_room_name_length ) )
+  {
+    im_session_ptr->process_message( 
+      im_message::build_join_rfsd_msg( get_invalid_room_message( room ) ) );
+  }
+  else if ( std::find( joined_rooms.begin(), joined_rooms.end(), room ) 
+    != joined_rooms.end() )
+  {
+    im_session_ptr->process_message( im_message::build_join_ack_msg( room ) );
+  }
+  else if ( joined_rooms.size() >= im_message::max_joined_rooms )
+  {
+    im_session_ptr->process_message( 
+      im_message::build_join_rfsd_msg( get_too_many_rooms_message() ) );
   }
   else
   {
-    return false;
+    subscribe( get_room_topic( room ), im_session_ptr );
+    joined_rooms.push_back( room );
+    im_session_ptr->process_message( im_message::build_join_ack_msg( room ) );
+
+    LOG_INFO( "User with nickname \"", im_session_ptr->get_session_owner(), 
+      "\" has joined room \"", room, "\"." );
+  }
+}
+
+void im_session_manager::on_join_ack_msg( 
+  const im_session_ptr& /*im_session_ptr*/, 
+  boost::string_view /*room*/ )
+{
+  // Handled by client.
+}
+
+void im_session_manager::on_join_rfsd_msg( 
+  const im_session_ptr& /*im_session_ptr*/, 
+  boost::string_view /*error_message*/ )
+{
+  // Handled by client.
+}
+
+void im_session_manager::on_leave_msg( 
+  const im_session_ptr& im_session_ptr, boost::string_view room )
+{
+  // Leaving a room one isn't in is acknowledged just the same.
+  //
+  std::vector<std::string>& joined_rooms = im_session_ptr->get_joined_rooms();
+  auto room_it = std::find( joined_rooms.begin(), joined_rooms.end(), room );
+  if ( room_it != joined_rooms.end() )
+  {
+    unsubscribe( get_room_topic( *room_it ), im_session_ptr );
+
+    LOG_INFO( "User with nickname \"", im_session_ptr->get_session_owner(), 
+      "\" has left room \"", *room_it, "\"." );
+
+    *room_it = std::move( joined_rooms.back() );
+    joined_rooms.pop_back();
+  }
+
+  im_session_ptr->process_message( 
+    im_message::build_leave_ack_msg( room.to_string() ) );
+}
+
+void im_session_manager::on_leave_ack_msg( 
+  const im_session_ptr& /*im_session_ptr*/, 
+  boost::string_view /*room*/ )
+{
+  // Handled by client.
+}
+
+void im_session_manager::on_room_message_msg( 
+  const im_session_ptr& im_session_ptr, boost::string_view room, 
+  boost::string_view message )
+{
+  bool is_audited = im_message_audit::is_enabled();
+  std::chrono::steady_clock::time_point relay_start;
+  if ( is_audited )
+  {
+    relay_start = std::chrono::steady_clock::now();
+  }
+
+  std::vector<std::string>& joined_rooms = im_session_ptr->get_joined_rooms();
+  auto room_it = std::find( joined_rooms.begin(), joined_rooms.end(), room );
+  if ( room_it == joined_rooms.end() )
+  {
+    im_session_ptr->process_message( 
+      im_message::build_message_rfsd_msg( 
+        get_not_in_room_message( room.to_string() ) ) );
+    return;
+  }
+
+  const std::string& originator = im_session_ptr->get_session_owner();
+  if ( room.length() + 1 + originator.length() + 1 + message.length() 
+    > im_message::max_binary_value_length )
+  {
+    im_session_ptr->process_message( 
+      im_message::build_message_rfsd_msg( get_message_too_long_message( 
+        im_message::max_binary_value_length ) ) );
+    return;
+  }
+
+  // The received frame, with the sender's nickname put in, is encoded 
+  // once and shared by the write queues of every member (on every shard). 
+  // Like on_message_msg(), only the readdressed frame is looked at after 
+  // it's taken.
+  //
+  const std::string room_topic = get_room_topic( *room_it );
+  im_message_ptr relayed_msg_ptr = im_session_ptr->take_received_message();
+  relayed_msg_ptr->readdress_room_message_msg( originator );
+
+  publish_message( room_topic, im_session_ptr, relayed_msg_ptr );
+  if ( shard_router_ptr_ != nullptr )
+  {
+    shard_router_ptr_->broadcast_message( shard_index_, room_topic, 
+      relayed_msg_ptr );
+  }
+
+  im_session_ptr->process_message( 
+    im_message::build_message_ack_msg( get_message_accepted_message() ) );
+
+  if ( is_audited )
+  {
+    // The body follows the originator's nickname.
+    boost::string_view body = relayed_msg_ptr->get_message_body();
+    body.remove_prefix( std::min( body.length(), originator.length() + 1 ) );
+    audit_message( im_session_ptr, "room", *room_it, body, relay_start );
   }
 }
 
-void im_session_manager::register_nickname( im_session_ptr session_ptr, 
+//----------------------------------------------------------------------
+
+void im_session_manager::on_shard_message( std::string topic, 
+  im_message_ptr im_message_ptr )
+{
+  publish_message( topic, nullptr, im_message_ptr );
+}
+
+//----------------------------------------------------------------------
+// Private methods.
+//----------------------------------------------------------------------
+
+bool im_session_manager::register_nickname( im_session_ptr session_ptr, 
   std::string nickname )
 {
-  //std::cout << "Adding the session to the sessions's list.\n";
-  add_session( session_ptr );
+  // With shards the nickname must be unique across all of them, so it is 
+  // claimed on the shared directory before the local registration.
+  //
+  // Relays to the session are checked against the protocol it's going to 
+  // switch to as soon as it can be found, from this shard or any other.
+  //
+  std::size_t max_value_length = im_session::get_max_value_length( 
+    session_ptr->negotiate_protocol_version() );
+  if ( ( shard_router_ptr_ != nullptr ) 
+    && !shard_router_ptr_->try_claim_nickname( nickname, shard_index_, 
+      max_value_length ) )
+  {
+    return false;
+  }
 
+  // The owner is set before the session can be found, since other 
+  // sessions' handlers read it (e.g. to audit what they relay) without 
+  // any lock. Sessions only get here without one (see on_connect_msg()), 
+  // so a refused session just goes back to having none.
+  //
   //std::cout << "Setting the session owner.\n";
   session_ptr->set_session_owner( nickname );
+  session_ptr->set_relay_max_value_length( max_value_length );
 
   //std::cout << "Register the session and nickname references.\n";
+  if ( !nickname_registry_.try_register( nickname, session_ptr ) )
   {
-    boost::unique_lock<boost::mutex> scoped_lock( nicknames_resources_mutex );
-    nicknames_list.push_back( nickname );
-    nicknames_sessions_map.insert( std::pair<std::string, im_session_ptr>( 
-      nickname, session_ptr ) );
+    session_ptr->set_session_owner( std::string() );
+    if ( shard_router_ptr_ != nullptr )
+    {
+      shard_router_ptr_->release_nickname( nickname, shard_index_ );
+    }
+    return false;
   }
+
+  return true;
 }
 
 void im_session_manager::unregister_session( im_session_ptr session_ptr )
 {
-  //std::cout << "Removing the session from the sessions's list.\n";
-  remove_session( session_ptr );
+  // Messages sent from now on wait in the mailbox. It's only told while 
+  // the user can still be found, so a sender told the user is online 
+  // finds it, and only by the session holding the nickname.
+  //
+  if ( ( mailbox_ptr_ != nullptr ) && ( nickname_registry_.find( 
+    session_ptr->get_session_owner() ) == session_ptr ) )
+  {
+    mailbox_ptr_->log_out( session_ptr->get_session_owner() );
+  }
 
   //std::cout << "Unregister the session and nickname references.\n";
+  // Sessions that were refused (or never sent a connect) own no nickname, 
+  // and a disconnect racing with an error must only unregister once.
+  //
+  if ( !nickname_registry_.unregister( session_ptr->get_session_owner(), 
+    session_ptr ) )
+  {
+    return;
+  }
+
+  message_audit_.settle( session_ptr->get_audit_state() );
+
+  if ( shard_router_ptr_ != nullptr )
   {
-    boost::unique_lock<boost::mutex> scoped_lock( nicknames_resources_mutex );
-    try
+    shard_router_ptr_->release_nickname( 
+      session_ptr->get_session_owner(), shard_index_ );
+  }
+
+  //std::cout << "Sending user logged out broadcast...\n";
+  publish_broadcast( session_ptr, 
+    im_message::build_broadcast_msg( 
+      get_logged_out_broadcast_message( 
+        session_ptr->get_session_owner() ) ) );
+}
+
+im_message_ptr im_session_manager::take_message_to_relay( 
+  const im_session_ptr& session_ptr )
+{
+  im_message_ptr relayed_msg_ptr = session_ptr->take_received_message();
+  relayed_msg_ptr->readdress_message_msg( session_ptr->get_session_owner() );
+  return relayed_msg_ptr;
+}
+
+bool im_session_manager::relay_to_online_user( 
+  const im_session_ptr& session_ptr, boost::string_view destinatary_nickname, 
+  std::size_t relayed_value_length, bool is_audited, 
+  std::chrono::steady_clock::time_point relay_start )
+{
+  // Both the lookup and the delivery are lock free: the registry lookup 
+  // reads an RCU directory, and the message goes straight to the sessions 
+  // (the only subscribers of their nickname topics) instead of through 
+  // the publisher's topics map.
+  //
+  // The received frame itself is what the destinatary gets, once its 
+  // nickname field is rewritten; since that changes what the views point 
+  // to, only the readdressed frame is looked at afterwards.
+  //
+  auto destinatary_session = nickname_registry_.find( destinatary_nickname );
+  if ( destinatary_session )
+  { 
+    // Refused rather than acknowledged and then dropped by the 
+    // destinatary's session.
+    //
+    std::size_t max_value_length = 
+      destinatary_session->get_relay_max_value_length();
+    if ( relayed_value_length > max_value_length )
     {
-      nicknames_list.remove( session_ptr->get_session_owner() );
-      nicknames_sessions_map.erase( session_ptr->get_session_owner() );
-
-      //std::cout << "Sending user logged out broadcast...\n";
-      publish_message( BROADCAST_TOPIC, session_ptr, 
-        im_message::build_broadcast_msg( 
-          get_logged_out_broadcast_message( 
-            session_ptr->get_session_owner() ) ) );
+      session_ptr->process_message( 
+        im_message::build_message_rfsd_msg( 
+          get_message_too_long_message( max_value_length ) ) );
+      return true;
     }
-    catch (std::out_of_range e)
+
+    //std::cout << "Sending message to destinatary...\n";
+    im_message_ptr relayed_msg_ptr = take_message_to_relay( session_ptr );
+    destinatary_session->process_message( relayed_msg_ptr );
+
+    //std::cout << "Sending message acknowledge to originator...\n";
+    session_ptr->process_message( 
+      im_message::build_message_ack_msg( 
+        get_message_accepted_message() ) );
+
+    if ( is_audited )
     {
-      std::cerr << "Error trying to unregister session and user.\n";
+      audit_message( session_ptr, "user", 
+        destinatary_session->get_session_owner(), 
+        relayed_msg_ptr->get_message_body(), relay_start );
     }
+    return true;
   }
 
-  //std::cout << "sessions_list size is: " 
-    //<< get_sessions_list_size() << ".\n";
-  //std::cout << "nicknames_list size is: " 
-    //<< get_nicknames_list_size() << ".\n";
-  //std::cout << "nicknames_sessions_map size is: " 
-    //<< get_nicknames_sessions_map_size() << ".\n";
+  // Not on this shard, but it may be online on another one.
+  //
+  std::size_t max_value_length = 0;
+  int owner_shard = ( shard_router_ptr_ != nullptr ) 
+    ? shard_router_ptr_->get_nickname_owner( 
+      destinatary_nickname.to_string(), max_value_length ) 
+    : im_shard_router::no_shard;
+
+  if ( ( owner_shard == im_shard_router::no_shard ) 
+    || ( static_cast<std::size_t>( owner_shard ) == shard_index_ ) )
+  {
+    return false;
+  }
+
+  if ( relayed_value_length > max_value_length )
+  {
+    session_ptr->process_message( 
+      im_message::build_message_rfsd_msg( 
+        get_message_too_long_message( max_value_length ) ) );
+    return true;
+  }
+
+  std::string destinatary_topic = destinatary_nickname.to_string();
+  im_message_ptr relayed_msg_ptr = take_message_to_relay( session_ptr );
+  shard_router_ptr_->deliver_message( shard_index_, owner_shard, 
+    destinatary_topic, relayed_msg_ptr );
+
+  session_ptr->process_message( 
+    im_message::build_message_ack_msg( 
+      get_message_accepted_message() ) );
+
+  if ( is_audited )
+  {
+    audit_message( session_ptr, "user", destinatary_topic, 
+      relayed_msg_ptr->get_message_body(), relay_start );
+  }
+  return true;
+}
+
+void im_session_manager::add_metrics_gauges()
+{
+  // With shards every manager adds its own, which im_metrics sums up. The 
+  // gauges don't keep the manager alive.
+  //
+  std::weak_ptr<im_session_manager> weak_self( shared_from_this() );
+
+  im_metrics::add_gauge( "nicknames_online", 
+    [weak_self]() -> std::int64_t
+    {
+      auto self = weak_self.lock();
+      return self ? self->nickname_registry_.size() : 0;
+    } );
+  im_metrics::add_gauge( "audit_logged_messages", 
+    [weak_self]() -> std::int64_t
+    {
+      auto self = weak_self.lock();
+      return self ? self->message_audit_.get_statistics().audited : 0;
+    } );
+  im_metrics::add_gauge( "audit_sampled_out_messages", 
+    [weak_self]() -> std::int64_t
+    {
+      auto self = weak_self.lock();
+      return self ? self->message_audit_.get_statistics().sampled_out : 0;
+    } );
+  im_metrics::add_gauge( "audit_rate_limited_messages", 
+    [weak_self]() -> std::int64_t
+    {
+      auto self = weak_self.lock();
+      return self ? self->message_audit_.get_statistics().rate_limited : 0;
+    } );
+}
+
+void im_session_manager::audit_message( const im_session_ptr& session_ptr, 
+  const char* destinatary_kind, boost::string_view destinatary_name, 
+  boost::string_view message, 
+  std::chrono::steady_clock::time_point relay_start )
+{
+  im_message_audit::sender_state& audit_state = 
+    session_ptr->get_audit_state();
+  if ( !message_audit_.admit( audit_state ) )
+  {
+    return;
+  }
+
+  long long relay_microseconds = 
+    std::chrono::duration_cast<std::chrono::microseconds>( 
+      std::chrono::steady_clock::now() - relay_start ).count();
+
+  // Only says how much was left out when something was.
+  std::string left_out_note;
+  std::uint64_t left_out_count = message_audit_.settle( audit_state );
+  if ( left_out_count > 0 )
+  {
+    left_out_note = " (" + std::to_string( left_out_count ) 
+      + " earlier messages from this user not logged)";
+  }
+
+  if ( im_message_audit::get_mode() == im_message_audit::audit_full )
+  {
+    LOG_INFO( "Message [", message, "] sent from user \"", 
+      session_ptr->get_session_owner(), "\" to ", destinatary_kind, " \"", 
+      destinatary_name, "\" in ", relay_microseconds, " us", 
+      left_out_note, "." );
+  }
+  else
+  {
+    LOG_INFO( "Message of ", message.length(), " bytes sent from user \"", 
+      session_ptr->get_session_owner(), "\" to ", destinatary_kind, " \"", 
+      destinatary_name, "\" in ", relay_microseconds, " us", 
+      left_out_note, "." );
+  }
+
+  if ( message_audit_.is_report_due() )
+  {
+    im_message_audit::statistics audit_statistics = 
+      message_audit_.get_statistics();
+    LOG_INFO( "Audit totals: ", audit_statistics.audited, 
+      " messages logged, ", audit_statistics.sampled_out, 
+      " left out by sampling and ", audit_statistics.rate_limited, 
+      " by rate limiting." );
+  }
+}
+
+im_nickname_registry::nicknames_snapshot_ptr 
+  im_session_manager::get_nicknames_snapshot()
+{
+  if ( shard_router_ptr_ != nullptr )
+  {
+    return shard_router_ptr_->get_nicknames_snapshot();
+  }
+  return nickname_registry_.get_nicknames_snapshot();
 }
 
 void im_session_manager::subscribe_session( im_session_ptr session_ptr )
@@ -291,6 +820,24 @@ void im_session_manager::unsubscribe_session( im_session_ptr session_ptr )
   //std::cout << "Unsubscribe to nickname and broadcast.\n";
   unsubscribe( session_ptr->get_session_owner(), session_ptr );
   unsubscribe( BROADCAST_TOPIC, session_ptr );
+
+  std::vector<std::string>& joined_rooms = session_ptr->get_joined_rooms();
+  for ( auto& room : joined_rooms )
+  {
+    unsubscribe( get_room_topic( room ), session_ptr );
+  }
+  joined_rooms.clear();
+}
+
+void im_session_manager::publish_broadcast( im_session_ptr session_ptr, 
+  im_message_ptr im_message_ptr )
+{
+  publish_message( BROADCAST_TOPIC, session_ptr, im_message_ptr );
+  if ( shard_router_ptr_ != nullptr )
+  {
+    shard_router_ptr_->broadcast_message( shard_index_, BROADCAST_TOPIC, 
+      im_message_ptr );
+  }
 }
 
 std::string im_session_manager::get_nickname_already_connect_message( 
@@ -300,6 +847,15 @@ std::string im_session_manager::get_nickname_already_connect_message(
     "\" is already connected." );
 }
 
+std::string im_session_manager::get_invalid_nickname_message( 
+  std::string nickname )
+{
+  return std::string( "The nickname \"" ).append( nickname ).append( 
+    "\" is not valid: it must not be empty, contain \"|\" nor be longer "
+    "than " ).append( std::to_string( im_message::max_destinatary_length ) )
+    .append( " characters." );
+}
+
 std::string im_session_manager::get_connection_accepted_message()
 {
   return "Connection successfully established.";
@@ -336,21 +892,64 @@ std::string im_session_manager::get_logged_out_broadcast_message(
     "\" has logged out." );
 }
 
-int im_session_manager::get_sessions_list_size()
+std::string im_session_manager::get_already_logged_in_message( 
+  std::string nickname )
+{
+  return std::string( "You are already connected with nickname \"" ).append( 
+    nickname ).append( "\"." );
+}
+
+std::string im_session_manager::get_not_logged_in_message()
 {
-  boost::unique_lock<boost::mutex> scoped_lock( sessions_list_mutex );
-  return sessions_list.size();
+  return "You must be connected with a nickname first.";
 }
 
-int im_session_manager::get_nicknames_list_size()
+std::string im_session_manager::get_invalid_room_message( std::string room )
 {
-  boost::unique_lock<boost::mutex> scoped_lock( nicknames_resources_mutex );
-  return nicknames_list.size();
+  return std::string( "The room name \"" ).append( room ).append( 
+    "\" is not valid: it must not be empty, contain \"|\" nor be longer "
+    "than " ).append( std::to_string( im_message::max_room_name_length ) )
+    .append( " characters." );
 }
 
-int im_session_manager::get_nicknames_sessions_map_size()
+std::string im_session_manager::get_too_many_rooms_message()
 {
-  boost::unique_lock<boost::mutex> scoped_lock( nicknames_resources_mutex );
-  return nicknames_sessions_map.size();
+  return std::string( "No more than " ).append( 
+    std::to_string( im_message::max_joined_rooms ) ).append( 
+    " rooms can be joined at once." );
 }
 
+std::string im_session_manager::get_not_in_room_message( std::string room )
+{
+  return std::string( "You are not in room \"" ).append( room ).append( 
+    "\"." );
+}
+
+std::string im_session_manager::get_message_stored_message( 
+  std::string nickname )
+{
+  return std::string( "User \"" ).append( nickname ).append( 
+    "\" is offline; the message will be delivered on the next login." );
+}
+
+std::string im_session_manager::get_mailbox_full_message( 
+  std::string nickname )
+{
+  return std::string( "The mailbox of user \"" ).append( nickname ).append( 
+    "\" is full." );
+}
+
+std::string im_session_manager::get_mailbox_failed_message( 
+  std::string nickname )
+{
+  return std::string( "The message to user \"" ).append( nickname ).append( 
+    "\" couldn't be stored." );
+}
+
+std::string im_session_manager::get_message_too_long_message( 
+  std::size_t max_value_length )
+{
+  return std::string( "The message is too long: relayed, with the nicknames "
+    "(and room) put in, it may be up to " ).append( std::to_string( 
+    max_value_length ) ).append( " bytes." );
+}
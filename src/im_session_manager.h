@@ -8,12 +8,17 @@
 #ifndef IM_SESSION_MANAGER_H
 #define IM_SESSION_MANAGER_H
 
+#include <chrono>
 #include <cstdlib>
 #include <list>
 #include <boost/thread/mutex.hpp>
 #include "im_session.h"
+#include "im_message_audit.h"
+#include "im_mailbox.h"
 #include "im_message_handler.h"
 #include "im_message_publisher.h"
+#include "im_nickname_registry.h"
+#include "im_shard_router.h"
 
 //----------------------------------------------------------------------
 
@@ -27,8 +32,10 @@ public:
   im_session_manager();
 
   void start();
-  void add_session( im_session_ptr im_session_ptr );
-  void remove_session( im_session_ptr im_session_ptr );
+  void set_shard( im_shard_router* shard_router_ptr, std::size_t shard_index );
+  // Messages to known users that are offline are kept there instead of 
+  // refused. Shared by every shard.
+  void set_mailbox( im_mailbox* mailbox_ptr );
   //void send_broadcast( im_message_ptr im_message_ptr );
   //void send_broadcast( im_message_ptr im_message_ptr, 
     //std::string skip_nickname );
@@ -39,59 +46,112 @@ public:
     const im_message& msg);
   void on_error(im_session_ptr im_session_ptr, 
     boost::system::error_code ec);
+  void on_oversized_frame(im_session_ptr im_session_ptr, 
+    const im_message& msg);
 
   // Inherited from im_message_handler_callback.
   //
-  void on_connect_msg( im_session_ptr im_session_ptr, 
-    std::string nickname );
-  void on_connect_ack_msg( im_session_ptr im_session_ptr, 
-    std::string ack_message );
-  void on_connect_rfsd_msg( im_session_ptr im_session_ptr, 
-    std::string error_message );
-  void on_message_msg( im_session_ptr im_session_ptr, 
-    std::string destinatary_nickname, std::string message );
-  void on_message_ack_msg( im_session_ptr im_session_ptr, 
-    std::string ack_message );
-  void on_message_rfsd_msg( im_session_ptr im_session_ptr, 
-    std::string error_message );
-  void on_list_request_msg( im_session_ptr im_session_ptr );
-  void on_list_response_msg( im_session_ptr im_session_ptr, 
-    std::vector<std::string> nicknames_list );
-  void on_disconnect_msg( im_session_ptr im_session_ptr );
-  void on_disconnect_ack_msg( im_session_ptr im_session_ptr, 
-    std::string ack_message );
-  void on_broadcast_msg( im_session_ptr im_session_ptr, 
-    std::string broadcast_message );
+  void on_connect_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view nickname );
+  void on_connect_ack_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view ack_message );
+  void on_connect_rfsd_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view error_message );
+  void on_message_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view destinatary_nickname, boost::string_view message );
+  void on_message_ack_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view ack_message );
+  void on_message_rfsd_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view error_message );
+  void on_list_request_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view cursor, std::size_t page_size );
+  void on_list_response_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view nicknames_list );
+  void on_disconnect_msg( const im_session_ptr& im_session_ptr );
+  void on_disconnect_ack_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view ack_message );
+  void on_broadcast_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view broadcast_message );
+  void on_stats_request_msg( const im_session_ptr& im_session_ptr );
+  void on_stats_response_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view stats );
+  void on_join_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view room );
+  void on_join_ack_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view room );
+  void on_join_rfsd_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view error_message );
+  void on_leave_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view room );
+  void on_leave_ack_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view room );
+  void on_room_message_msg( const im_session_ptr& im_session_ptr, 
+    boost::string_view room, boost::string_view message );
+
+  // Called by the shard router, on this shard's thread, for messages 
+  // published by other shards.
+  //
+  void on_shard_message( std::string topic, im_message_ptr im_message_ptr );
 
 private:
-  bool is_nickname_already_registered( std::string nickname );
-  void register_nickname( im_session_ptr session_ptr, std::string nickname );
+  bool register_nickname( im_session_ptr session_ptr, std::string nickname );
   void unregister_session( im_session_ptr session_ptr );
+  im_nickname_registry::nicknames_snapshot_ptr get_nicknames_snapshot();
   void subscribe_session( im_session_ptr session_ptr );
   void unsubscribe_session( im_session_ptr session_ptr );
+  void publish_broadcast( im_session_ptr session_ptr, 
+    im_message_ptr im_message_ptr );
+  // The MESSAGE_MSG being processed, readdressed to go out from its 
+  // sender.
+  im_message_ptr take_message_to_relay( const im_session_ptr& session_ptr );
+  // Relays the MESSAGE_MSG being processed if its destinatary is online 
+  // on any shard, or refuses it if the relayed value doesn't fit the 
+  // destinatary's protocol; false (with the message untouched) if it 
+  // isn't online.
+  bool relay_to_online_user( const im_session_ptr& session_ptr, 
+    boost::string_view destinatary_nickname, 
+    std::size_t relayed_value_length, bool is_audited, 
+    std::chrono::steady_clock::time_point relay_start );
+  // Reports this manager's numbers through im_metrics.
+  void add_metrics_gauges();
+  // "destinatary_kind" is "user" or "room".
+  void audit_message( const im_session_ptr& session_ptr, 
+    const char* destinatary_kind, boost::string_view destinatary_name, 
+    boost::string_view message, 
+    std::chrono::steady_clock::time_point relay_start );
 
   std::string get_nickname_already_connect_message( std::string nickname );
+  std::string get_invalid_nickname_message( std::string nickname );
   std::string get_connection_accepted_message();
   std::string get_destinatary_not_found_message( std::string nickname );
   std::string get_message_accepted_message();
   std::string get_disconnection_accepted_message();
   std::string get_logged_in_broadcast_message( std::string nickname );
   std::string get_logged_out_broadcast_message( std::string nickname );
-
-  int get_sessions_list_size();
-  int get_nicknames_list_size();
-  int get_nicknames_sessions_map_size();
-  int get_sessions_nicknames_map_size();
+  std::string get_already_logged_in_message( std::string nickname );
+  std::string get_not_logged_in_message();
+  std::string get_invalid_room_message( std::string room );
+  std::string get_too_many_rooms_message();
+  std::string get_not_in_room_message( std::string room );
+  std::string get_message_stored_message( std::string nickname );
+  std::string get_mailbox_full_message( std::string nickname );
+  std::string get_mailbox_failed_message( std::string nickname );
+  std::string get_message_too_long_message( std::size_t max_value_length );
 
 private:
-  boost::mutex sessions_list_mutex;
-  std::list<im_session_ptr> sessions_list;
-
-  boost::mutex nicknames_resources_mutex;
-  std::list<std::string> nicknames_list;
-  std::map<std::string, im_session_ptr> nicknames_sessions_map;
+  im_nickname_registry nickname_registry_;
 
   im_message_handler im_message_handler_;
+  im_message_audit message_audit_;
+
+  // Only set when running as one shard of a shard-per-core server.
+  //
+  im_shard_router* shard_router_ptr_;
+  std::size_t shard_index_;
+
+  // Only set when offline users get their messages later.
+  //
+  im_mailbox* mailbox_ptr_;
 };
 
 //----------------------------------------------------------------------
@@ -0,0 +1,265 @@
+//
+// im_shard_router.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include "im_metrics.h"
+#include "im_shard_router.h"
+#include "im_session_manager.h"
+
+//----------------------------------------------------------------------
+// Constructor
+//----------------------------------------------------------------------
+
+im_shard_router::im_shard_router( std::size_t shards_count )
+  : shards_count_( shards_count ),
+  directory_version_( 0 ),
+  snapshot_version_( 0 )
+{
+  for ( std::size_t i = 0; i < shards_count_; ++i )
+  {
+    shards_.emplace_back( new shard_context() );
+    shards_.back()->io_service_ptr = nullptr;
+    shards_.back()->drain_scheduled = false;
+  }
+
+  for ( std::size_t i = 0; i < shards_count_ * shards_count_; ++i )
+  {
+    links_.emplace_back( new shard_link() );
+  }
+}
+
+//----------------------------------------------------------------------
+// Public methods.
+//----------------------------------------------------------------------
+
+void im_shard_router::add_shard( std::size_t shard_index,
+  boost::asio::io_service& io_service,
+  std::shared_ptr<im_session_manager> im_session_manager_ptr )
+{
+  shards_.at( shard_index )->io_service_ptr = &io_service;
+  shards_.at( shard_index )->im_session_manager_ptr = im_session_manager_ptr;
+}
+
+std::size_t im_shard_router::get_shards_count() const
+{
+  return shards_count_;
+}
+
+//----------------------------------------------------------------------
+
+bool im_shard_router::try_claim_nickname( std::string nickname,
+  std::size_t shard_index, std::size_t max_value_length )
+{
+  nickname_owner owner;
+  owner.shard_index = shard_index;
+  owner.max_value_length = max_value_length;
+
+  directory_stripe& stripe = get_stripe( nickname );
+  im_metered_lock<boost::mutex> scoped_lock( stripe.mutex );
+  if ( !stripe.owners.insert(
+    std::pair<std::string, nickname_owner>( nickname, owner ) ).second )
+  {
+    return false;
+  }
+  ++directory_version_;
+  return true;
+}
+
+void im_shard_router::release_nickname( std::string nickname,
+  std::size_t shard_index )
+{
+  directory_stripe& stripe = get_stripe( nickname );
+  im_metered_lock<boost::mutex> scoped_lock( stripe.mutex );
+  auto owner_it = stripe.owners.find( nickname );
+  if ( ( owner_it != stripe.owners.end() )
+    && ( owner_it->second.shard_index == shard_index ) )
+  {
+    stripe.owners.erase( owner_it );
+    ++directory_version_;
+  }
+}
+
+int im_shard_router::get_nickname_owner( std::string nickname,
+  std::size_t& max_value_length )
+{
+  directory_stripe& stripe = get_stripe( nickname );
+  im_metered_lock<boost::mutex> scoped_lock( stripe.mutex );
+  auto owner_it = stripe.owners.find( nickname );
+  if ( owner_it == stripe.owners.end() )
+  {
+    return no_shard;
+  }
+  max_value_length = owner_it->second.max_value_length;
+  return static_cast<int>( owner_it->second.shard_index );
+}
+
+im_shard_router::nicknames_snapshot_ptr 
+  im_shard_router::get_nicknames_snapshot()
+{
+  std::uint64_t snapshot_version = directory_version_;
+  {
+    im_metered_lock<boost::mutex> scoped_lock( snapshot_mutex_ );
+    if ( nicknames_snapshot_ptr_ && ( snapshot_version_ == snapshot_version ) )
+    {
+      return nicknames_snapshot_ptr_;
+    }
+  }
+
+  auto snapshot_ptr = std::make_shared<nicknames_snapshot>();
+  for ( auto& stripe : directory_ )
+  {
+    im_metered_lock<boost::mutex> scoped_lock( stripe.mutex );
+    for ( auto& owner : stripe.owners )
+    {
+      snapshot_ptr->push_back( owner.first );
+    }
+  }
+  // Same order as the LIST of a server without shards.
+  std::sort( snapshot_ptr->begin(), snapshot_ptr->end() );
+
+  // Only cached if no stripe changed while it was being read.
+  //
+  if ( directory_version_ == snapshot_version )
+  {
+    im_metered_lock<boost::mutex> scoped_lock( snapshot_mutex_ );
+    nicknames_snapshot_ptr_ = snapshot_ptr;
+    snapshot_version_ = snapshot_version;
+  }
+  return snapshot_ptr;
+}
+
+//----------------------------------------------------------------------
+
+void im_shard_router::deliver_message( std::size_t from_shard,
+  std::size_t to_shard, std::string topic, im_message_ptr im_message_ptr )
+{
+  shard_envelope envelope;
+  envelope.topic = topic;
+  envelope.message_ptr = im_message_ptr;
+  enqueue( from_shard, to_shard, envelope );
+}
+
+void im_shard_router::broadcast_message( std::size_t from_shard,
+  std::string topic, im_message_ptr im_message_ptr )
+{
+  for ( std::size_t to_shard = 0; to_shard < shards_count_; ++to_shard )
+  {
+    if ( to_shard != from_shard )
+    {
+      deliver_message( from_shard, to_shard, topic, im_message_ptr );
+    }
+  }
+}
+
+//----------------------------------------------------------------------
+// Private methods.
+//----------------------------------------------------------------------
+
+im_shard_router::shard_link& im_shard_router::get_link(
+  std::size_t from_shard, std::size_t to_shard )
+{
+  return *links_.at( from_shard * shards_count_ + to_shard );
+}
+
+im_shard_router::directory_stripe& im_shard_router::get_stripe(
+  const std::string& nickname )
+{
+  return directory_[
+    std::hash<std::string>()( nickname ) % directory_stripes_count ];
+}
+
+void im_shard_router::enqueue( std::size_t from_shard, std::size_t to_shard,
+  shard_envelope envelope )
+{
+  shard_link& link = get_link( from_shard, to_shard );
+
+  // Keep the ordering between shards: once something is waiting on the
+  // overflow, everything else waits behind it.
+  //
+  // Rather than polling the full queue, the retry waits for the consumer, 
+  // whose drain (scheduled below, after the flag is set) asks for it.
+  //
+  if ( !flush_overflow( from_shard, to_shard ) || !link.queue.push( envelope ) )
+  {
+    bool retry_scheduled = !link.overflow.empty();
+    link.overflow.push_back( envelope );
+    if ( !retry_scheduled )
+    {
+      link.retry_wanted = true;
+    }
+  }
+
+  schedule_drain( to_shard );
+}
+
+bool im_shard_router::flush_overflow( std::size_t from_shard,
+  std::size_t to_shard )
+{
+  shard_link& link = get_link( from_shard, to_shard );
+  while ( !link.overflow.empty() )
+  {
+    if ( !link.queue.push( link.overflow.front() ) )
+    {
+      return false;
+    }
+    link.overflow.pop_front();
+  }
+  return true;
+}
+
+void im_shard_router::retry_overflow( std::size_t from_shard,
+  std::size_t to_shard )
+{
+  shard_link& link = get_link( from_shard, to_shard );
+  std::deque<shard_envelope> pending;
+  pending.swap( link.overflow );
+  for ( auto& pending_envelope : pending )
+  {
+    enqueue( from_shard, to_shard, pending_envelope );
+  }
+}
+
+void im_shard_router::schedule_drain( std::size_t to_shard )
+{
+  shard_context& shard = *shards_.at( to_shard );
+  if ( !shard.drain_scheduled.exchange( true ) )
+  {
+    shard.io_service_ptr->post( [this, to_shard]() { drain( to_shard ); } );
+  }
+}
+
+void im_shard_router::drain( std::size_t to_shard )
+{
+  shard_context& shard = *shards_.at( to_shard );
+
+  // Cleared before reading, so anything pushed from now on schedules
+  // another drain instead of being left behind.
+  //
+  shard.drain_scheduled = false;
+
+  shard_envelope envelope;
+  for ( std::size_t from_shard = 0; from_shard < shards_count_; ++from_shard )
+  {
+    shard_link& link = get_link( from_shard, to_shard );
+    while ( link.queue.pop( envelope ) )
+    {
+      shard.im_session_manager_ptr->on_shard_message( envelope.topic,
+        envelope.message_ptr );
+    }
+
+    if ( link.retry_wanted.exchange( false ) )
+    {
+      shards_.at( from_shard )->io_service_ptr->post(
+        [this, from_shard, to_shard]()
+        {
+          retry_overflow( from_shard, to_shard );
+        });
+    }
+  }
+}
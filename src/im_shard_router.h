@@ -0,0 +1,139 @@
+//
+// im_shard_router.h
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#ifndef IM_SHARD_ROUTER_H
+#define IM_SHARD_ROUTER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/thread/mutex.hpp>
+#include "im_message.hpp"
+
+//----------------------------------------------------------------------
+
+class im_session_manager;
+
+//----------------------------------------------------------------------
+
+// Links the shards of a shard-per-core server. Every shard runs its own
+// io_service on a single thread and owns the sessions it accepted; this
+// class tells which shard owns each nickname and hands messages over from
+// one shard to another through one single-producer/single-consumer queue
+// per (source, destination) pair, so routing never takes a global lock.
+//
+// LIST is served from a sorted snapshot of the directory, like a server
+// without shards does (see im_nickname_registry), rebuilt only the first
+// time it's asked for after a nickname was claimed or released.
+//
+class im_shard_router
+{
+public:
+  typedef std::vector<std::string> nicknames_snapshot;
+  typedef std::shared_ptr<const nicknames_snapshot> nicknames_snapshot_ptr;
+
+  enum { queue_capacity = 256 };
+  enum { directory_stripes_count = 64 };
+  enum { no_shard = -1 };
+
+  im_shard_router( std::size_t shards_count );
+
+  void add_shard( std::size_t shard_index,
+    boost::asio::io_service& io_service,
+    std::shared_ptr<im_session_manager> im_session_manager_ptr );
+  std::size_t get_shards_count() const;
+
+  // Nickname directory, shared by all shards. Along with its shard, every 
+  // nickname keeps the largest value its session may be relayed (see 
+  // im_session::get_relay_max_value_length()).
+  //
+  bool try_claim_nickname( std::string nickname, std::size_t shard_index,
+    std::size_t max_value_length );
+  void release_nickname( std::string nickname, std::size_t shard_index );
+  int get_nickname_owner( std::string nickname,
+    std::size_t& max_value_length );
+  nicknames_snapshot_ptr get_nicknames_snapshot();
+
+  // Must be called from the thread running the source shard.
+  //
+  void deliver_message( std::size_t from_shard, std::size_t to_shard,
+    std::string topic, im_message_ptr im_message_ptr );
+  void broadcast_message( std::size_t from_shard, std::string topic,
+    im_message_ptr im_message_ptr );
+
+private:
+  struct shard_envelope
+  {
+    std::string topic;
+    im_message_ptr message_ptr;
+  };
+
+  typedef boost::lockfree::spsc_queue<shard_envelope> shard_queue;
+
+  struct shard_link
+  {
+    shard_link() : queue( queue_capacity ), retry_wanted( false ) {}
+
+    shard_queue queue;
+    // Envelopes that didn't fit in the queue. Only touched by the
+    // producer shard, so it needs no locking either.
+    std::deque<shard_envelope> overflow;
+    // Set by the producer when the queue was full; the consumer's next
+    // drain makes room and tells the producer to flush the overflow.
+    std::atomic<bool> retry_wanted;
+  };
+
+  struct shard_context
+  {
+    boost::asio::io_service* io_service_ptr;
+    std::shared_ptr<im_session_manager> im_session_manager_ptr;
+    std::atomic<bool> drain_scheduled;
+  };
+
+  struct nickname_owner
+  {
+    std::size_t shard_index;
+    std::size_t max_value_length;
+  };
+
+  struct directory_stripe
+  {
+    boost::mutex mutex;
+    std::unordered_map<std::string, nickname_owner> owners;
+  };
+
+  shard_link& get_link( std::size_t from_shard, std::size_t to_shard );
+  directory_stripe& get_stripe( const std::string& nickname );
+  void enqueue( std::size_t from_shard, std::size_t to_shard,
+    shard_envelope envelope );
+  bool flush_overflow( std::size_t from_shard, std::size_t to_shard );
+  void retry_overflow( std::size_t from_shard, std::size_t to_shard );
+  void schedule_drain( std::size_t to_shard );
+  void drain( std::size_t to_shard );
+
+private:
+  std::size_t shards_count_;
+  std::vector<std::unique_ptr<shard_context>> shards_;
+  std::vector<std::unique_ptr<shard_link>> links_;
+  directory_stripe directory_[directory_stripes_count];
+  // Bumped whenever any stripe changes, which makes the snapshot stale.
+  std::atomic<std::uint64_t> directory_version_;
+  boost::mutex snapshot_mutex_;
+  std::uint64_t snapshot_version_;
+  nicknames_snapshot_ptr nicknames_snapshot_ptr_;
+};
+
+//----------------------------------------------------------------------
+
+#endif // IM_SHARD_ROUTER_H
@@ -0,0 +1,181 @@
+//
+// loadgen_main.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <boost/asio.hpp>
+#include "im_load_generator.h"
+#include "im_message.hpp"
+
+using boost::asio::ip::tcp;
+
+//----------------------------------------------------------------------
+
+static void print_usage()
+{
+  std::cerr << "Usage: im_loadgen <host> <port> [options]\n"
+    << "Options:\n"
+    << "  --clients <count>        simulated clients, each with its own "
+    << "connection\n"
+    << "                           (default: 1000)\n"
+    << "  --threads <count>        number of threads running the io_service "
+    << "(default: one\n"
+    << "                           per core)\n"
+    << "  --duration <seconds>     how long to measure, once every client is "
+    << "logged in\n"
+    << "                           (default: 10)\n"
+    << "  --connect-rate <rate>    logins per second, also when logging "
+    << "dropped clients\n"
+    << "                           back in (default: 1000)\n"
+    << "  --message-rate <rate>    direct messages per second (default: "
+    << "1000)\n"
+    << "  --message-bytes <bytes>  size of each message body (default: 64)\n"
+    << "  --list-rate <rate>       nicknames list requests per second "
+    << "(default: 10)\n"
+    << "  --churn-rate <rate>      logouts (each followed by a login) per "
+    << "second, every\n"
+    << "                           one broadcast to all clients (default: "
+    << "10)\n"
+    << "  --storm-interval <seconds>   seconds between reconnect storms "
+    << "(default: 0, none)\n"
+    << "  --storm-fraction <fraction>  fraction of the clients dropping "
+    << "their connections\n"
+    << "                               in each storm (default: 0.1)\n"
+    << "  --protocol <version>     1: legacy text headers, 2: binary headers "
+    << "(default: 2)\n"
+    << "  --nickname-prefix <text> nicknames are <text><index> (default: "
+    << "load)\n"
+    << "  --report-interval <seconds>  seconds between progress lines "
+    << "(default: 1, 0: none)\n";
+}
+
+//----------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+  try
+  {
+    if (argc < 3)
+    {
+      print_usage();
+      return 1;
+    }
+
+    im_load_generator::options options;
+
+    for (int i = 3; i < argc; ++i)
+    {
+      if ( ( std::strcmp(argv[i], "--clients") == 0 ) && ( i + 1 < argc ) )
+      {
+        options.clients_count = std::atoi(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--threads") == 0 )
+        && ( i + 1 < argc ) )
+      {
+        options.threads_count = std::atoi(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--duration") == 0 )
+        && ( i + 1 < argc ) )
+      {
+        options.duration_seconds = std::atof(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--connect-rate") == 0 )
+        && ( i + 1 < argc ) )
+      {
+        options.connect_rate = std::atof(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--message-rate") == 0 )
+        && ( i + 1 < argc ) )
+      {
+        options.message_rate = std::atof(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--message-bytes") == 0 )
+        && ( i + 1 < argc ) )
+      {
+        options.message_bytes = std::atoi(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--list-rate") == 0 )
+        && ( i + 1 < argc ) )
+      {
+        options.list_rate = std::atof(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--churn-rate") == 0 )
+        && ( i + 1 < argc ) )
+      {
+        options.churn_rate = std::atof(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--storm-interval") == 0 )
+        && ( i + 1 < argc ) )
+      {
+        options.storm_interval_seconds = std::atof(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--storm-fraction") == 0 )
+        && ( i + 1 < argc ) )
+      {
+        options.storm_fraction = std::atof(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--protocol") == 0 )
+        && ( i + 1 < argc ) )
+      {
+        options.protocol_version = std::atoi(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--nickname-prefix") == 0 )
+        && ( i + 1 < argc ) )
+      {
+        options.nickname_prefix = argv[++i];
+      }
+      else if ( ( std::strcmp(argv[i], "--report-interval") == 0 )
+        && ( i + 1 < argc ) )
+      {
+        options.report_interval_seconds = std::atof(argv[++i]);
+      }
+      else
+      {
+        print_usage();
+        return 1;
+      }
+    }
+
+    if (options.threads_count < 1)
+    {
+      options.threads_count = 1;
+    }
+
+    // Legacy peers take bodies up to "max_message_length" only.
+    //
+    std::size_t max_message_bytes =
+      ( options.protocol_version == im_message::LEGACY_PROTOCOL )
+      ? im_message::max_message_length
+      : im_message::max_binary_value_length - im_message::max_destinatary_length
+        - im_message::default_separator_length;
+
+    if ( ( options.clients_count < 2 ) || ( options.connect_rate <= 0 )
+      || ( options.protocol_version < im_message::LEGACY_PROTOCOL )
+      || ( options.protocol_version > im_message::BINARY_PROTOCOL )
+      || ( options.message_bytes > max_message_bytes ) )
+    {
+      print_usage();
+      return 1;
+    }
+
+    boost::asio::io_service io_service;
+
+    tcp::resolver resolver(io_service);
+    auto endpoint_iterator = resolver.resolve({ argv[1], argv[2] });
+
+    im_load_generator im_load_generator(io_service, endpoint_iterator,
+      options);
+    im_load_generator.run();
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+  }
+
+  return 0;
+}
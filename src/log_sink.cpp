@@ -0,0 +1,419 @@
+//
+// log_sink.cpp
+// ~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "log_sink.h"
+
+//----------------------------------------------------------------------
+// LogSinkOptions
+//----------------------------------------------------------------------
+
+LogSinkOptions::LogSinkOptions() :
+  sinkType( BUFFERED_SINK ),
+  syncMode( SYNC_NONE ),
+  segmentBytes( 64 * 1024 * 1024 ),
+  keptSegments( 8 ),
+  commitBytes( 256 * 1024 ),
+  commitIntervalMilliseconds( 50 ),
+  syncIntervalMilliseconds( 1000 )
+{
+}
+
+//----------------------------------------------------------------------
+// LogSink
+//----------------------------------------------------------------------
+
+std::unique_ptr<LogSink> LogSink::create( const std::string& fileName,
+  const LogSinkOptions& options )
+{
+  std::unique_ptr<LogSink> sink;
+  if ( options.sinkType == LogSinkOptions::MAPPED_SINK )
+  {
+    sink.reset( new LogMappedSink( fileName, options ) );
+  }
+  else
+  {
+    sink.reset( new LogBufferedSink( fileName, options ) );
+  }
+
+  // Backends can't be called from the base constructor.
+  if ( !sink->openSegment( sink->m_segmentBytes ) )
+  {
+    throw std::runtime_error("Unable to initialize the Logger!");
+  }
+  return sink;
+}
+
+LogSink::LogSink( const std::string& fileName,
+  const LogSinkOptions& options ) :
+  m_fileName( fileName ),
+  m_options( options ),
+  m_fileDescriptor( -1 ),
+  m_segmentBytes( 0 ),
+  m_uncommittedBytes( 0 ),
+  m_errorReported( false )
+{
+}
+
+LogSink::~LogSink()
+{
+}
+
+void LogSink::append( const char* data, std::size_t length )
+{
+  write( data, length );
+  m_segmentBytes += length;
+  m_uncommittedBytes += length;
+}
+
+void LogSink::commit( bool durable )
+{
+  commitSegment( durable );
+  m_uncommittedBytes = 0;
+}
+
+bool LogSink::rotateIfFull()
+{
+  if ( ( m_options.segmentBytes == 0 )
+    || ( m_segmentBytes < m_options.segmentBytes ) )
+  {
+    return false;
+  }
+
+  commit( m_options.syncMode != LogSinkOptions::SYNC_NONE );
+  closeSegment();
+  shiftSegments();
+
+  // Nothing else can be done about a segment that can't be opened;
+  // records are lost until the next rotation is attempted.
+  //
+  m_segmentBytes = 0;
+  if ( !openSegment( m_segmentBytes ) )
+  {
+    reportError( "open" );
+  }
+  return true;
+}
+
+std::size_t LogSink::getUncommittedBytes() const
+{
+  return m_uncommittedBytes;
+}
+
+void LogSink::reportError( const char* operation )
+{
+  // Only once, or a full disk would flood the console.
+  if ( m_errorReported )
+  {
+    return;
+  }
+
+  m_errorReported = true;
+  std::cerr << "Log sink -> " << operation << " of \"" << m_fileName
+    << "\" failed: " << std::strerror( errno ) << "\n";
+}
+
+void LogSink::shiftSegments()
+{
+  // "server.log" becomes "server.log.1", "server.log.1" becomes
+  // "server.log.2" and so on; the oldest one is removed.
+  //
+  if ( m_options.keptSegments == 0 )
+  {
+    std::remove( m_fileName.c_str() );
+    return;
+  }
+
+  std::remove( ( m_fileName + "."
+    + std::to_string( m_options.keptSegments ) ).c_str() );
+  for ( std::size_t i = m_options.keptSegments - 1; i > 0; --i )
+  {
+    std::rename( ( m_fileName + "." + std::to_string( i ) ).c_str(),
+      ( m_fileName + "." + std::to_string( i + 1 ) ).c_str() );
+  }
+  std::rename( m_fileName.c_str(), ( m_fileName + ".1" ).c_str() );
+}
+
+//----------------------------------------------------------------------
+// LogBufferedSink
+//----------------------------------------------------------------------
+
+LogBufferedSink::LogBufferedSink( const std::string& fileName,
+  const LogSinkOptions& options ) :
+  LogSink( fileName, options ),
+  m_buffer( nullptr ),
+  m_bufferCapacity( 0 ),
+  m_bufferedBytes( 0 )
+{
+  // Whole pages, large enough for a full group commit.
+  m_bufferCapacity = ( ( options.commitBytes + buffer_alignment - 1 )
+    / buffer_alignment ) * buffer_alignment;
+  if ( m_bufferCapacity < 16 * buffer_alignment )
+  {
+    m_bufferCapacity = 16 * buffer_alignment;
+  }
+
+  void* buffer = nullptr;
+  if ( posix_memalign( &buffer, buffer_alignment, m_bufferCapacity ) != 0 )
+  {
+    throw std::bad_alloc();
+  }
+  m_buffer = static_cast<char*>( buffer );
+}
+
+LogBufferedSink::~LogBufferedSink()
+{
+  closeSegment();
+  std::free( m_buffer );
+}
+
+bool LogBufferedSink::openSegment( std::uint64_t& fileBytes )
+{
+  m_fileDescriptor = ::open( m_fileName.c_str(),
+    O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+  struct stat fileStatus;
+  if ( ( m_fileDescriptor < 0 ) || ( ::fstat( m_fileDescriptor,
+    &fileStatus ) != 0 ) )
+  {
+    return false;
+  }
+
+  fileBytes = fileStatus.st_size;
+  return true;
+}
+
+void LogBufferedSink::closeSegment()
+{
+  if ( m_fileDescriptor < 0 )
+  {
+    return;
+  }
+
+  writeOut( m_buffer, m_bufferedBytes );
+  m_bufferedBytes = 0;
+  ::close( m_fileDescriptor );
+  m_fileDescriptor = -1;
+}
+
+void LogBufferedSink::write( const char* data, std::size_t length )
+{
+  if ( m_bufferedBytes + length > m_bufferCapacity )
+  {
+    writeOut( m_buffer, m_bufferedBytes );
+    m_bufferedBytes = 0;
+  }
+
+  if ( length >= m_bufferCapacity )
+  {
+    writeOut( data, length );
+    return;
+  }
+
+  std::memcpy( m_buffer + m_bufferedBytes, data, length );
+  m_bufferedBytes += length;
+}
+
+void LogBufferedSink::commitSegment( bool durable )
+{
+  writeOut( m_buffer, m_bufferedBytes );
+  m_bufferedBytes = 0;
+
+  if ( durable && ( m_fileDescriptor >= 0 )
+    && ( ::fdatasync( m_fileDescriptor ) != 0 ) )
+  {
+    reportError( "fdatasync" );
+  }
+}
+
+void LogBufferedSink::writeOut( const char* data, std::size_t length )
+{
+  if ( m_fileDescriptor < 0 )
+  {
+    return;
+  }
+
+  while ( length > 0 )
+  {
+    ssize_t writtenBytes = ::write( m_fileDescriptor, data, length );
+    if ( writtenBytes < 0 )
+    {
+      if ( errno == EINTR )
+      {
+        continue;
+      }
+      reportError( "write" );
+      return;
+    }
+
+    data += writtenBytes;
+    length -= writtenBytes;
+  }
+}
+
+//----------------------------------------------------------------------
+// LogMappedSink
+//----------------------------------------------------------------------
+
+LogMappedSink::LogMappedSink( const std::string& fileName,
+  const LogSinkOptions& options ) :
+  LogSink( fileName, options ),
+  m_fileBytes( 0 ),
+  m_windowStart( 0 ),
+  m_window( nullptr ),
+  m_windowLength( 0 ),
+  m_syncedBytes( 0 )
+{
+}
+
+LogMappedSink::~LogMappedSink()
+{
+  closeSegment();
+}
+
+bool LogMappedSink::openSegment( std::uint64_t& fileBytes )
+{
+  m_fileDescriptor = ::open( m_fileName.c_str(),
+    O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+  struct stat fileStatus;
+  if ( ( m_fileDescriptor < 0 ) || ( ::fstat( m_fileDescriptor,
+    &fileStatus ) != 0 ) )
+  {
+    return false;
+  }
+
+  // The first window is only mapped once there's something to write.
+  m_fileBytes = fileStatus.st_size;
+  m_syncedBytes = m_fileBytes;
+  fileBytes = m_fileBytes;
+  return true;
+}
+
+void LogMappedSink::closeSegment()
+{
+  if ( m_fileDescriptor < 0 )
+  {
+    return;
+  }
+
+  unmapWindow();
+  ::close( m_fileDescriptor );
+  m_fileDescriptor = -1;
+}
+
+void LogMappedSink::write( const char* data, std::size_t length )
+{
+  while ( length > 0 )
+  {
+    if ( ( m_window == nullptr )
+      || ( m_fileBytes == m_windowStart + m_windowLength ) )
+    {
+      unmapWindow();
+      if ( !mapWindow() )
+      {
+        return;
+      }
+    }
+
+    std::size_t copiedBytes = m_windowStart + m_windowLength - m_fileBytes;
+    if ( copiedBytes > length )
+    {
+      copiedBytes = length;
+    }
+    std::memcpy( m_window + ( m_fileBytes - m_windowStart ), data,
+      copiedBytes );
+    m_fileBytes += copiedBytes;
+    data += copiedBytes;
+    length -= copiedBytes;
+  }
+}
+
+void LogMappedSink::commitSegment( bool durable )
+{
+  // The mapping is shared, so what was copied is already in the page
+  // cache; committing only matters for durability.
+  //
+  if ( !durable || ( m_fileDescriptor < 0 ) )
+  {
+    return;
+  }
+
+  if ( m_syncedBytes < m_windowStart )
+  {
+    // Part of it was in windows that are already unmapped.
+    if ( ::fdatasync( m_fileDescriptor ) != 0 )
+    {
+      reportError( "fdatasync" );
+    }
+  }
+  else if ( m_window != nullptr )
+  {
+    // msync() wants a page aligned start.
+    std::uint64_t pageSize = ::sysconf( _SC_PAGESIZE );
+    std::uint64_t syncStart = m_syncedBytes & ~( pageSize - 1 );
+    if ( ::msync( m_window + ( syncStart - m_windowStart ),
+      m_fileBytes - syncStart, MS_SYNC ) != 0 )
+    {
+      reportError( "msync" );
+    }
+  }
+  m_syncedBytes = m_fileBytes;
+}
+
+bool LogMappedSink::mapWindow()
+{
+  // Mappings start at a page boundary, which may be before the end of
+  // the file.
+  //
+  std::uint64_t pageSize = ::sysconf( _SC_PAGESIZE );
+  m_windowStart = m_fileBytes & ~( pageSize - 1 );
+  m_windowLength = window_bytes;
+
+  if ( ::ftruncate( m_fileDescriptor, m_windowStart + m_windowLength ) != 0 )
+  {
+    reportError( "ftruncate" );
+    return false;
+  }
+
+  void* window = ::mmap( nullptr, m_windowLength, PROT_READ | PROT_WRITE,
+    MAP_SHARED, m_fileDescriptor, m_windowStart );
+  if ( window == MAP_FAILED )
+  {
+    reportError( "mmap" );
+    ::ftruncate( m_fileDescriptor, m_fileBytes );
+    return false;
+  }
+
+  m_window = static_cast<char*>( window );
+  return true;
+}
+
+void LogMappedSink::unmapWindow()
+{
+  if ( m_window == nullptr )
+  {
+    return;
+  }
+
+  ::munmap( m_window, m_windowLength );
+  m_window = nullptr;
+
+  // Drops whatever the window didn't use.
+  if ( ::ftruncate( m_fileDescriptor, m_fileBytes ) != 0 )
+  {
+    reportError( "ftruncate" );
+  }
+}
@@ -0,0 +1,166 @@
+//
+// log_sink.h
+// ~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#ifndef IM_LOG_SINK_H
+#define IM_LOG_SINK_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+//----------------------------------------------------------------------
+// LogSinkOptions
+//----------------------------------------------------------------------
+
+struct LogSinkOptions
+{
+  enum SinkType {
+    BUFFERED_SINK,  // write(2) from a large aligned buffer
+    MAPPED_SINK     // copy into a memory-mapped window of the file
+  };
+
+  // When committed bytes are also forced to the disk.
+  //
+  enum SyncMode {
+    SYNC_NONE,      // left to the OS
+    SYNC_PERIODIC,  // at most every "syncIntervalMilliseconds"
+    SYNC_ON_ERROR   // as soon as an ERROR record was written
+  };
+
+  LogSinkOptions();
+
+  int sinkType;
+  int syncMode;
+  // A segment reaching this size is rotated out; 0 never rotates.
+  std::uint64_t segmentBytes;
+  // How many rotated segments ("server.log.1" being the newest) are kept.
+  std::size_t keptSegments;
+  // Group commit: appended bytes are handed to the OS once this many are
+  // pending, or once the oldest of them waited this long.
+  std::size_t commitBytes;
+  unsigned int commitIntervalMilliseconds;
+  unsigned int syncIntervalMilliseconds;
+};
+
+//----------------------------------------------------------------------
+// LogSink
+//----------------------------------------------------------------------
+
+// Where the log worker writes to: the active segment file plus its rotated
+// predecessors. Only ever used by the log worker thread.
+//
+class LogSink
+{
+  public:
+    static std::unique_ptr<LogSink> create( const std::string& fileName,
+      const LogSinkOptions& options );
+
+    virtual ~LogSink();
+
+    // Bytes may stay buffered until the next commit.
+    void append( const char* data, std::size_t length );
+    // Hands everything appended so far to the OS and, when "durable", waits
+    // for it to reach the disk.
+    void commit( bool durable );
+    // Starts a new segment if the current one is full. True if it did.
+    bool rotateIfFull();
+
+    std::size_t getUncommittedBytes() const;
+
+  protected:
+    LogSink( const std::string& fileName, const LogSinkOptions& options );
+
+    // Implemented by the backends. "openSegment" sets "fileBytes" to the
+    // size of the segment file it opened.
+    //
+    virtual bool openSegment( std::uint64_t& fileBytes ) = 0;
+    virtual void closeSegment() = 0;
+    virtual void write( const char* data, std::size_t length ) = 0;
+    virtual void commitSegment( bool durable ) = 0;
+
+    void reportError( const char* operation );
+
+  protected:
+    const std::string m_fileName;
+    const LogSinkOptions m_options;
+    int m_fileDescriptor;
+
+  private:
+    void shiftSegments();
+
+  private:
+    std::uint64_t m_segmentBytes;
+    std::size_t m_uncommittedBytes;
+    bool m_errorReported;
+};
+
+//----------------------------------------------------------------------
+// LogBufferedSink
+//----------------------------------------------------------------------
+
+class LogBufferedSink : public LogSink
+{
+  public:
+    enum { buffer_alignment = 4096 };
+
+    LogBufferedSink( const std::string& fileName,
+      const LogSinkOptions& options );
+    virtual ~LogBufferedSink();
+
+  protected:
+    virtual bool openSegment( std::uint64_t& fileBytes );
+    virtual void closeSegment();
+    virtual void write( const char* data, std::size_t length );
+    virtual void commitSegment( bool durable );
+
+  private:
+    void writeOut( const char* data, std::size_t length );
+
+  private:
+    char* m_buffer;
+    std::size_t m_bufferCapacity;
+    std::size_t m_bufferedBytes;
+};
+
+//----------------------------------------------------------------------
+// LogMappedSink
+//----------------------------------------------------------------------
+
+// Appending is a memcpy into a shared mapping of the segment, which the
+// kernel writes back on its own. The file is extended a whole window at a
+// time and trimmed back to its contents when the window is unmapped, so a
+// server that's killed leaves at most a window of zeros at its end.
+//
+class LogMappedSink : public LogSink
+{
+  public:
+    enum { window_bytes = 8 * 1024 * 1024 };
+
+    LogMappedSink( const std::string& fileName,
+      const LogSinkOptions& options );
+    virtual ~LogMappedSink();
+
+  protected:
+    virtual bool openSegment( std::uint64_t& fileBytes );
+    virtual void closeSegment();
+    virtual void write( const char* data, std::size_t length );
+    virtual void commitSegment( bool durable );
+
+  private:
+    bool mapWindow();
+    void unmapWindow();
+
+  private:
+    std::uint64_t m_fileBytes;
+    std::uint64_t m_windowStart;
+    char* m_window;
+    std::size_t m_windowLength;
+    // Start of what wasn't msync'ed yet.
+    std::uint64_t m_syncedBytes;
+};
+
+#endif // IM_LOG_SINK_H
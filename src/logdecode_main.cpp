@@ -0,0 +1,300 @@
+//
+// logdecode_main.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "logger.h"
+
+//----------------------------------------------------------------------
+
+// Turns a server log written with "--log-format binary" back into the
+// text the server would have written. A log file may hold several
+// streams (one per server run or segment), as well as text lines written
+// by runs in text mode, which are copied as they are.
+//
+class log_decoder
+{
+public:
+  log_decoder(const std::string& input, std::ostream& output)
+    : input_(input),
+      output_(output),
+      position_(0),
+      corrupted_count_(0),
+      has_typed_arguments_(true),
+      formatted_second_(-1)
+  {
+  }
+
+  void run()
+  {
+    while (position_ < input_.size())
+    {
+      std::size_t stream_position = find_magic(position_);
+      output_.write(input_.data() + position_, stream_position - position_);
+      position_ = stream_position;
+      if (position_ == input_.size())
+      {
+        break;
+      }
+
+      decode_stream();
+    }
+  }
+
+  std::size_t get_corrupted_count() const
+  {
+    return corrupted_count_;
+  }
+
+private:
+  std::size_t find_magic(std::size_t from) const
+  {
+    std::size_t found = input_.find(std::string(LogBinaryFormat::magic,
+      sizeof(LogBinaryFormat::magic)), from);
+    return (found == std::string::npos) ? input_.size() : found;
+  }
+
+  bool read_integer(std::size_t bytes_count, std::uint64_t& value)
+  {
+    if (input_.size() - position_ < bytes_count)
+    {
+      return false;
+    }
+
+    value = 0;
+    for (std::size_t i = 0; i < bytes_count; ++i)
+    {
+      value |= static_cast<std::uint64_t>(
+        static_cast<unsigned char>(input_[position_ + i])) << (8 * i);
+    }
+    position_ += bytes_count;
+    return true;
+  }
+
+  bool read_bytes(std::size_t bytes_count, std::string& value)
+  {
+    if (input_.size() - position_ < bytes_count)
+    {
+      return false;
+    }
+
+    value.assign(input_, position_, bytes_count);
+    position_ += bytes_count;
+    return true;
+  }
+
+  void decode_stream()
+  {
+    std::uint64_t version = 0;
+    position_ += sizeof(LogBinaryFormat::magic);
+    if (!read_integer(4, version) || ((version != LogBinaryFormat::version)
+      && (version != LogBinaryFormat::text_message_version)))
+    {
+      skip_corrupted();
+      return;
+    }
+    has_typed_arguments_ = (version == LogBinaryFormat::version);
+
+    // Call sites are only valid within the stream defining them.
+    call_sites_files_.clear();
+    call_sites_.clear();
+
+    while (position_ < input_.size())
+    {
+      if (input_.compare(position_, sizeof(LogBinaryFormat::magic),
+        LogBinaryFormat::magic, sizeof(LogBinaryFormat::magic)) == 0)
+      {
+        return;
+      }
+
+      if ((input_[position_] == 0) && is_padding())
+      {
+        return;
+      }
+
+      std::uint64_t kind = 0;
+      read_integer(1, kind);
+      bool decoded = false;
+      if (kind == LogBinaryFormat::call_site_record)
+      {
+        decoded = decode_call_site();
+      }
+      else if (kind == LogBinaryFormat::entry_record)
+      {
+        decoded = decode_entry();
+      }
+
+      if (!decoded)
+      {
+        skip_corrupted();
+        return;
+      }
+    }
+  }
+
+  bool decode_call_site()
+  {
+    std::uint64_t id = 0, level = 0, line = 0, file_length = 0;
+    std::string file;
+    if (!read_integer(4, id) || !read_integer(1, level)
+      || !read_integer(4, line) || !read_integer(2, file_length)
+      || !read_bytes(file_length, file) || (id >= Logger::max_call_sites))
+    {
+      return false;
+    }
+
+    if (id >= call_sites_.size())
+    {
+      call_sites_.resize(id + 1);
+      call_sites_files_.resize(id + 1);
+    }
+    call_sites_files_[id] = file;
+    call_sites_[id].logLevel = static_cast<int>(level);
+    call_sites_[id].line = static_cast<int>(line);
+    call_sites_[id].file = nullptr;
+    return true;
+  }
+
+  bool decode_entry()
+  {
+    std::uint64_t id = 0, level = 0, ticks = 0, message_length = 0;
+    if (!read_integer(4, id) || !read_integer(1, level)
+      || !read_integer(8, ticks) || !read_integer(4, message_length)
+      || !read_bytes(message_length, message_)
+      || (id >= call_sites_.size()) || call_sites_files_[id].empty())
+    {
+      return false;
+    }
+
+    // Files are kept apart, so growing the vectors never leaves a call
+    // site pointing to a moved string.
+    LogCallSite call_site = call_sites_[id];
+    call_site.file = call_sites_files_[id].c_str();
+
+    std::time_t seconds = std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::nanoseconds(ticks)).count();
+    if (seconds != formatted_second_)
+    {
+      formatted_date_time_ = Logger::formatDateTime(seconds);
+      formatted_second_ = seconds;
+    }
+
+    // Older streams hold the text itself.
+    if (has_typed_arguments_)
+    {
+      arguments_text_.clear();
+      if (!LogBinaryFormat::appendArgumentsText(arguments_text_,
+        message_.data(), message_.length()))
+      {
+        return false;
+      }
+      message_.swap(arguments_text_);
+    }
+
+    line_.clear();
+    Logger::appendTextLine(line_, formatted_date_time_,
+      static_cast<int>(level), call_site, message_.data(), message_.length());
+    output_.write(line_.data(), line_.length());
+    return true;
+  }
+
+  bool is_padding()
+  {
+    // A memory-mapped segment whose server was killed ends in zeros, up
+    // to the end of the file or the stream written by the next run.
+    //
+    std::size_t end_position = find_magic(position_);
+    for (std::size_t i = position_; i < end_position; ++i)
+    {
+      if (input_[i] != 0)
+      {
+        return false;
+      }
+    }
+
+    position_ = end_position;
+    return true;
+  }
+
+  void skip_corrupted()
+  {
+    // Resume at the next stream; whatever is left of this one can't be
+    // trusted anymore.
+    //
+    ++corrupted_count_;
+    position_ = find_magic(position_);
+  }
+
+private:
+  const std::string& input_;
+  std::ostream& output_;
+  std::size_t position_;
+  std::size_t corrupted_count_;
+  bool has_typed_arguments_;
+  std::vector<LogCallSite> call_sites_;
+  std::vector<std::string> call_sites_files_;
+  std::string message_;
+  std::string arguments_text_;
+  std::string line_;
+  std::time_t formatted_second_;
+  std::string formatted_date_time_;
+};
+
+//----------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+  try
+  {
+    if (argc < 2)
+    {
+      std::cerr << "Usage: im_logdecode <log file> [<log file> ...]\n"
+        << "Rotated segments are decoded in the order given, like this: "
+        << "\"im_logdecode server.log.2 server.log.1 server.log\".\n";
+      return 1;
+    }
+
+    std::size_t corrupted_count = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+      std::ifstream input_stream(argv[i], std::ios_base::binary);
+      if (!input_stream.good())
+      {
+        std::cerr << "Unable to open \"" << argv[i] << "\".\n";
+        return 1;
+      }
+
+      std::string input((std::istreambuf_iterator<char>(input_stream)),
+        std::istreambuf_iterator<char>());
+
+      log_decoder decoder(input, std::cout);
+      decoder.run();
+      corrupted_count += decoder.get_corrupted_count();
+    }
+    std::cout.flush();
+
+    if (corrupted_count > 0)
+    {
+      std::cerr << corrupted_count
+        << " corrupted or truncated stream(s) skipped.\n";
+      return 2;
+    }
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
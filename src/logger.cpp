@@ -5,56 +5,195 @@
 // Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
 //
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <stdexcept>
-#include <boost/date_time.hpp>
-#include <boost/date_time/local_time/local_time.hpp>
 #include <iostream>
-#include <locale>
-#include <sstream>
 #include "logger.h"
 
 using namespace std;
 
 //----------------------------------------------------------------------
-// LogWorker
+// LogRing
 //----------------------------------------------------------------------
 
-const char* const LogWorker::m_logFileName = "server.log";
+LogRing::LogRing( std::size_t capacity ) :
+  m_records( capacity ),
+  m_mask( capacity - 1 ),
+  m_enqueuePosition( 0 ),
+  m_dequeuePosition( 0 )
+{
+  if ( ( capacity < 2 ) || ( ( capacity & ( capacity - 1 ) ) != 0 ) )
+  {
+    throw std::invalid_argument("Log ring capacity must be a power of two!");
+  }
+
+  for ( std::size_t i = 0; i < capacity; ++i )
+  {
+    m_records[i].sequence.store( i, std::memory_order_relaxed );
+  }
+}
+
+bool LogRing::empty() const
+{
+  std::size_t position = m_dequeuePosition.load( std::memory_order_relaxed );
+  return m_records[position & m_mask].sequence.load(
+    std::memory_order_acquire ) != position + 1;
+}
+
+std::size_t LogRing::size() const
+{
+  std::size_t dequeuePosition =
+    m_dequeuePosition.load( std::memory_order_relaxed );
+  std::size_t enqueuePosition =
+    m_enqueuePosition.load( std::memory_order_relaxed );
+  return ( enqueuePosition > dequeuePosition )
+    ? enqueuePosition - dequeuePosition : 0;
+}
 
-static boost::local_time::time_zone_ptr const utc_time_zone( 
-  new boost::local_time::posix_time_zone( "GMT" ) );
+//----------------------------------------------------------------------
+// LogBinaryFormat
+//----------------------------------------------------------------------
 
-LogWorker::LogWorker() : 
-  m_workerIsDone( false )
+const char LogBinaryFormat::magic[8] = 
+  { 'I', 'M', 'L', 'O', 'G', 'B', 'I', 'N' };
+
+static std::uint64_t getLittleEndian( const char* input,
+  std::size_t bytesCount )
 {
-  m_logFileOutputStream.open(m_logFileName, std::ios_base::app);
-  if (!m_logFileOutputStream.good())
+  std::uint64_t value = 0;
+  for ( std::size_t i = 0; i < bytesCount; ++i )
   {
-    throw std::runtime_error("Unable to initialize the Logger!");
-  } 
+    value |= static_cast<std::uint64_t>( 
+      static_cast<unsigned char>( input[i] ) ) << ( 8 * i );
+  }
+  return value;
+}
+
+bool LogBinaryFormat::appendArgumentsText( std::string& output,
+  const char* arguments, std::size_t argumentsLength )
+{
+  // Each argument is rendered just like appendLogArgument() would have.
+  //
+  const char* end = arguments + argumentsLength;
+  while ( arguments < end )
+  {
+    int type = static_cast<unsigned char>( *arguments++ );
+    std::size_t available = static_cast<std::size_t>( end - arguments );
+    if ( type == string_argument )
+    {
+      if ( available < 4 )
+      {
+        return false;
+      }
+      std::uint64_t length = getLittleEndian( arguments, 4 );
+      if ( available - 4 < length )
+      {
+        return false;
+      }
+      output.append( arguments + 4, length );
+      arguments += 4 + length;
+    }
+    else if ( ( type == char_argument ) && ( available >= 1 ) )
+    {
+      output.push_back( *arguments++ );
+    }
+    else if ( ( ( type == signed_argument ) || ( type == unsigned_argument ) )
+      && ( available >= 8 ) )
+    {
+      std::uint64_t value = getLittleEndian( arguments, 8 );
+      output.append( ( type == signed_argument )
+        ? std::to_string( static_cast<std::int64_t>( value ) )
+        : std::to_string( value ) );
+      arguments += 8;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+//----------------------------------------------------------------------
+// LogWorker
+//----------------------------------------------------------------------
+
+const char* const LogWorker::m_logFileName = "server.log";
+
+LogWorker::LogWorker( const LogSinkOptions& sinkOptions ) :
+  m_sinkOptions( sinkOptions ),
+  m_sink( LogSink::create( m_logFileName, sinkOptions ) ),
+  m_logFormat( Logger::TEXT_FORMAT ),
+  m_binaryStreamStarted( false ),
+  m_formattedSecond( -1 ),
+  m_workerIsDone( false ),
+  m_workerIsSleeping( false ),
+  m_commitRequested( false ),
+  m_writtenCount( 0 ),
+  m_committedCount( 0 ),
+  m_reportedDroppedCount( 0 ),
+  m_oldestUncommittedTime( std::chrono::steady_clock::now() ),
+  m_lastSyncTime( std::chrono::steady_clock::now() ),
+  m_errorWritten( false ),
+  m_syncPending( false )
+{
 }
 
 LogWorker::~LogWorker()
 {
-  m_logFileOutputStream.close();
 }
 
-void LogWorker::start()
+void LogWorker::start( LogRing& logRing,
+  const std::atomic<std::uint64_t>& droppedCount )
 {
-  boost::unique_lock<boost::mutex> scoped_lock( m_workerMutex );
-  while ( !m_workerIsDone )
+  for (;;)
   {
-    //std::cout << "Waiting for a message to log...\n";
-    m_conditionVariable.wait(scoped_lock);
-    for ( auto logEntry : m_logQueue )
+    bool isDone = m_workerIsDone;
+
+    std::uint64_t writtenCount = 0;
+    while ( logRing.tryPop( [this]( const LogRecord& logRecord )
+      { 
+        writeRecord( logRecord.logLevel, logRecord.callSiteId, 
+          logRecord.time, logRecord.hasTypedArguments, 
+          logRecord.message.data(), logRecord.message.length() ); 
+      } ) )
+    {
+      ++writtenCount;
+    }
+
+    if ( droppedCount != m_reportedDroppedCount )
     {
-      //std::cout << "Processing message...\n";
-      m_logFileOutputStream << getLogFormattedDateTime() << " | " 
-        << logEntry->getLogLevel() << " | " << logEntry->getFile() 
-        << ":" << logEntry->getLine() << " | " 
-        << logEntry->getMessage() << std::endl;
+      writeDroppedNotice( droppedCount );
     }
-    m_logQueue.clear();
+
+    m_writtenCount += writtenCount;
+    commitIfDue( isDone );
+
+    if ( writtenCount > 0 )
+    {
+      continue;
+    }
+
+    // Checked before draining, so nothing logged before stop() is lost.
+    if ( isDone )
+    {
+      break;
+    }
+
+    // Producers only take the mutex to wake the worker up while it's
+    // sleeping; the timeout covers a wake up racing with falling asleep,
+    // and pending commits and syncs.
+    //
+    boost::unique_lock<boost::mutex> scoped_lock( m_workerMutex );
+    m_workerIsSleeping = true;
+    if ( logRing.empty() && !m_workerIsDone && !m_commitRequested )
+    {
+      m_conditionVariable.timed_wait( scoped_lock,
+        boost::posix_time::milliseconds( getSleepMilliseconds() ) );
+    }
+    m_workerIsSleeping = false;
   }
 }
 
@@ -65,68 +204,285 @@ void LogWorker::stop()
   m_conditionVariable.notify_one();
 }
 
-void LogWorker::enqueueLog( LogEntryPtr pLogEntry )
+void LogWorker::wakeUp()
 {
   boost::unique_lock<boost::mutex> scoped_lock( m_workerMutex );
-  m_logQueue.push_back( pLogEntry );
   m_conditionVariable.notify_one();
 }
 
-std::string LogWorker::getLogFormattedDateTime()
+void LogWorker::requestCommit()
+{
+  m_commitRequested = true;
+  wakeUp();
+}
+
+bool LogWorker::isSleeping() const
+{
+  return m_workerIsSleeping;
+}
+
+void LogWorker::setFormat( int logFormat )
+{
+  m_logFormat = logFormat;
+}
+
+std::uint64_t LogWorker::getCommittedCount() const
 {
-    boost::local_time::local_time_facet *pTimeFacet = 
-      new boost::local_time::local_time_facet();
-    pTimeFacet->set_iso_extended_format();
+  return m_committedCount;
+}
+
+const std::string& LogWorker::getLogFormattedDateTime(
+  std::chrono::system_clock::time_point time )
+{
+  std::time_t second = std::chrono::system_clock::to_time_t( time );
+  if ( second != m_formattedSecond )
+  {
+    m_formattedDateTime = Logger::formatDateTime( second );
+    m_formattedSecond = second;
+  }
+  return m_formattedDateTime;
+}
+
+void LogWorker::writeRecord( int logLevel, std::uint32_t callSiteId,
+  std::chrono::system_clock::time_point time, bool hasTypedArguments,
+  const char* message, std::size_t messageLength )
+{
+  if ( m_sink->rotateIfFull() )
+  {
+    // Every segment holds streams that can be decoded on their own.
+    m_binaryStreamStarted = false;
+  }
+
+  m_recordBuffer.clear();
+  if ( m_logFormat == Logger::BINARY_FORMAT )
+  {
+    writeBinaryRecord( logLevel, callSiteId, time, hasTypedArguments, 
+      message, messageLength );
+  }
+  else
+  {
+    writeTextRecord( logLevel, callSiteId, time, hasTypedArguments, 
+      message, messageLength );
+  }
 
-    boost::posix_time::ptime my_ptime = 
-      boost::posix_time::second_clock::universal_time();
-    boost::local_time::local_date_time now(my_ptime, utc_time_zone);
+  if ( m_sink->getUncommittedBytes() == 0 )
+  {
+    m_oldestUncommittedTime = std::chrono::steady_clock::now();
+  }
+  m_sink->append( m_recordBuffer.data(), m_recordBuffer.length() );
 
-    std::ostringstream date_osstr;
-    date_osstr.imbue(std::locale(date_osstr.getloc(), pTimeFacet));
-    date_osstr << now;
+  if ( logLevel >= Logger::ERROR_LEVEL )
+  {
+    m_errorWritten = true;
+  }
+}
+
+void LogWorker::writeTextRecord( int logLevel, std::uint32_t callSiteId,
+  std::chrono::system_clock::time_point time, bool hasTypedArguments,
+  const char* message, std::size_t messageLength )
+{
+  // Only records logged right before switching to text mode are typed.
+  //
+  if ( hasTypedArguments )
+  {
+    m_argumentsText.clear();
+    LogBinaryFormat::appendArgumentsText( m_argumentsText, message, 
+      messageLength );
+    message = m_argumentsText.data();
+    messageLength = m_argumentsText.length();
+  }
 
-    return date_osstr.str();
+  Logger::appendTextLine( m_recordBuffer, 
+    getLogFormattedDateTime( time ), logLevel, 
+    Logger::getCallSite( callSiteId ), message, messageLength );
 }
 
+void LogWorker::writeBinaryRecord( int logLevel, std::uint32_t callSiteId,
+  std::chrono::system_clock::time_point time, bool hasTypedArguments,
+  const char* message, std::size_t messageLength )
+{
+  if ( !m_binaryStreamStarted )
+  {
+    m_recordBuffer.append( LogBinaryFormat::magic, 
+      sizeof( LogBinaryFormat::magic ) );
+    LogBinaryFormat::putInteger( m_recordBuffer, 
+      LogBinaryFormat::version, 4 );
+    m_definedCallSites.assign( Logger::max_call_sites, false );
+    m_binaryStreamStarted = true;
+  }
+
+  if ( !m_definedCallSites[callSiteId] )
+  {
+    const LogCallSite& callSite = Logger::getCallSite( callSiteId );
+    std::size_t fileLength = std::strlen( callSite.file );
+    LogBinaryFormat::putInteger( m_recordBuffer, 
+      LogBinaryFormat::call_site_record, 1 );
+    LogBinaryFormat::putInteger( m_recordBuffer, callSiteId, 4 );
+    LogBinaryFormat::putInteger( m_recordBuffer, callSite.logLevel, 1 );
+    LogBinaryFormat::putInteger( m_recordBuffer, callSite.line, 4 );
+    LogBinaryFormat::putInteger( m_recordBuffer, fileLength, 2 );
+    m_recordBuffer.append( callSite.file, fileLength );
+    m_definedCallSites[callSiteId] = true;
+  }
+
+  std::uint64_t ticks = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    time.time_since_epoch() ).count();
+  LogBinaryFormat::putInteger( m_recordBuffer, 
+    LogBinaryFormat::entry_record, 1 );
+  LogBinaryFormat::putInteger( m_recordBuffer, callSiteId, 4 );
+  LogBinaryFormat::putInteger( m_recordBuffer, logLevel, 1 );
+  LogBinaryFormat::putInteger( m_recordBuffer, ticks, 8 );
+  if ( hasTypedArguments )
+  {
+    LogBinaryFormat::putInteger( m_recordBuffer, messageLength, 4 );
+    m_recordBuffer.append( message, messageLength );
+  }
+  else
+  {
+    // Text already put together goes as a single string argument.
+    LogBinaryFormat::putInteger( m_recordBuffer, 1 + 4 + messageLength, 4 );
+    encodeLogString( m_recordBuffer, message, messageLength );
+  }
+}
+
+void LogWorker::writeDroppedNotice( std::uint64_t droppedCount )
+{
+  static const std::uint32_t callSiteId = 
+    Logger::registerCallSite( Logger::ERROR_LEVEL, __FILE__, __LINE__ );
+
+  std::string notice = std::to_string( droppedCount - m_reportedDroppedCount )
+    + " log records were dropped (log ring full).";
+  writeRecord( Logger::ERROR_LEVEL, callSiteId, 
+    std::chrono::system_clock::now(), false, notice.data(), 
+    notice.length() );
+  m_reportedDroppedCount = droppedCount;
+}
+
+void LogWorker::commitIfDue( bool isDone )
+{
+  // Group commit: records are handed to the OS in large batches, unless
+  // someone is waiting for them (flush() or shutting down) or the sync
+  // mode wants them on the disk now.
+  //
+  std::chrono::steady_clock::time_point now = 
+    std::chrono::steady_clock::now();
+
+  bool durable = false;
+  if ( isDone )
+  {
+    durable = ( m_sinkOptions.syncMode != LogSinkOptions::SYNC_NONE );
+  }
+  else if ( m_sinkOptions.syncMode == LogSinkOptions::SYNC_ON_ERROR )
+  {
+    durable = m_errorWritten;
+  }
+  else if ( m_sinkOptions.syncMode == LogSinkOptions::SYNC_PERIODIC )
+  {
+    durable = m_syncPending && ( now - m_lastSyncTime >= 
+      std::chrono::milliseconds( m_sinkOptions.syncIntervalMilliseconds ) );
+  }
+
+  std::size_t uncommittedBytes = m_sink->getUncommittedBytes();
+  bool commitRequested = m_commitRequested.exchange( false );
+  bool isDue = isDone || durable || ( ( uncommittedBytes > 0 )
+    && ( commitRequested || ( uncommittedBytes >= m_sinkOptions.commitBytes )
+    || ( now - m_oldestUncommittedTime >= std::chrono::milliseconds( 
+      m_sinkOptions.commitIntervalMilliseconds ) ) ) );
+  if ( !isDue )
+  {
+    if ( commitRequested )
+    {
+      // Nothing left to commit, but flush() is waiting on the count.
+      m_committedCount = m_writtenCount;
+    }
+    return;
+  }
+
+  m_sink->commit( durable );
+  m_committedCount = m_writtenCount;
+
+  if ( durable )
+  {
+    m_lastSyncTime = now;
+    m_syncPending = false;
+    m_errorWritten = false;
+  }
+  else if ( uncommittedBytes > 0 )
+  {
+    m_syncPending = true;
+  }
+}
+
+unsigned int LogWorker::getSleepMilliseconds() const
+{
+  // Long enough not to spin, short enough to commit and sync on time.
+  //
+  std::chrono::steady_clock::duration sleepTime = 
+    std::chrono::milliseconds( 100 );
+  std::chrono::steady_clock::time_point now = 
+    std::chrono::steady_clock::now();
+
+  if ( m_sink->getUncommittedBytes() > 0 )
+  {
+    sleepTime = std::min( sleepTime, m_oldestUncommittedTime + 
+      std::chrono::milliseconds( m_sinkOptions.commitIntervalMilliseconds )
+      - now );
+  }
+  if ( m_syncPending 
+    && ( m_sinkOptions.syncMode == LogSinkOptions::SYNC_PERIODIC ) )
+  {
+    sleepTime = std::min( sleepTime, m_lastSyncTime + 
+      std::chrono::milliseconds( m_sinkOptions.syncIntervalMilliseconds )
+      - now );
+  }
+
+  std::chrono::milliseconds::rep sleepMilliseconds = 
+    std::chrono::duration_cast<std::chrono::milliseconds>( sleepTime ).count();
+  return ( sleepMilliseconds < 1 ) ? 1 : sleepMilliseconds;
+}
 
 //----------------------------------------------------------------------
 // Logger
 //----------------------------------------------------------------------
 
-
-const std::string Logger::TRACE_LEVEL = "TRACE";
-const std::string Logger::DEBUG_LEVEL = "DEBUG";
-const std::string Logger::INFO_LEVEL = "INFO";
-const std::string Logger::ERROR_LEVEL = "ERROR";
-
 Logger* Logger::m_pInstance = nullptr;
 
-boost::mutex Logger::sMutex;
+// Id 0 is where call sites go once the table is full.
+LogCallSite Logger::sCallSites[Logger::max_call_sites] = 
+  { { Logger::INFO_LEVEL, "(unregistered)", 0 } };
+std::atomic<std::uint32_t> Logger::sCallSitesCount( 1 );
+boost::mutex Logger::sCallSitesMutex;
+LogSinkOptions Logger::sSinkOptions;
+std::atomic<int> Logger::sLevelThreshold( Logger::TRACE_LEVEL );
 
 //----------------------------------------------------------------------
 // Constructor
 //----------------------------------------------------------------------
 
 Logger& Logger::instance()
+{
+  // Initialized once (thread-safely) on first use; from then on this is
+  // just a read.
+  static Logger* pInstance = createInstance();
+  return *pInstance;
+}
+
+Logger* Logger::createInstance()
 {
   static Cleanup cleanup;
+  m_pInstance = new Logger();
+  return m_pInstance;
+}
 
-  boost::unique_lock<boost::mutex> scoped_lock( sMutex );
+Logger::Cleanup::~Cleanup()
+{
   if (m_pInstance == nullptr)
   {
-    m_pInstance = new Logger();
+    return;
   }
 
-  m_pInstance->m_logWorkerThread = 
-    boost::thread([&](){ m_pInstance->m_logWorker.start(); });
-  
-  return *m_pInstance;
-}
-
-Logger::Cleanup::~Cleanup()
-{
-  boost::unique_lock<boost::mutex> scoped_lock( sMutex );
+  // The worker drains the ring before leaving, so everything logged so far
+  // makes it to the file.
   m_pInstance->m_logWorker.stop();
   m_pInstance->m_logWorkerThread.join();
   delete Logger::m_pInstance;
@@ -137,33 +493,170 @@ Logger::~Logger()
 {
 }
 
-Logger::Logger()
+Logger::Logger() :
+  m_logRing( ring_capacity ),
+  m_logWorker( sSinkOptions ),
+  m_overflowPolicy( OVERFLOW_DROP ),
+  m_logFormat( TEXT_FORMAT ),
+  m_enqueuedCount( 0 ),
+  m_droppedCount( 0 ),
+  m_evictedCount( 0 )
 {
+  m_logWorkerThread = boost::thread(
+    [this](){ m_logWorker.start( m_logRing, m_droppedCount ); });
 }
 
 //----------------------------------------------------------------------
 // Public methods.
 //----------------------------------------------------------------------
 
-void Logger::log(const string& logLevel, const std::string& file, 
-  const int& line, const string& message)
+const char* Logger::getLevelName( int logLevel )
+{
+  static const char* const levelNames[] =
+    { "TRACE", "DEBUG", "INFO", "ERROR" };
+  if ( ( logLevel < TRACE_LEVEL ) || ( logLevel > ERROR_LEVEL ) )
+  {
+    return "UNKNOWN";
+  }
+  return levelNames[logLevel];
+}
+
+std::uint32_t Logger::registerCallSite( LogLevel logLevel, const char* file,
+  int line )
+{
+  boost::unique_lock<boost::mutex> scoped_lock( sCallSitesMutex );
+  std::uint32_t callSiteId = sCallSitesCount;
+  if ( callSiteId == max_call_sites )
+  {
+    return 0;
+  }
+
+  sCallSites[callSiteId].logLevel = logLevel;
+  sCallSites[callSiteId].file = file;
+  sCallSites[callSiteId].line = line;
+  // Published after it's filled in, for lookups that take no lock.
+  sCallSitesCount.store( callSiteId + 1, std::memory_order_release );
+  return callSiteId;
+}
+
+const LogCallSite& Logger::getCallSite( std::uint32_t callSiteId )
+{
+  if ( callSiteId >= sCallSitesCount.load( std::memory_order_acquire ) )
+  {
+    return sCallSites[0];
+  }
+  return sCallSites[callSiteId];
+}
+
+std::string Logger::formatDateTime( std::time_t seconds )
+{
+  std::tm dateTime;
+  gmtime_r( &seconds, &dateTime );
+
+  // Room for the widest int in every field, so nothing is ever cut off 
+  // (though only years past 9999 would need more than 26 characters).
+  //
+  char formatted[80];
+  std::snprintf( formatted, sizeof( formatted ),
+    "%04d-%02d-%02d %02d:%02d:%02d+00:00", dateTime.tm_year + 1900,
+    dateTime.tm_mon + 1, dateTime.tm_mday, dateTime.tm_hour,
+    dateTime.tm_min, dateTime.tm_sec );
+  return formatted;
+}
+
+void Logger::appendTextLine( std::string& output,
+  const std::string& dateTime, int logLevel, const LogCallSite& callSite,
+  const char* message, std::size_t messageLength )
+{
+  char line[16];
+  int lineLength = std::snprintf( line, sizeof( line ), "%d", callSite.line );
+
+  output.append( dateTime ).append( " | " ).append( 
+    getLevelName( logLevel ) ).append( " | " ).append( callSite.file ).append(
+    ":" ).append( line, lineLength ).append( " | " ).append( message,
+    messageLength ).append( 1, '\n' );
+}
+
+bool Logger::setSinkOptions( const LogSinkOptions& sinkOptions )
+{
+  if ( m_pInstance != nullptr )
+  {
+    return false;
+  }
+
+  sSinkOptions = sinkOptions;
+  return true;
+}
+
+void Logger::setLevel( LogLevel logLevel )
+{
+  sLevelThreshold = logLevel;
+}
+
+void Logger::flush()
+{
+  std::uint64_t enqueuedCount = m_enqueuedCount;
+  while ( m_logWorker.getCommittedCount() + m_evictedCount < enqueuedCount )
+  {
+    m_logWorker.requestCommit();
+    boost::this_thread::sleep( boost::posix_time::milliseconds( 1 ) );
+  }
+}
+
+void Logger::setOverflowPolicy( OverflowPolicy overflowPolicy )
+{
+  m_overflowPolicy = overflowPolicy;
+}
+
+void Logger::setFormat( LogFormat logFormat )
+{
+  m_logFormat = logFormat;
+  m_logWorker.setFormat( logFormat );
+}
+
+std::uint64_t Logger::getDroppedCount() const
+{
+  return m_droppedCount;
+}
+
+std::size_t Logger::getQueueDepth() const
 {
-  boost::unique_lock<boost::mutex> scoped_lock( sMutex );
-  logImpl(logLevel, file, line, message);
+  return m_logRing.size();
 }
 
 //----------------------------------------------------------------------
 // Private methods.
 //----------------------------------------------------------------------
 
-void Logger::logImpl(const std::string& logLevel, const std::string& file, 
-    const int& line, const std::string& message)
+bool Logger::makeRoom()
 {
-  //boost::posix_time::time_facet tf(1);
-  //tf.set_iso_extended_format();
-  //locale loc = locale(locale("pt_BR"), tf);
-  //cout.imbue(loc)
-  m_pInstance->m_logWorker.enqueueLog( 
-    std::make_shared<LogEntry>( logLevel, file, line, message ) );
+  int overflowPolicy = m_overflowPolicy;
+  if ( overflowPolicy == OVERFLOW_DROP )
+  {
+    ++m_droppedCount;
+    return false;
+  }
+  else if ( overflowPolicy == OVERFLOW_DROP_OLDEST )
+  {
+    if ( m_logRing.tryPop( []( const LogRecord& ) {} ) )
+    {
+      ++m_evictedCount;
+      ++m_droppedCount;
+    }
+  }
+  else
+  {
+    m_logWorker.wakeUp();
+    boost::this_thread::yield();
+  }
+  return true;
 }
 
+void Logger::onRecordEnqueued()
+{
+  ++m_enqueuedCount;
+  if ( m_logWorker.isSleeping() )
+  {
+    m_logWorker.wakeUp();
+  }
+}
@@ -8,61 +8,133 @@
 #ifndef IM_LOGGER_H
 #define IM_LOGGER_H
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
 #include <stdexcept>
 #include <iostream>
-#include <fstream>
+#include <memory>
 #include <vector>
-#include <deque>
 #include <string>
+#include <type_traits>
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <boost/utility/string_view.hpp>
+#include "log_sink.h"
+
+// Lowest level compiled in: 0 (TRACE), 1 (DEBUG), 2 (INFO) or 3 (ERROR).
+// Statements below it are removed by the preprocessor, arguments and all.
+//
+#ifndef IM_LOG_MIN_LEVEL
+#define IM_LOG_MIN_LEVEL 0
+#endif
+
+//----------------------------------------------------------------------
+// LogRecord
+//----------------------------------------------------------------------
+
+// Where a record was logged from. Each LOG_* statement registers its call
+// site once and then only passes its id around.
+//
+struct LogCallSite
+{
+  int logLevel;
+  const char* file;
+  int line;
+};
+
+// One slot of the log ring. Slots are reused, so "message" keeps its
+// capacity and, once warmed up, logging allocates nothing.
+//
+struct LogRecord
+{
+  std::atomic<std::size_t> sequence;
+  int logLevel;
+  std::uint32_t callSiteId;
+  std::chrono::system_clock::time_point time;
+  // The arguments encoded as in binary logs (see LogBinaryFormat) when
+  // "hasTypedArguments", their text otherwise.
+  bool hasTypedArguments;
+  std::string message;
+};
 
 //----------------------------------------------------------------------
-// LogEntry
+// LogBinaryFormat
 //----------------------------------------------------------------------
 
-class LogEntry
+// Layout of binary logs, shared with im_logdecode. Every run of the
+// server starts a stream (the magic and the version) and then appends
+// records, all integers little-endian:
+//
+//   call site:  u8 kind (1), u32 call site id, u8 level, u32 line,
+//               u16 file length, file
+//   entry:      u8 kind (2), u32 call site id, u8 level,
+//               u64 nanoseconds since the epoch, u32 arguments length,
+//               arguments
+//   argument:   u8 type, then u32 length and the bytes of a string, the
+//               u8 of a character, or the 64 bits of an integer
+//
+// Arguments are stored as the producer passed them, so the text is only
+// put together when the log is decoded. Version 1 entries held the text
+// of the message instead.
+//
+// A call site is defined in the stream before its first entry, so each
+// stream can be decoded on its own.
+//
+struct LogBinaryFormat
+{
+  static const char magic[8];
+  enum { version = 2 };
+  enum { text_message_version = 1 };
+  enum { call_site_record = 1, entry_record = 2 };
+  enum { string_argument = 1, char_argument = 2, signed_argument = 3,
+    unsigned_argument = 4 };
+
+  static void putInteger( std::string& output, std::uint64_t value,
+    std::size_t bytesCount );
+  // Appends the text of encoded "arguments"; false if they're malformed.
+  static bool appendArgumentsText( std::string& output,
+    const char* arguments, std::size_t argumentsLength );
+};
+
+//----------------------------------------------------------------------
+// LogRing
+//----------------------------------------------------------------------
+
+// Bounded lock-free multi-producer queue of log records (D. Vyukov's
+// bounded MPMC queue). Any thread may also consume, which is what lets a
+// producer discard the oldest record when the ring is full.
+//
+class LogRing
 {
   public:
-    LogEntry(const std::string& logLevel, const std::string& file, 
-      const int& line, const std::string& message) : 
-      logLevel_(logLevel),
-      file_(file),
-      line_(line),
-      message_(message)
-    {
-    }
+    explicit LogRing( std::size_t capacity );
 
-    std::string getLogLevel() const
-    {
-      return logLevel_;
-    }
+    // Fills the next free slot through "fill" (called with the slot, which
+    // is owned by the caller until it returns). False when full.
+    template <class Fill>
+    bool tryPush( Fill fill );
 
-    std::string getFile() const
-    {
-      return file_;
-    }
+    // Hands the oldest record to "consume", then frees its slot. False
+    // when empty.
+    template <class Consume>
+    bool tryPop( Consume consume );
 
-    int getLine() const
-    {
-      return line_;
-    }
+    bool empty() const;
+    // Records pushed and not popped yet; only a hint while others push or
+    // pop.
+    std::size_t size() const;
 
-    std::string getMessage() const
-    {
-      return message_;
-    }
-  
   private:
-    std::string logLevel_;
-    std::string file_;
-    int line_;
-    std::string message_;
+    std::vector<LogRecord> m_records;
+    std::size_t m_mask;
+    std::atomic<std::size_t> m_enqueuePosition;
+    std::atomic<std::size_t> m_dequeuePosition;
 };
 
-typedef std::shared_ptr<LogEntry> LogEntryPtr;
-
 //----------------------------------------------------------------------
 // LogWorker
 //----------------------------------------------------------------------
@@ -70,23 +142,70 @@ typedef std::shared_ptr<LogEntry> LogEntryPtr;
 class LogWorker
 {
   public:
-    LogWorker();
+    explicit LogWorker( const LogSinkOptions& sinkOptions );
     ~LogWorker();
 
-    void start();
+    // Runs until stop(), writing everything pushed to "logRing" and 
+    // reporting records the producers had to drop.
+    void start( LogRing& logRing, 
+      const std::atomic<std::uint64_t>& droppedCount );
     void stop();
-    void enqueueLog( LogEntryPtr pLogEntry );
-  
+    void wakeUp();
+    // Commits whatever was written without waiting for the group to fill.
+    void requestCommit();
+    bool isSleeping() const;
+    void setFormat( int logFormat );
+
+    // Records handed to the OS by the last commit.
+    std::uint64_t getCommittedCount() const;
+
   protected:
-    std::string getLogFormattedDateTime();
+    const std::string& getLogFormattedDateTime(
+      std::chrono::system_clock::time_point time );
+
+  private:
+    void writeRecord( int logLevel, std::uint32_t callSiteId,
+      std::chrono::system_clock::time_point time, bool hasTypedArguments,
+      const char* message, std::size_t messageLength );
+    void writeTextRecord( int logLevel, std::uint32_t callSiteId,
+      std::chrono::system_clock::time_point time, bool hasTypedArguments,
+      const char* message, std::size_t messageLength );
+    void writeBinaryRecord( int logLevel, std::uint32_t callSiteId,
+      std::chrono::system_clock::time_point time, bool hasTypedArguments,
+      const char* message, std::size_t messageLength );
+    void writeDroppedNotice( std::uint64_t droppedCount );
+    void commitIfDue( bool isDone );
+    unsigned int getSleepMilliseconds() const;
 
   private:
     static const char* const m_logFileName;
-    std::ofstream m_logFileOutputStream;
-    bool m_workerIsDone;
+    const LogSinkOptions m_sinkOptions;
+    std::unique_ptr<LogSink> m_sink;
+    // Each record is rendered here, then appended to the sink at once.
+    std::string m_recordBuffer;
+    // Text of typed arguments, for records written in text mode.
+    std::string m_argumentsText;
+    std::atomic<int> m_logFormat;
+    // Binary stream state: whether its header was written, and which
+    // call sites it already defines.
+    bool m_binaryStreamStarted;
+    std::vector<bool> m_definedCallSites;
+    // Text timestamps only change once a second.
+    std::time_t m_formattedSecond;
+    std::string m_formattedDateTime;
+    std::atomic<bool> m_workerIsDone;
+    std::atomic<bool> m_workerIsSleeping;
+    std::atomic<bool> m_commitRequested;
+    std::uint64_t m_writtenCount;
+    std::atomic<std::uint64_t> m_committedCount;
+    std::uint64_t m_reportedDroppedCount;
+    // Group commit and sync state.
+    std::chrono::steady_clock::time_point m_oldestUncommittedTime;
+    std::chrono::steady_clock::time_point m_lastSyncTime;
+    bool m_errorWritten;
+    bool m_syncPending;
     boost::mutex m_workerMutex;
     boost::condition_variable m_conditionVariable;
-    std::deque<LogEntryPtr> m_logQueue;
 };
 
 //----------------------------------------------------------------------
@@ -96,15 +215,76 @@ class LogWorker
 class Logger
 {
 public:
-  static const std::string TRACE_LEVEL;
-  static const std::string DEBUG_LEVEL;
-  static const std::string INFO_LEVEL;
-  static const std::string ERROR_LEVEL;
+  enum LogLevel {
+    TRACE_LEVEL = 0,
+    DEBUG_LEVEL,
+    INFO_LEVEL,
+    ERROR_LEVEL
+  };
+
+  // What a producer does when the ring is full.
+  //
+  enum OverflowPolicy {
+    OVERFLOW_BLOCK,       // wait for the worker to make room
+    OVERFLOW_DROP,        // discard the new record
+    OVERFLOW_DROP_OLDEST  // discard the oldest queued record
+  };
+
+  enum LogFormat {
+    TEXT_FORMAT,
+    BINARY_FORMAT
+  };
+
+  enum { ring_capacity = 8192 };
+  enum { max_call_sites = 4096 };
 
   static Logger& instance();
+  static const char* getLevelName( int logLevel );
+
+  // Call sites are registered once per LOG_* statement (see the macros) 
+  // and never removed. Ids are dense; looking one up takes no lock.
+  //
+  static std::uint32_t registerCallSite( LogLevel logLevel, const char* file,
+    int line );
+  static const LogCallSite& getCallSite( std::uint32_t callSiteId );
+
+  // Text rendering of a record, the same for the log written in text mode
+  // and for binary logs decoded by im_logdecode.
+  //
+  static std::string formatDateTime( std::time_t seconds );
+  static void appendTextLine( std::string& output,
+    const std::string& dateTime, int logLevel, const LogCallSite& callSite,
+    const char* message, std::size_t messageLength );
+
+  // Only takes effect if called before the Logger is first used; returns
+  // false otherwise.
+  //
+  static bool setSinkOptions( const LogSinkOptions& sinkOptions );
 
-  void log(const std::string& logLevel, const std::string& file, 
-    const int& line, const std::string& inMessage);
+  // Checked by the LOG_* macros before anything else is done.
+  //
+  static bool isEnabled( LogLevel logLevel );
+  static void setLevel( LogLevel logLevel );
+
+  // The message is the concatenation of "arguments" (strings, characters
+  // and integers), only put together once the record got a ring slot,
+  // right into the slot's string. In binary format the arguments are 
+  // stored typed instead, and only turned into text by im_logdecode.
+  //
+  template <class... Arguments>
+  void log( LogLevel logLevel, std::uint32_t callSiteId,
+    const Arguments&... arguments );
+
+  // Returns once everything logged before the call was handed to the OS.
+  //
+  void flush();
+
+  void setOverflowPolicy( OverflowPolicy overflowPolicy );
+  // Meant to be set before anything is logged.
+  void setFormat( LogFormat logFormat );
+  std::uint64_t getDroppedCount() const;
+  // Records waiting for the worker.
+  std::size_t getQueueDepth() const;
 
 protected:
   static Logger* m_pInstance;
@@ -118,29 +298,306 @@ protected:
       ~Cleanup();
   };
 
-  // Enqueues messages on the worker thread.
+  // Enqueues messages for the worker thread.
   //
-  void logImpl(const std::string& logLevel, const std::string& file, 
-    const int& line, const std::string& inMessage);
+  template <class Fill>
+  void logImpl( Fill fill );
+  // Overflow handling; false when the record has to be given up.
+  bool makeRoom();
+  void onRecordEnqueued();
 
 private:
   Logger();
   virtual ~Logger();
   Logger(const Logger&);
   Logger& operator=(const Logger&);
-  static boost::mutex sMutex;
+  static Logger* createInstance();
+
+  static LogCallSite sCallSites[max_call_sites];
+  static std::atomic<std::uint32_t> sCallSitesCount;
+  static boost::mutex sCallSitesMutex;
+  static LogSinkOptions sSinkOptions;
+  static std::atomic<int> sLevelThreshold;
+
+  LogRing m_logRing;
   LogWorker m_logWorker;
   boost::thread m_logWorkerThread;
+  std::atomic<int> m_overflowPolicy;
+  std::atomic<int> m_logFormat;
+  std::atomic<std::uint64_t> m_enqueuedCount;
+  std::atomic<std::uint64_t> m_droppedCount;
+  // Oldest records discarded by producers, which the worker never sees.
+  std::atomic<std::uint64_t> m_evictedCount;
 };
 
+//----------------------------------------------------------------------
+// Log message arguments.
+//----------------------------------------------------------------------
+
+inline void appendLogArgument( std::string& message,
+  const std::string& argument )
+{
+  message.append( argument );
+}
+
+inline void appendLogArgument( std::string& message,
+  boost::string_view argument )
+{
+  message.append( argument.data(), argument.length() );
+}
+
+inline void appendLogArgument( std::string& message, const char* argument )
+{
+  message.append( argument );
+}
+
+inline void appendLogArgument( std::string& message, char argument )
+{
+  message.push_back( argument );
+}
+
+template <class Integer>
+typename std::enable_if<std::is_integral<Integer>::value>::type
+  appendLogArgument( std::string& message, Integer argument )
+{
+  message.append( std::to_string( argument ) );
+}
+
+inline void appendLogArguments( std::string& )
+{
+}
+
+template <class Argument, class... Arguments>
+void appendLogArguments( std::string& message, const Argument& argument,
+  const Arguments&... arguments )
+{
+  appendLogArgument( message, argument );
+  appendLogArguments( message, arguments... );
+}
+
+// Same arguments, encoded for binary logs.
+//
+inline void encodeLogString( std::string& arguments, const char* argument,
+  std::size_t argumentLength )
+{
+  arguments.push_back( static_cast<char>( LogBinaryFormat::string_argument ) );
+  LogBinaryFormat::putInteger( arguments, argumentLength, 4 );
+  arguments.append( argument, argumentLength );
+}
+
+inline void encodeLogArgument( std::string& arguments,
+  const std::string& argument )
+{
+  encodeLogString( arguments, argument.data(), argument.length() );
+}
+
+inline void encodeLogArgument( std::string& arguments,
+  boost::string_view argument )
+{
+  encodeLogString( arguments, argument.data(), argument.length() );
+}
+
+inline void encodeLogArgument( std::string& arguments, const char* argument )
+{
+  encodeLogString( arguments, argument, std::strlen( argument ) );
+}
+
+inline void encodeLogArgument( std::string& arguments, char argument )
+{
+  arguments.push_back( static_cast<char>( LogBinaryFormat::char_argument ) );
+  arguments.push_back( argument );
+}
+
+template <class Integer>
+typename std::enable_if<std::is_integral<Integer>::value>::type
+  encodeLogArgument( std::string& arguments, Integer argument )
+{
+  // Two's complement, so signed values are read back as they were.
+  arguments.push_back( static_cast<char>( std::is_signed<Integer>::value
+    ? LogBinaryFormat::signed_argument 
+    : LogBinaryFormat::unsigned_argument ) );
+  LogBinaryFormat::putInteger( arguments, 
+    static_cast<std::uint64_t>( argument ), 8 );
+}
+
+inline void encodeLogArguments( std::string& )
+{
+}
+
+template <class Argument, class... Arguments>
+void encodeLogArguments( std::string& arguments, const Argument& argument,
+  const Arguments&... otherArguments )
+{
+  encodeLogArgument( arguments, argument );
+  encodeLogArguments( arguments, otherArguments... );
+}
+
+//----------------------------------------------------------------------
+// LogBinaryFormat, Logger template and inline methods.
+//----------------------------------------------------------------------
+
+inline void LogBinaryFormat::putInteger( std::string& output,
+  std::uint64_t value, std::size_t bytesCount )
+{
+  for ( std::size_t i = 0; i < bytesCount; ++i )
+  {
+    output.push_back( static_cast<char>( ( value >> ( 8 * i ) ) & 0xff ) );
+  }
+}
+
+inline bool Logger::isEnabled( LogLevel logLevel )
+{
+  return logLevel >= sLevelThreshold.load( std::memory_order_relaxed );
+}
+
+template <class... Arguments>
+void Logger::log( LogLevel logLevel, std::uint32_t callSiteId,
+  const Arguments&... arguments )
+{
+  bool hasTypedArguments = 
+    ( m_logFormat.load( std::memory_order_relaxed ) == BINARY_FORMAT );
+  logImpl( [&]( LogRecord& logRecord )
+    {
+      logRecord.logLevel = logLevel;
+      logRecord.callSiteId = callSiteId;
+      logRecord.time = std::chrono::system_clock::now();
+      logRecord.hasTypedArguments = hasTypedArguments;
+      logRecord.message.clear();
+      if ( hasTypedArguments )
+      {
+        encodeLogArguments( logRecord.message, arguments... );
+      }
+      else
+      {
+        appendLogArguments( logRecord.message, arguments... );
+      }
+    } );
+}
+
+template <class Fill>
+void Logger::logImpl( Fill fill )
+{
+  while ( !m_logRing.tryPush( fill ) )
+  {
+    if ( !makeRoom() )
+    {
+      return;
+    }
+  }
+  onRecordEnqueued();
+}
+
+//----------------------------------------------------------------------
+// LogRing template methods.
+//----------------------------------------------------------------------
+
+template <class Fill>
+bool LogRing::tryPush( Fill fill )
+{
+  std::size_t position = m_enqueuePosition.load( std::memory_order_relaxed );
+  for (;;)
+  {
+    LogRecord& record = m_records[position & m_mask];
+    std::size_t sequence = record.sequence.load( std::memory_order_acquire );
+    std::intptr_t difference = static_cast<std::intptr_t>( sequence )
+      - static_cast<std::intptr_t>( position );
+    if ( difference == 0 )
+    {
+      if ( m_enqueuePosition.compare_exchange_weak( position, position + 1,
+        std::memory_order_relaxed ) )
+      {
+        fill( record );
+        record.sequence.store( position + 1, std::memory_order_release );
+        return true;
+      }
+    }
+    else if ( difference < 0 )
+    {
+      return false;
+    }
+    else
+    {
+      position = m_enqueuePosition.load( std::memory_order_relaxed );
+    }
+  }
+}
+
+template <class Consume>
+bool LogRing::tryPop( Consume consume )
+{
+  std::size_t position = m_dequeuePosition.load( std::memory_order_relaxed );
+  for (;;)
+  {
+    LogRecord& record = m_records[position & m_mask];
+    std::size_t sequence = record.sequence.load( std::memory_order_acquire );
+    std::intptr_t difference = static_cast<std::intptr_t>( sequence )
+      - static_cast<std::intptr_t>( position + 1 );
+    if ( difference == 0 )
+    {
+      if ( m_dequeuePosition.compare_exchange_weak( position, position + 1,
+        std::memory_order_relaxed ) )
+      {
+        consume( record );
+        record.sequence.store( position + m_mask + 1,
+          std::memory_order_release );
+        return true;
+      }
+    }
+    else if ( difference < 0 )
+    {
+      return false;
+    }
+    else
+    {
+      position = m_dequeuePosition.load( std::memory_order_relaxed );
+    }
+  }
+}
+
 //----------------------------------------------------------------------
 // MACROS
 //----------------------------------------------------------------------
 
-#define LOG_TRACE( message ) Logger::instance().log( Logger::TRACE_LEVEL, __FILE__, __LINE__, message )
-#define LOG_DEBUG( message ) Logger::instance().log( Logger::DEBUG_LEVEL, __FILE__, __LINE__, message )
-#define LOG_INFO( message ) Logger::instance().log( Logger::INFO_LEVEL, __FILE__, __LINE__, message )
-#define LOG_ERROR( message ) Logger::instance().log( Logger::ERROR_LEVEL, __FILE__, __LINE__, message )
+// Arguments are only evaluated if the level is enabled, like this: 
+// LOG_INFO( "User \"", nickname, "\" has logged in." ). Each statement
+// registers its call site the first time it logs.
+//
+#define LOG_AT_LEVEL( logLevel, ... ) \
+  do \
+  { \
+    if ( Logger::isEnabled( logLevel ) ) \
+    { \
+      static const std::uint32_t logCallSiteId = \
+        Logger::registerCallSite( logLevel, __FILE__, __LINE__ ); \
+      Logger::instance().log( logLevel, logCallSiteId, __VA_ARGS__ ); \
+    } \
+  } while ( false )
+
+#define LOG_DISABLED( ... ) do { } while ( false )
+
+#if IM_LOG_MIN_LEVEL <= 0
+#define LOG_TRACE( ... ) LOG_AT_LEVEL( Logger::TRACE_LEVEL, __VA_ARGS__ )
+#else
+#define LOG_TRACE( ... ) LOG_DISABLED( __VA_ARGS__ )
+#endif
+
+#if IM_LOG_MIN_LEVEL <= 1
+#define LOG_DEBUG( ... ) LOG_AT_LEVEL( Logger::DEBUG_LEVEL, __VA_ARGS__ )
+#else
+#define LOG_DEBUG( ... ) LOG_DISABLED( __VA_ARGS__ )
+#endif
+
+#if IM_LOG_MIN_LEVEL <= 2
+#define LOG_INFO( ... ) LOG_AT_LEVEL( Logger::INFO_LEVEL, __VA_ARGS__ )
+#else
+#define LOG_INFO( ... ) LOG_DISABLED( __VA_ARGS__ )
+#endif
+
+#if IM_LOG_MIN_LEVEL <= 3
+#define LOG_ERROR( ... ) LOG_AT_LEVEL( Logger::ERROR_LEVEL, __VA_ARGS__ )
+#else
+#define LOG_ERROR( ... ) LOG_DISABLED( __VA_ARGS__ )
+#endif
 
 #endif // IM_LOGGER_H
 
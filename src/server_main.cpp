@@ -4,15 +4,173 @@
 //
 // Copyright (c) 2018 by Mauro Sergio Ferreira Brasil
 //
-// Based on "chat_server.cpp" with Copyright (c) 2013-2015 by Christopher M. 
+// Based on "chat_server.cpp" with Copyright (c) 2013-2015 by Christopher M.
 // Kohlhoff (chris at kohlhoff dot com)
 //
 
+#include <csignal>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <list>
+#include <memory>
+#include <vector>
 #include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include "im_message_audit.h"
+#include "im_metrics.h"
+#include "im_mailbox.h"
 #include "im_server.h"
+#include "im_session.h"
+#include "im_shard_router.h"
+#include "logger.h"
+
+//----------------------------------------------------------------------
+
+static void print_usage()
+{
+  std::cerr << "Usage: im_server <port> [options]\n"
+    << "Options:\n"
+    << "  --threads <count>  number of threads running the io_service "
+    << "(default: one per core)\n"
+    << "  --shards <count>   run <count> independent shards, each with its "
+    << "own thread,\n"
+    << "                     io_service and acceptor (overrides --threads)\n"
+    << "  --write-batch-bytes <bytes>    most bytes gathered into a single "
+    << "write\n"
+    << "  --write-batch-frames <count>   most frames gathered into a single "
+    << "write\n"
+    << "  --write-queue-messages <count> most messages queued for a client "
+    << "(default: 4096)\n"
+    << "  --write-queue-bytes <bytes>    most bytes queued for a client "
+    << "(default: 4 MiB)\n"
+    << "  --slow-consumer <policy>       what to do when a client's queue is "
+    << "full: drop-newest,\n"
+    << "                                 drop-oldest-broadcast (default) or "
+    << "disconnect\n"
+    << "  --max-protocol <version>       highest protocol accepted on connect "
+    << "(1: legacy\n"
+    << "                                 text headers, 2: binary headers; "
+    << "default: 2)\n"
+    << "  --log-overflow <policy>        what to do when logging faster than "
+    << "the log is\n"
+    << "                                 written: block, drop (default) or "
+    << "drop-oldest\n"
+    << "  --audit <mode>                 what is logged of relayed messages: "
+    << "full (default),\n"
+    << "                                 metadata (no body) or off\n"
+    << "  --audit-sample <n>             log one in <n> messages of each "
+    << "sender\n"
+    << "  --audit-rate <count>           log at most <count> messages per "
+    << "second of each\n"
+    << "                                 sender\n"
+    << "  --log-level <level>            lowest level logged: trace (default), "
+    << "debug, info\n"
+    << "                                 or error\n"
+    << "  --log-format <format>          text (default) or binary (read with "
+    << "im_logdecode)\n"
+    << "  --log-sink <sink>              buffered (default) or mmap\n"
+    << "  --log-segment-bytes <bytes>    size at which the log is rotated "
+    << "(default: 64 MiB,\n"
+    << "                                 0: never)\n"
+    << "  --log-segments <count>         rotated segments kept (default: 8)\n"
+    << "  --log-fsync <mode>             none (default), periodic or error "
+    << "(as soon as\n"
+    << "                                 an error is logged)\n"
+    << "  --stats-interval <seconds>     print the server statistics (also "
+    << "asked for with\n"
+    << "                                 the client's \"stats\" command) "
+    << "every <seconds>\n"
+    << "  --mailbox <directory>          keep messages to known users that "
+    << "are offline\n"
+    << "                                 there, and deliver them on login\n"
+    << "  --mailbox-segment-bytes <bytes>\n"
+    << "                                 size of each mailbox segment "
+    << "(default: 64 MiB)\n"
+    << "  --mailbox-commit-ms <ms>       longest a stored message waits to be "
+    << "forced to\n"
+    << "                                 the disk (default: 5)\n";
+}
+
+//----------------------------------------------------------------------
+
+// Prints the statistics every "interval_seconds", as a single write so 
+// other output doesn't get in between.
+//
+static void schedule_stats_dump(boost::asio::steady_timer& timer, 
+  double interval_seconds)
+{
+  timer.expires_after(std::chrono::milliseconds(
+    static_cast<long long>(interval_seconds * 1000)));
+  timer.async_wait(
+    [&timer, interval_seconds](const boost::system::error_code& ec)
+    {
+      if (ec)
+      {
+        return;
+      }
+
+      std::string stats_dump = "Server statistics:\n" 
+        + im_metrics::get_snapshot_text();
+      std::cout << stats_dump;
+      std::cout.flush();
+      schedule_stats_dump(timer, interval_seconds);
+    });
+}
+
+//----------------------------------------------------------------------
+
+static void run_shards(const tcp::endpoint& endpoint, std::size_t shards_count, 
+  double stats_interval_seconds, im_mailbox* mailbox_ptr)
+{
+  std::vector<std::unique_ptr<boost::asio::io_service>> io_services;
+  std::vector<std::unique_ptr<im_server>> servers;
+  im_shard_router shard_router(shards_count);
+
+  for (std::size_t i = 0; i < shards_count; ++i)
+  {
+    io_services.emplace_back(new boost::asio::io_service());
+    servers.emplace_back(new im_server(*io_services.back(), endpoint, true));
+    servers.back()->get_session_manager()->set_shard(&shard_router, i);
+    servers.back()->get_session_manager()->set_mailbox(mailbox_ptr);
+    shard_router.add_shard(i, *io_services.back(),
+      servers.back()->get_session_manager());
+  }
+
+  // Stopping every shard lets main() return, so the log gets flushed.
+  //
+  boost::asio::signal_set signals(*io_services[0], SIGINT, SIGTERM);
+  signals.async_wait(
+    [&io_services](const boost::system::error_code&, int)
+    {
+      for (auto& io_service_ptr : io_services)
+      {
+        io_service_ptr->stop();
+      }
+    });
+
+  boost::asio::steady_timer stats_timer(*io_services[0]);
+  if (stats_interval_seconds > 0)
+  {
+    schedule_stats_dump(stats_timer, stats_interval_seconds);
+  }
+
+  boost::thread_group shard_threads;
+  for (std::size_t i = 1; i < shards_count; ++i)
+  {
+    boost::asio::io_service* io_service_ptr = io_services[i].get();
+    shard_threads.create_thread([io_service_ptr](){ io_service_ptr->run(); });
+  }
+
+  io_services[0]->run();
+  shard_threads.join_all();
+
+  // Its last acknowledges are posted to the shards' io_services.
+  if (mailbox_ptr)
+  {
+    mailbox_ptr->stop();
+  }
+}
 
 //----------------------------------------------------------------------
 
@@ -20,18 +178,363 @@ int main(int argc, char* argv[])
 {
   try
   {
-    if (argc != 2)
+    if (argc < 2)
     {
-      std::cerr << "Usage: im_server <port>\n";
+      print_usage();
       return 1;
     }
 
-    boost::asio::io_service io_service;
+    std::size_t threads_count = boost::thread::hardware_concurrency();
+    std::size_t shards_count = 0;
+    std::size_t write_batch_bytes = im_session::default_max_write_batch_bytes;
+    std::size_t write_batch_frames = im_session::default_max_write_batch_frames;
+    std::size_t write_queue_messages = 
+      im_session::default_max_write_queue_messages;
+    std::size_t write_queue_bytes = im_session::default_max_write_queue_bytes;
+    int write_queue_policy = im_session::drop_oldest_broadcast;
+    int max_protocol_version = im_message::BINARY_PROTOCOL;
+    Logger::OverflowPolicy log_overflow_policy = Logger::OVERFLOW_DROP;
+    Logger::LogLevel log_level = Logger::TRACE_LEVEL;
+    Logger::LogFormat log_format = Logger::TEXT_FORMAT;
+    LogSinkOptions log_sink_options;
+    im_message_audit::options audit_options;
+    double stats_interval_seconds = 0;
+    im_mailbox::options mailbox_options;
+    bool is_mailbox_enabled = false;
+
+    for (int i = 2; i < argc; ++i)
+    {
+      if ( ( std::strcmp(argv[i], "--threads") == 0 ) && ( i + 1 < argc ) )
+      {
+        threads_count = std::atoi(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--shards") == 0 ) && ( i + 1 < argc ) )
+      {
+        shards_count = std::atoi(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--write-batch-bytes") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        write_batch_bytes = std::atoi(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--write-batch-frames") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        write_batch_frames = std::atoi(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--write-queue-messages") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        write_queue_messages = std::atoi(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--write-queue-bytes") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        write_queue_bytes = std::strtoull(argv[++i], nullptr, 10);
+      }
+      else if ( ( std::strcmp(argv[i], "--slow-consumer") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        const char* policy = argv[++i];
+        if (std::strcmp(policy, "drop-newest") == 0)
+        {
+          write_queue_policy = im_session::drop_newest;
+        }
+        else if (std::strcmp(policy, "drop-oldest-broadcast") == 0)
+        {
+          write_queue_policy = im_session::drop_oldest_broadcast;
+        }
+        else if (std::strcmp(policy, "disconnect") == 0)
+        {
+          write_queue_policy = im_session::disconnect_consumer;
+        }
+        else
+        {
+          print_usage();
+          return 1;
+        }
+      }
+      else if ( ( std::strcmp(argv[i], "--max-protocol") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        max_protocol_version = std::atoi(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--log-overflow") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        const char* policy = argv[++i];
+        if (std::strcmp(policy, "block") == 0)
+        {
+          log_overflow_policy = Logger::OVERFLOW_BLOCK;
+        }
+        else if (std::strcmp(policy, "drop") == 0)
+        {
+          log_overflow_policy = Logger::OVERFLOW_DROP;
+        }
+        else if (std::strcmp(policy, "drop-oldest") == 0)
+        {
+          log_overflow_policy = Logger::OVERFLOW_DROP_OLDEST;
+        }
+        else
+        {
+          print_usage();
+          return 1;
+        }
+      }
+      else if ( ( std::strcmp(argv[i], "--audit") == 0 ) && ( i + 1 < argc ) )
+      {
+        const char* mode = argv[++i];
+        if (std::strcmp(mode, "full") == 0)
+        {
+          audit_options.mode = im_message_audit::audit_full;
+        }
+        else if (std::strcmp(mode, "metadata") == 0)
+        {
+          audit_options.mode = im_message_audit::audit_metadata;
+        }
+        else if (std::strcmp(mode, "off") == 0)
+        {
+          audit_options.mode = im_message_audit::audit_off;
+        }
+        else
+        {
+          print_usage();
+          return 1;
+        }
+      }
+      else if ( ( std::strcmp(argv[i], "--audit-sample") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        audit_options.sample_every = std::atoi(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--audit-rate") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        audit_options.sender_rate = std::atof(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--log-level") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        const char* level = argv[++i];
+        if (std::strcmp(level, "trace") == 0)
+        {
+          log_level = Logger::TRACE_LEVEL;
+        }
+        else if (std::strcmp(level, "debug") == 0)
+        {
+          log_level = Logger::DEBUG_LEVEL;
+        }
+        else if (std::strcmp(level, "info") == 0)
+        {
+          log_level = Logger::INFO_LEVEL;
+        }
+        else if (std::strcmp(level, "error") == 0)
+        {
+          log_level = Logger::ERROR_LEVEL;
+        }
+        else
+        {
+          print_usage();
+          return 1;
+        }
+      }
+      else if ( ( std::strcmp(argv[i], "--log-format") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        const char* format = argv[++i];
+        if (std::strcmp(format, "text") == 0)
+        {
+          log_format = Logger::TEXT_FORMAT;
+        }
+        else if (std::strcmp(format, "binary") == 0)
+        {
+          log_format = Logger::BINARY_FORMAT;
+        }
+        else
+        {
+          print_usage();
+          return 1;
+        }
+      }
+      else if ( ( std::strcmp(argv[i], "--log-sink") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        const char* sink = argv[++i];
+        if (std::strcmp(sink, "buffered") == 0)
+        {
+          log_sink_options.sinkType = LogSinkOptions::BUFFERED_SINK;
+        }
+        else if (std::strcmp(sink, "mmap") == 0)
+        {
+          log_sink_options.sinkType = LogSinkOptions::MAPPED_SINK;
+        }
+        else
+        {
+          print_usage();
+          return 1;
+        }
+      }
+      else if ( ( std::strcmp(argv[i], "--log-segment-bytes") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        log_sink_options.segmentBytes = std::strtoull(argv[++i], nullptr, 10);
+      }
+      else if ( ( std::strcmp(argv[i], "--log-segments") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        log_sink_options.keptSegments = std::atoi(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--log-fsync") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        const char* mode = argv[++i];
+        if (std::strcmp(mode, "none") == 0)
+        {
+          log_sink_options.syncMode = LogSinkOptions::SYNC_NONE;
+        }
+        else if (std::strcmp(mode, "periodic") == 0)
+        {
+          log_sink_options.syncMode = LogSinkOptions::SYNC_PERIODIC;
+        }
+        else if (std::strcmp(mode, "error") == 0)
+        {
+          log_sink_options.syncMode = LogSinkOptions::SYNC_ON_ERROR;
+        }
+        else
+        {
+          print_usage();
+          return 1;
+        }
+      }
+      else if ( ( std::strcmp(argv[i], "--stats-interval") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        stats_interval_seconds = std::atof(argv[++i]);
+      }
+      else if ( ( std::strcmp(argv[i], "--mailbox") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        mailbox_options.directory = argv[++i];
+        is_mailbox_enabled = true;
+      }
+      else if ( ( std::strcmp(argv[i], "--mailbox-segment-bytes") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        mailbox_options.segment_bytes = std::strtoull(argv[++i], nullptr, 10);
+      }
+      else if ( ( std::strcmp(argv[i], "--mailbox-commit-ms") == 0 ) 
+        && ( i + 1 < argc ) )
+      {
+        mailbox_options.commit_interval_milliseconds = std::atoi(argv[++i]);
+      }
+      else
+      {
+        print_usage();
+        return 1;
+      }
+    }
+
+    if (threads_count < 1)
+    {
+      threads_count = 1;
+    }
+
+    if ( ( max_protocol_version < im_message::LEGACY_PROTOCOL ) 
+      || ( max_protocol_version > im_message::BINARY_PROTOCOL ) )
+    {
+      print_usage();
+      return 1;
+    }
+
+    im_session::set_write_batch_limits(write_batch_bytes, write_batch_frames);
+    im_session::set_max_protocol_version(max_protocol_version);
+    im_session::set_write_queue_limits(write_queue_messages, write_queue_bytes);
+    im_session::set_default_write_queue_policy(write_queue_policy);
+    im_message_audit::set_options(audit_options);
+    Logger::setSinkOptions(log_sink_options);
+    Logger::setLevel(log_level);
+    Logger::instance().setOverflowPolicy(log_overflow_policy);
+    Logger::instance().setFormat(log_format);
+
+    im_metrics::add_gauge("logger_queue_depth", 
+      []() -> std::int64_t { return Logger::instance().getQueueDepth(); });
+    im_metrics::add_gauge("logger_dropped_records", 
+      []() -> std::int64_t { return Logger::instance().getDroppedCount(); });
+
+    // Shared by every shard, and outlives them all.
+    //
+    std::unique_ptr<im_mailbox> mailbox_ptr;
+    if (is_mailbox_enabled)
+    {
+      mailbox_ptr.reset(new im_mailbox(mailbox_options));
+      mailbox_ptr->start();
+
+      im_mailbox* stats_mailbox_ptr = mailbox_ptr.get();
+      im_metrics::add_gauge("mailbox_pending_messages", 
+        [stats_mailbox_ptr]() -> std::int64_t 
+        { return stats_mailbox_ptr->get_statistics().pending_messages; });
+      im_metrics::add_gauge("mailbox_stored_messages", 
+        [stats_mailbox_ptr]() -> std::int64_t 
+        { return stats_mailbox_ptr->get_statistics().stored_messages; });
+      im_metrics::add_gauge("mailbox_delivered_messages", 
+        [stats_mailbox_ptr]() -> std::int64_t 
+        { return stats_mailbox_ptr->get_statistics().delivered_messages; });
+      im_metrics::add_gauge("mailbox_commits", 
+        [stats_mailbox_ptr]() -> std::int64_t 
+        { return stats_mailbox_ptr->get_statistics().commits; });
+      im_metrics::add_gauge("mailbox_compactions", 
+        [stats_mailbox_ptr]() -> std::int64_t 
+        { return stats_mailbox_ptr->get_statistics().compactions; });
+      im_metrics::add_gauge("mailbox_segments", 
+        [stats_mailbox_ptr]() -> std::int64_t 
+        { return stats_mailbox_ptr->get_statistics().segments; });
+    }
 
     tcp::endpoint endpoint(tcp::v4(), std::atoi(argv[1]));
+
+    if (shards_count > 0)
+    {
+      run_shards(endpoint, shards_count, stats_interval_seconds, 
+        mailbox_ptr.get());
+      return 0;
+    }
+
+    boost::asio::io_service io_service;
     im_server im_server(io_service, endpoint);
+    im_server.get_session_manager()->set_mailbox(mailbox_ptr.get());
+
+    // Stopping the io_service lets main() return, so the log gets flushed.
+    //
+    boost::asio::signal_set signals(io_service, SIGINT, SIGTERM);
+    signals.async_wait(
+      [&io_service](const boost::system::error_code&, int)
+      {
+        io_service.stop();
+      });
+
+    boost::asio::steady_timer stats_timer(io_service);
+    if (stats_interval_seconds > 0)
+    {
+      schedule_stats_dump(stats_timer, stats_interval_seconds);
+    }
+
+    // Every thread runs the same io_service. Sessions serialize their own
+    // handlers through a strand, so no further coordination is needed here.
+    //
+    boost::thread_group io_threads;
+    for (std::size_t i = 1; i < threads_count; ++i)
+    {
+      io_threads.create_thread([&io_service](){ io_service.run(); });
+    }
 
     io_service.run();
+    io_threads.join_all();
+
+    // Its last acknowledges are posted to the io_service.
+    if (mailbox_ptr)
+    {
+      mailbox_ptr->stop();
+    }
   }
   catch (std::exception& e)
   {
@@ -40,4 +543,3 @@ int main(int argc, char* argv[])
 
   return 0;
 }
-